@@ -5,64 +5,130 @@
 
 #include <assert.h>
 #include <stdio.h>
+#include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
 #include <stdbool.h>
 
-struct data_vector
+/**
+ * A fixed-capacity ring of messages of elem_size bytes each,
+ * stored inline. The capacity is a power of two, so a position is
+ * found with a mask. The head and the tail only grow and wrap
+ * around the size_t naturally, their difference is the ring's
+ * size.
+ */
+struct data_ring
 {
-	unsigned *data;
-	size_t size;
-	size_t capacity;
+	char *data;
+	size_t elem_size;
+	size_t mask;
+	size_t head;
+	size_t tail;
 };
 
+/**
+ * Create a ring for at least @a size_limit messages.
+ * @retval 0 Success.
+ * @retval -1 The ring doesn't fit into the memory.
+ */
+static int data_ring_create(struct data_ring *ring, size_t size_limit,
+			    size_t elem_size)
+{
+	if (size_limit > SIZE_MAX / 2 + 1)
+		return -1;
+	size_t capacity = 1;
+	while (capacity < size_limit)
+		capacity <<= 1;
+	if (capacity > SIZE_MAX / elem_size)
+		return -1;
+	ring->data = malloc(elem_size * capacity);
+	if (ring->data == NULL)
+		return -1;
+	ring->elem_size = elem_size;
+	ring->mask = capacity - 1;
+	ring->head = 0;
+	ring->tail = 0;
+	return 0;
+}
+
+static size_t data_ring_size(const struct data_ring *ring)
+{
+	return ring->tail - ring->head;
+}
+
+/** Slot of the message at the absolute position @a pos. */
+static void *data_ring_slot(const struct data_ring *ring, size_t pos)
+{
+	return ring->data + (pos & ring->mask) * ring->elem_size;
+}
 
-/** Append @a count messages in @a data to the end of the vector. */
-static void data_vector_append_many(struct data_vector *vector,
-                                    const unsigned *data, size_t count)
+/** Append @a count messages in @a data to the end of the ring. */
+static void data_ring_append_many(struct data_ring *ring,
+				  const void *data, size_t count)
 {
-  if (vector->size + count > vector->capacity) {
-    if (vector->capacity == 0)
-      vector->capacity = 4;
-    else
-      vector->capacity *= 2;
-    if (vector->capacity < vector->size + count)
-      vector->capacity = vector->size + count;
-    vector->data =
-        realloc(vector->data, sizeof(vector->data[0]) * vector->capacity);
-  }
-  memcpy(&vector->data[vector->size], data, sizeof(data[0]) * count);
-  vector->size += count;
+	assert(data_ring_size(ring) + count <= ring->mask + 1);
+	size_t first = ring->mask + 1 - (ring->tail & ring->mask);
+	if (first > count)
+		first = count;
+	size_t first_bytes = first * ring->elem_size;
+	memcpy(data_ring_slot(ring, ring->tail), data, first_bytes);
+	memcpy(ring->data, (const char *)data + first_bytes,
+	       (count - first) * ring->elem_size);
+	ring->tail += count;
 }
 
-/** Append a single message to the vector. */
-static void data_vector_append(struct data_vector *vector, unsigned data)
+/** Append a single message to the ring. */
+static void data_ring_append(struct data_ring *ring, const void *data)
 {
-	data_vector_append_many(vector, &data, 1);
+	assert(data_ring_size(ring) <= ring->mask);
+	void *slot = data_ring_slot(ring, ring->tail++);
+	/* Let the compiler inline the most common copy. */
+	if (ring->elem_size == sizeof(unsigned))
+		memcpy(slot, data, sizeof(unsigned));
+	else
+		memcpy(slot, data, ring->elem_size);
 }
 
-/** Pop @a count of messages into @a data from the head of the vector. */
-static void data_vector_pop_first_many(struct data_vector *vector, unsigned *data, size_t count)
+/** Pop @a count of messages into @a data from the head of the ring. */
+static void data_ring_pop_first_many(struct data_ring *ring, void *data, size_t count)
 {
-	assert(count <= vector->size);
-	memcpy(data, vector->data, sizeof(data[0]) * count);
-	vector->size -= count;
-	memmove(vector->data, &vector->data[count], vector->size * sizeof(vector->data[0]));
+	assert(count <= data_ring_size(ring));
+	size_t first = ring->mask + 1 - (ring->head & ring->mask);
+	if (first > count)
+		first = count;
+	size_t first_bytes = first * ring->elem_size;
+	memcpy(data, data_ring_slot(ring, ring->head), first_bytes);
+	memcpy((char *)data + first_bytes, ring->data,
+	       (count - first) * ring->elem_size);
+	ring->head += count;
 }
 
-/** Pop a single message from the head of the vector. */
-static unsigned data_vector_pop_first(struct data_vector *vector)
+/** Pop a single message from the head of the ring. */
+static void data_ring_pop_first(struct data_ring *ring, void *data)
 {
-	unsigned data = 0;
-	data_vector_pop_first_many(vector, &data, 1);
-	return data;
+	assert(data_ring_size(ring) > 0);
+	void *slot = data_ring_slot(ring, ring->head++);
+	if (ring->elem_size == sizeof(unsigned))
+		memcpy(data, slot, sizeof(unsigned));
+	else
+		memcpy(data, slot, ring->elem_size);
 }
 
-static void data_vector_free(struct data_vector *vector)
+static void data_ring_free(struct data_ring *ring)
 {
- 	free(vector->data);
+	free(ring->data);
 }
 
+/**
+ * Entries of one coroutine waiting in several queues at once, see
+ * coro_bus_select(). Only the first wakeup counts, the other
+ * entries become stale.
+ */
+struct wakeup_group
+{
+	bool is_woken;
+};
+
 /**
  * One coroutine waiting to be woken up in a list of other
  * suspended coros.
@@ -71,6 +137,22 @@ struct wakeup_entry
 {
 	struct rlist base;
 	struct coro *coro;
+	/** How many messages or slots the coroutine wants. */
+	size_t demand;
+	/**
+	 * The waker took the entry out of the queue. Each such
+	 * wakeup stands for a message or a slot, so it must not be
+	 * lost.
+	 */
+	bool is_woken;
+	/**
+	 * Woken by a close of the channel. Its descriptor can be
+	 * already taken by a new channel, so it must not be looked up
+	 * again.
+	 */
+	bool is_closed;
+	/** The group of the entry, or NULL. */
+	struct wakeup_group *group;
 };
 
 /** A queue of suspended coros waiting to be woken up. */
@@ -79,21 +161,85 @@ struct wakeup_queue
     struct rlist coros;
 };
 
-/** Suspend the current coroutine until it is woken up. */
-static void wakeup_queue_suspend(struct wakeup_queue *queue)
+/**
+ * Suspend the current coroutine until it is woken up.
+ * @param demand How many messages or slots it is going to take.
+ * @retval 0 Woken up.
+ * @retval -1 The coroutine is cancelled or the channel is closed,
+ *     the error is set.
+ */
+static int wakeup_queue_suspend(struct wakeup_queue *queue, size_t demand)
 {
 	struct wakeup_entry entry;
 	entry.coro = coro_this();
+	entry.demand = demand;
+	entry.is_woken = false;
+	entry.is_closed = false;
+	entry.group = NULL;
 	rlist_add_tail_entry(&queue->coros, &entry, base);
-	coro_suspend();
+	bool is_woken_up = coro_suspend();
+	if (entry.is_closed) {
+		coro_bus_errno_set(CORO_BUS_ERR_NO_CHANNEL);
+		return -1;
+	}
+	/*
+	 * A woken entry is already unlinked. When both woken and
+	 * cancelled, take the wakeup. The next wait fails on the
+	 * cancel anyway.
+	 */
+	if (entry.is_woken)
+		return 0;
 	rlist_del_entry(&entry, base);
+	if (!is_woken_up) {
+		coro_bus_errno_set(CORO_BUS_ERR_CANCELLED);
+		return -1;
+	}
+	return 0;
+}
+
+/**
+ * Wake up the first coros until their demand covers @a count new
+ * messages or slots. A woken one leaves the queue, so the next
+ * wakeup goes to the next coro instead of the same one again.
+ */
+static void wakeup_queue_wakeup_many(struct wakeup_queue *queue, size_t count)
+{
+	while (count > 0 && !rlist_empty(&queue->coros)) {
+		struct wakeup_entry *entry = rlist_shift_entry(&queue->coros, struct wakeup_entry, base);
+		if (entry->group != NULL) {
+			/* Stale, its coro is already woken by another queue. */
+			if (entry->group->is_woken)
+				continue;
+			entry->group->is_woken = true;
+		}
+		count -= entry->demand < count ? entry->demand : count;
+		entry->is_woken = true;
+		coro_wakeup(entry->coro);
+	}
 }
 
 static void wakeup_queue_wakeup_first(struct wakeup_queue *queue)
 {
-	if (rlist_empty(&queue->coros)) return;
-	struct wakeup_entry *entry = rlist_first_entry(&queue->coros, struct wakeup_entry, base);
-	coro_wakeup(entry->coro);
+	wakeup_queue_wakeup_many(queue, 1);
+}
+
+/**
+ * Wake up all the coros of the queue of a closed channel. They
+ * fail right away, the queue is freed after that.
+ */
+static void wakeup_queue_close(struct wakeup_queue *queue)
+{
+	while (!rlist_empty(&queue->coros)) {
+		struct wakeup_entry *entry = rlist_shift_entry(&queue->coros, struct wakeup_entry, base);
+		if (entry->group != NULL) {
+			if (entry->group->is_woken)
+				continue;
+			entry->group->is_woken = true;
+		}
+		entry->is_woken = true;
+		entry->is_closed = true;
+		coro_wakeup(entry->coro);
+	}
 }
 
 
@@ -105,16 +251,56 @@ struct coro_bus_channel
 	struct wakeup_queue send_queue;
 	/** Coroutines waiting until the channel is not empty. */
 	struct wakeup_queue recv_queue;
-	/** Message queue. */
-	struct data_vector data;
+	/** Message queue, fits size_limit messages. */
+	struct data_ring data;
 	/** Variable indicates if channel was closed or not */
     	bool is_closed;
+	/** The tail slot is taken by coro_bus_send_reserve(). */
+	bool is_reserved;
+	/** The head slot is taken by coro_bus_recv_peek(). */
+	bool is_peeked;
+	/** What a broadcast does when the channel is full. */
+	enum coro_bus_overflow overflow;
+	/** Descriptor of the channel in its bus. */
+	int descriptor;
+	/** Link in the list of the open channels of the bus. */
+	struct rlist in_bus;
 };
 
+/**
+ * A reserved slot keeps the other senders away until it is
+ * committed, because the messages must become visible in order.
+ */
+static bool channel_is_writable(const struct coro_bus_channel *channel)
+{
+	return !channel->is_reserved &&
+	       data_ring_size(&channel->data) < channel->size_limit;
+}
+
+/** Same for a peeked message and the other receivers. */
+static bool channel_is_readable(const struct coro_bus_channel *channel)
+{
+	return !channel->is_peeked && data_ring_size(&channel->data) > 0;
+}
+
 struct coro_bus
 {
+	/** Channels by descriptors, NULL for a free descriptor. */
 	struct coro_bus_channel **channels;
+	/** Descriptors given out at least once. */
 	int channel_count;
+	/** Allocated size of channels and of free_descriptors. */
+	int channel_capacity;
+	/** Stack of the closed descriptors, they are reused first. */
+	int *free_descriptors;
+	int free_count;
+	/**
+	 * Open channels, so as the ones iterating them don't have
+	 * to skip the holes in the descriptor table.
+	 */
+	struct rlist channel_list;
+	/** Where the next select starts, for fairness. */
+	unsigned select_offset;
 };
 
 static struct coro_bus_channel* get_channel_by_descriptor(struct coro_bus *bus, int descriptor)
@@ -125,16 +311,38 @@ static struct coro_bus_channel* get_channel_by_descriptor(struct coro_bus *bus,
     	return channels[descriptor];
 }
 
-static enum coro_bus_error_code global_error = CORO_BUS_ERR_NONE;
+/**
+ * Find a channel with messages of @a elem_size bytes. Set the
+ * error if there is none.
+ */
+static struct coro_bus_channel *get_channel_checked(struct coro_bus *bus, int descriptor, size_t elem_size)
+{
+	struct coro_bus_channel *channel = get_channel_by_descriptor(bus, descriptor);
+	if (!channel) {
+		coro_bus_errno_set(CORO_BUS_ERR_NO_CHANNEL);
+		return NULL;
+	}
+	if (channel->data.elem_size != elem_size) {
+		coro_bus_errno_set(CORO_BUS_ERR_WRONG_SIZE);
+		return NULL;
+	}
+	return channel;
+}
+
+/**
+ * Per thread, because the thread-safe bus is used from many
+ * threads at once.
+ */
+static __thread enum coro_bus_error_code thread_error = CORO_BUS_ERR_NONE;
 
 enum coro_bus_error_code coro_bus_errno(void)
 {
-	return global_error;
+	return thread_error;
 }
 
 void coro_bus_errno_set(enum coro_bus_error_code err)
 {
-	global_error = err;
+	thread_error = err;
 }
 
 /* IMPLEMENTED */
@@ -142,6 +350,7 @@ struct coro_bus* coro_bus_new(void)
 {
 	coro_bus_errno_set(CORO_BUS_ERR_NONE);
 	struct coro_bus *new_bus = calloc(1, sizeof(struct coro_bus));
+	rlist_create(&new_bus->channel_list);
     return new_bus;
 }
 
@@ -149,49 +358,67 @@ struct coro_bus* coro_bus_new(void)
 void coro_bus_delete(struct coro_bus *bus)
 {
 	coro_bus_errno_set(CORO_BUS_ERR_NONE);
-	int channel_count = bus->channel_count;
-	struct coro_bus_channel **channels = bus->channels;
-    	for (int i = 0; i < channel_count; i++)
-    	{
-        	if (channels[i])
-		{
-             		data_vector_free(&channels[i]->data);
-             		free(channels[i]);
-        	}
-    	}
-    	free(channels);
-    	free(bus);
+	struct coro_bus_channel *cur_channel, *tmp;
+	rlist_foreach_entry_safe(cur_channel, &bus->channel_list, in_bus, tmp)
+	{
+		data_ring_free(&cur_channel->data);
+		free(cur_channel);
+	}
+	free(bus->channels);
+	free(bus->free_descriptors);
+	free(bus);
+}
+
+/**
+ * Take a closed descriptor, or a new one. The table grows twice,
+ * so the opens are O(1) amortized.
+ */
+static int bus_descriptor_alloc(struct coro_bus *bus)
+{
+	if (bus->free_count > 0)
+		return bus->free_descriptors[--bus->free_count];
+	if (bus->channel_count == bus->channel_capacity)
+	{
+		int capacity = bus->channel_capacity == 0 ? 4 : bus->channel_capacity * 2;
+		bus->channels = realloc(bus->channels, capacity * sizeof(bus->channels[0]));
+		bus->free_descriptors = realloc(bus->free_descriptors,
+						capacity * sizeof(bus->free_descriptors[0]));
+		bus->channel_capacity = capacity;
+	}
+	return bus->channel_count++;
 }
 
 /* IMPLEMENTED */
 int coro_bus_channel_open(struct coro_bus *bus, size_t size_limit)
+{
+	return coro_bus_channel_open_typed(bus, size_limit, sizeof(unsigned));
+}
+
+int coro_bus_channel_open_typed(struct coro_bus *bus, size_t size_limit, size_t elem_size)
 {
 	coro_bus_errno_set(CORO_BUS_ERR_NONE);
-	struct coro_bus_channel **channels = bus->channels;
+	if (size_limit == 0 || elem_size == 0)
+	{
+		coro_bus_errno_set(CORO_BUS_ERR_WRONG_SIZE);
+		return -1;
+	}
     	struct coro_bus_channel *new_channel = calloc(1, sizeof(struct coro_bus_channel));
     	new_channel->size_limit = size_limit;
-    	new_channel->data.data = calloc(1, sizeof(unsigned));
-	new_channel->data.capacity = 0;
-	new_channel->data.size = 0;
+	if (data_ring_create(&new_channel->data, size_limit, elem_size) != 0)
+	{
+		free(new_channel);
+		coro_bus_errno_set(CORO_BUS_ERR_WRONG_SIZE);
+		return -1;
+	}
 	new_channel->is_closed = false;
 	rlist_create(&new_channel->recv_queue.coros);
 	rlist_create(&new_channel->send_queue.coros);
 
-	for (int i = 0; i < bus->channel_count; i++)
-	{
-		if (!channels[i])
-		{
-			channels[i] = new_channel;
-			return i;
-		}
-	}
-
-    	channels = realloc(channels, (bus->channel_count + 1)*sizeof(*channels));
-	channels[bus->channel_count] = new_channel;
-	bus->channels = channels;
-	bus->channel_count = bus->channel_count + 1;
-
-    	return bus->channel_count - 1;
+	int descriptor = bus_descriptor_alloc(bus);
+	new_channel->descriptor = descriptor;
+	bus->channels[descriptor] = new_channel;
+	rlist_add_tail_entry(&bus->channel_list, new_channel, in_bus);
+	return descriptor;
 }
 
 /* IMPLEMENTED */
@@ -205,54 +432,136 @@ void coro_bus_channel_close(struct coro_bus *bus, int channel)
     cur_channel->is_closed = true;
 
     bus->channels[channel] = NULL;
+    bus->free_descriptors[bus->free_count++] = channel;
+    rlist_del_entry(cur_channel, in_bus);
     coro_bus_errno_set(CORO_BUS_ERR_NO_CHANNEL);
 
-    while (!rlist_empty(&cur_channel->recv_queue.coros))
-    {
-	wakeup_queue_wakeup_first(&cur_channel->recv_queue);
-	coro_yield();
-    }
-
-    while (!rlist_empty(&cur_channel->send_queue.coros))
-    {
-        wakeup_queue_wakeup_first(&cur_channel->send_queue);
-        coro_yield();
-    }
+    /*
+     * The woken ones don't touch the channel anymore, so it can be
+     * freed right away.
+     */
+    wakeup_queue_close(&cur_channel->recv_queue);
+    wakeup_queue_close(&cur_channel->send_queue);
 
-    data_vector_free(&cur_channel->data);
+    data_ring_free(&cur_channel->data);
     free(cur_channel);
 }
 
 /* IMPLEMENTED */
 int coro_bus_send(struct coro_bus *bus, int channel, unsigned data)
+{
+	return coro_bus_send_elem(bus, channel, &data, sizeof(data));
+}
+
+/* IMPLEMENTED */
+int coro_bus_try_send(struct coro_bus *bus, int channel, unsigned data)
+{
+	return coro_bus_try_send_elem(bus, channel, &data, sizeof(data));
+}
+
+/* IMPLEMENTED */
+int coro_bus_recv(struct coro_bus *bus, int channel, unsigned *data)
+{
+	return coro_bus_recv_elem(bus, channel, data, sizeof(*data));
+}
+
+/* IMPLEMENTED */
+int coro_bus_try_recv(struct coro_bus *bus, int channel, unsigned *data)
+{
+	return coro_bus_try_recv_elem(bus, channel, data, sizeof(*data));
+}
+
+int coro_bus_send_elem(struct coro_bus *bus, int channel, const void *data, size_t size)
 {
 	coro_bus_errno_set(CORO_BUS_ERR_NONE);
 	while (true)
 	{
-		int res = coro_bus_try_send(bus, channel, data);
-		if (!res) return 0;
+		if (!coro_bus_try_send_elem(bus, channel, data, size)) return 0;
+		if (coro_bus_errno() != CORO_BUS_ERR_WOULD_BLOCK) return -1;
+		struct coro_bus_channel *send_channel = get_channel_by_descriptor(bus, channel);
+		if (wakeup_queue_suspend(&send_channel->send_queue, 1) != 0)
+			return -1;
+	}
+}
 
-		enum coro_bus_error_code err = coro_bus_errno();
- 		if (err == CORO_BUS_ERR_NO_CHANNEL)
-		{
-      			coro_bus_errno_set(CORO_BUS_ERR_NO_CHANNEL);
-      			return -1;
-    		}
-		else if (err == CORO_BUS_ERR_WOULD_BLOCK)
-		{
-			struct coro_bus_channel *send_channel = get_channel_by_descriptor(bus, channel);
-			if (!send_channel)
-			{
-                        	coro_bus_errno_set(CORO_BUS_ERR_NO_CHANNEL);
-                        	return -1;
-			}
-			wakeup_queue_suspend(&send_channel->send_queue);
-		}
+int coro_bus_try_send_elem(struct coro_bus *bus, int channel, const void *data, size_t size)
+{
+	coro_bus_errno_set(CORO_BUS_ERR_NONE);
+	struct coro_bus_channel *send_channel = get_channel_checked(bus, channel, size);
+	if (!send_channel)
+		return -1;
+	if (!channel_is_writable(send_channel))
+	{
+		coro_bus_errno_set(CORO_BUS_ERR_WOULD_BLOCK);
+		return -1;
 	}
+	data_ring_append(&send_channel->data, data);
+	wakeup_queue_wakeup_first(&send_channel->recv_queue);
+	return 0;
 }
 
-/* IMPLEMENTED */
-int coro_bus_try_send(struct coro_bus *bus, int channel, unsigned data)
+int coro_bus_recv_elem(struct coro_bus *bus, int channel, void *data, size_t size)
+{
+	coro_bus_errno_set(CORO_BUS_ERR_NONE);
+	while (true)
+	{
+		if (!coro_bus_try_recv_elem(bus, channel, data, size)) return 0;
+		if (coro_bus_errno() != CORO_BUS_ERR_WOULD_BLOCK) return -1;
+		struct coro_bus_channel *recv_channel = get_channel_by_descriptor(bus, channel);
+		if (wakeup_queue_suspend(&recv_channel->recv_queue, 1) != 0)
+			return -1;
+	}
+}
+
+int coro_bus_try_recv_elem(struct coro_bus *bus, int channel, void *data, size_t size)
+{
+	coro_bus_errno_set(CORO_BUS_ERR_NONE);
+	struct coro_bus_channel *recv_channel = get_channel_checked(bus, channel, size);
+	if (!recv_channel)
+		return -1;
+	if (!channel_is_readable(recv_channel))
+	{
+		coro_bus_errno_set(CORO_BUS_ERR_WOULD_BLOCK);
+		return -1;
+	}
+	data_ring_pop_first(&recv_channel->data, data);
+	wakeup_queue_wakeup_first(&recv_channel->send_queue);
+	return 0;
+}
+
+void *coro_bus_send_reserve(struct coro_bus *bus, int channel)
+{
+	coro_bus_errno_set(CORO_BUS_ERR_NONE);
+	while (true)
+	{
+		void *slot = coro_bus_try_send_reserve(bus, channel);
+		if (slot) return slot;
+		if (coro_bus_errno() != CORO_BUS_ERR_WOULD_BLOCK) return NULL;
+		struct coro_bus_channel *send_channel = get_channel_by_descriptor(bus, channel);
+		if (wakeup_queue_suspend(&send_channel->send_queue, 1) != 0)
+			return NULL;
+	}
+}
+
+void *coro_bus_try_send_reserve(struct coro_bus *bus, int channel)
+{
+	coro_bus_errno_set(CORO_BUS_ERR_NONE);
+	struct coro_bus_channel *send_channel = get_channel_by_descriptor(bus, channel);
+	if (!send_channel)
+	{
+		coro_bus_errno_set(CORO_BUS_ERR_NO_CHANNEL);
+		return NULL;
+	}
+	if (!channel_is_writable(send_channel))
+	{
+		coro_bus_errno_set(CORO_BUS_ERR_WOULD_BLOCK);
+		return NULL;
+	}
+	send_channel->is_reserved = true;
+	return data_ring_slot(&send_channel->data, send_channel->data.tail);
+}
+
+int coro_bus_send_commit(struct coro_bus *bus, int channel)
 {
 	coro_bus_errno_set(CORO_BUS_ERR_NONE);
 	struct coro_bus_channel *send_channel = get_channel_by_descriptor(bus, channel);
@@ -261,114 +570,340 @@ int coro_bus_try_send(struct coro_bus *bus, int channel, unsigned data)
 		coro_bus_errno_set(CORO_BUS_ERR_NO_CHANNEL);
 		return -1;
 	}
-    	if (send_channel->data.size == send_channel->size_limit)
-    	{
-    		coro_bus_errno_set(CORO_BUS_ERR_WOULD_BLOCK);
-        	return -1;
-    	}
-    	data_vector_append(&send_channel->data, data);
-    	wakeup_queue_wakeup_first(&send_channel->recv_queue);
-    	return 0;
+	assert(send_channel->is_reserved);
+	send_channel->is_reserved = false;
+	++send_channel->data.tail;
+	wakeup_queue_wakeup_first(&send_channel->recv_queue);
+	/*
+	 * The senders woken during the reservation went back to
+	 * sleep. Wake as many as there are free slots.
+	 */
+	wakeup_queue_wakeup_many(&send_channel->send_queue,
+				 send_channel->size_limit - data_ring_size(&send_channel->data));
+	return 0;
 }
 
-/* IMPLEMENTED */
-int coro_bus_recv(struct coro_bus *bus, int channel, unsigned *data)
+const void *coro_bus_recv_peek(struct coro_bus *bus, int channel)
 {
 	coro_bus_errno_set(CORO_BUS_ERR_NONE);
 	while (true)
 	{
-		if(!coro_bus_try_recv(bus, channel, data)) return 0;
-		if (coro_bus_errno() != CORO_BUS_ERR_WOULD_BLOCK) return -1;
+		const void *slot = coro_bus_try_recv_peek(bus, channel);
+		if (slot) return slot;
+		if (coro_bus_errno() != CORO_BUS_ERR_WOULD_BLOCK) return NULL;
 		struct coro_bus_channel *recv_channel = get_channel_by_descriptor(bus, channel);
-		if (!recv_channel)
-		{
-			coro_bus_errno_set(CORO_BUS_ERR_NO_CHANNEL);
-			return -1;
-		}
-		wakeup_queue_suspend(&recv_channel->recv_queue);
+		if (wakeup_queue_suspend(&recv_channel->recv_queue, 1) != 0)
+			return NULL;
 	}
 }
 
-/* IMPLEMENTED */
-int coro_bus_try_recv(struct coro_bus *bus, int channel, unsigned *data)
+const void *coro_bus_try_recv_peek(struct coro_bus *bus, int channel)
 {
 	coro_bus_errno_set(CORO_BUS_ERR_NONE);
 	struct coro_bus_channel *recv_channel = get_channel_by_descriptor(bus, channel);
 	if (!recv_channel)
 	{
-                 coro_bus_errno_set(CORO_BUS_ERR_NO_CHANNEL);
-                 return -1;
+		coro_bus_errno_set(CORO_BUS_ERR_NO_CHANNEL);
+		return NULL;
 	}
-	if (recv_channel->data.size == 0)
+	if (!channel_is_readable(recv_channel))
 	{
 		coro_bus_errno_set(CORO_BUS_ERR_WOULD_BLOCK);
+		return NULL;
+	}
+	recv_channel->is_peeked = true;
+	return data_ring_slot(&recv_channel->data, recv_channel->data.head);
+}
+
+int coro_bus_recv_consume(struct coro_bus *bus, int channel)
+{
+	coro_bus_errno_set(CORO_BUS_ERR_NONE);
+	struct coro_bus_channel *recv_channel = get_channel_by_descriptor(bus, channel);
+	if (!recv_channel)
+	{
+		coro_bus_errno_set(CORO_BUS_ERR_NO_CHANNEL);
 		return -1;
 	}
-	*data = data_vector_pop_first(&recv_channel->data);
+	assert(recv_channel->is_peeked);
+	recv_channel->is_peeked = false;
+	++recv_channel->data.head;
 	wakeup_queue_wakeup_first(&recv_channel->send_queue);
+	wakeup_queue_wakeup_many(&recv_channel->recv_queue,
+				 data_ring_size(&recv_channel->data));
 	return 0;
 }
 
 
+/**
+ * Check if an op of select won't block. A missing channel counts
+ * too, the op fails on it right away.
+ */
+static bool select_op_is_ready(struct coro_bus *bus, const struct coro_bus_select_op *op)
+{
+	struct coro_bus_channel *cur_channel = get_channel_by_descriptor(bus, op->channel);
+	if (!cur_channel)
+		return true;
+	return op->is_send ? channel_is_writable(cur_channel) : channel_is_readable(cur_channel);
+}
+
+int coro_bus_try_select(struct coro_bus *bus, const struct coro_bus_select_op *ops, int count)
+{
+	coro_bus_errno_set(CORO_BUS_ERR_NONE);
+	if (count <= 0)
+	{
+		coro_bus_errno_set(CORO_BUS_ERR_NO_CHANNEL);
+		return -1;
+	}
+	/* Not always from the first op, or the rest would starve. */
+	unsigned offset = bus->select_offset++;
+	for (int i = 0; i < count; i++)
+	{
+		int idx = (offset + i) % count;
+		if (select_op_is_ready(bus, &ops[idx]))
+			return idx;
+	}
+	coro_bus_errno_set(CORO_BUS_ERR_WOULD_BLOCK);
+	return -1;
+}
+
+enum {
+	/** Wakeup entries of select which fit on the stack. */
+	SELECT_STATIC_ENTRY_COUNT = 8,
+};
+
+/**
+ * Suspend in the queues of all the ops at once.
+ * @retval >=0 Index of the op which woke the coroutine up.
+ * @retval -1 Woken up by something else, or cancelled, or a
+ *     channel is closed.
+ */
+static int select_suspend(struct coro_bus *bus, const struct coro_bus_select_op *ops, int count)
+{
+	struct wakeup_entry static_entries[SELECT_STATIC_ENTRY_COUNT];
+	struct wakeup_entry *entries = static_entries;
+	if (count > SELECT_STATIC_ENTRY_COUNT)
+		entries = malloc(sizeof(*entries) * count);
+	struct wakeup_group group;
+	group.is_woken = false;
+	struct coro *self = coro_this();
+	/* All the channels exist, otherwise an op would be ready. */
+	for (int i = 0; i < count; i++)
+	{
+		struct coro_bus_channel *cur_channel = get_channel_by_descriptor(bus, ops[i].channel);
+		struct wakeup_queue *queue = ops[i].is_send ? &cur_channel->send_queue : &cur_channel->recv_queue;
+		entries[i].coro = self;
+		entries[i].demand = 1;
+		entries[i].is_woken = false;
+		entries[i].is_closed = false;
+		entries[i].group = &group;
+		rlist_add_tail_entry(&queue->coros, &entries[i], base);
+	}
+	bool is_woken_up = coro_suspend();
+	/*
+	 * The entries not taken by a waker are still in the queues
+	 * or were unlinked as stale. Either way the deletion is safe.
+	 * Same as for a single wait, a wakeup is taken even when
+	 * cancelled.
+	 */
+	int rc = -1;
+	for (int i = 0; i < count; i++)
+	{
+		if (entries[i].is_woken)
+			rc = i;
+		else
+			rlist_del_entry(&entries[i], base);
+	}
+	bool is_closed = rc >= 0 && entries[rc].is_closed;
+	if (entries != static_entries)
+		free(entries);
+	if (is_closed)
+	{
+		coro_bus_errno_set(CORO_BUS_ERR_NO_CHANNEL);
+		return -1;
+	}
+	if (rc < 0 && !is_woken_up)
+		coro_bus_errno_set(CORO_BUS_ERR_CANCELLED);
+	return rc;
+}
+
+int coro_bus_select(struct coro_bus *bus, const struct coro_bus_select_op *ops, int count)
+{
+	coro_bus_errno_set(CORO_BUS_ERR_NONE);
+	while (true)
+	{
+		int rc = coro_bus_try_select(bus, ops, count);
+		if (rc >= 0 || coro_bus_errno() != CORO_BUS_ERR_WOULD_BLOCK)
+			return rc;
+		coro_bus_errno_set(CORO_BUS_ERR_NONE);
+		rc = select_suspend(bus, ops, count);
+		if (rc >= 0)
+			return rc;
+		if (coro_bus_errno() != CORO_BUS_ERR_NONE)
+			return -1;
+	}
+}
+
 #if NEED_BROADCAST
 
+int coro_bus_channel_set_overflow(struct coro_bus *bus, int channel, enum coro_bus_overflow overflow)
+{
+	coro_bus_errno_set(CORO_BUS_ERR_NONE);
+	struct coro_bus_channel *cur_channel = get_channel_checked(bus, channel, sizeof(unsigned));
+	if (!cur_channel)
+		return -1;
+	cur_channel->overflow = overflow;
+	return 0;
+}
+
+/** The channel takes part in a broadcast and can stop it. */
+static bool broadcast_is_blocking(const struct coro_bus_channel *channel)
+{
+	return channel->data.elem_size == sizeof(unsigned) &&
+	       channel->overflow == CORO_BUS_OVERFLOW_BLOCK;
+}
+
+/**
+ * Find the first channel of unsigned which can't take a message
+ * and doesn't drop them.
+ * @retval >=0 Descriptor of the channel.
+ * @retval -1 All can take it.
+ */
+static int broadcast_find_blocked(struct coro_bus *bus)
+{
+	struct coro_bus_channel *cur_channel;
+	rlist_foreach_entry(cur_channel, &bus->channel_list, in_bus)
+	{
+		if (!broadcast_is_blocking(cur_channel)) continue;
+		if (!channel_is_writable(cur_channel)) return cur_channel->descriptor;
+	}
+	return -1;
+}
+
+/**
+ * Give a wakeup of a channel to its next sender, if the slot is
+ * still free. The broadcaster took it, but is not going to use it.
+ */
+static void broadcast_pass_wakeup(struct coro_bus *bus, int channel)
+{
+	struct coro_bus_channel *cur_channel = get_channel_by_descriptor(bus, channel);
+	if (cur_channel && channel_is_writable(cur_channel))
+		wakeup_queue_wakeup_first(&cur_channel->send_queue);
+}
+
+/**
+ * Put the messages into one channel, dropping what doesn't fit
+ * according to the channel's policy. A reserved or a peeked slot
+ * can't be dropped nor overwritten, then the new messages go
+ * away.
+ */
+static void broadcast_deliver(struct coro_bus_channel *channel, const unsigned *data, size_t count)
+{
+	struct data_ring *ring = &channel->data;
+	if (channel->is_reserved)
+		return;
+	size_t size = data_ring_size(ring);
+	size_t free_space = channel->size_limit - size;
+	if (count == 1 && free_space > 0)
+	{
+		/* The plain broadcast, don't make it pay for the batches. */
+		data_ring_append(ring, data);
+		wakeup_queue_wakeup_first(&channel->recv_queue);
+		return;
+	}
+	if (count > free_space && channel->overflow == CORO_BUS_OVERFLOW_DROP_OLDEST &&
+	    !channel->is_peeked)
+	{
+		/* Only the newest size_limit of them can stay. */
+		if (count > channel->size_limit)
+		{
+			data += count - channel->size_limit;
+			count = channel->size_limit;
+		}
+		ring->head += count - free_space;
+		free_space = count;
+	}
+	if (count > free_space)
+		count = free_space;
+	data_ring_append_many(ring, data, count);
+	if (data_ring_size(ring) > size)
+		wakeup_queue_wakeup_many(&channel->recv_queue, data_ring_size(ring) - size);
+}
+
 /* IMPLEMENTED */
 int coro_bus_broadcast(struct coro_bus *bus, unsigned data)
 {
-        coro_bus_errno_set(CORO_BUS_ERR_NONE);
-        while (true)
-        {
-                int res = coro_bus_try_broadcast(bus, data);
-                if (!res) return 0;
-
-                enum coro_bus_error_code err = coro_bus_errno();
-                if (err == CORO_BUS_ERR_NO_CHANNEL)
-                {
-                        coro_bus_errno_set(CORO_BUS_ERR_NO_CHANNEL);
-                        return -1;
-                }
-                else if (err == CORO_BUS_ERR_WOULD_BLOCK)
-                {
-                        for (int i = 0; i < bus->channel_count; i++)
-        		{
-                		struct coro_bus_channel *cur_channel = get_channel_by_descriptor(bus, i);
-                		if(!cur_channel) continue;
-				if(cur_channel->data.size == cur_channel->size_limit)
-                			wakeup_queue_suspend(&cur_channel->send_queue);
-        		}
-                }
-        }
+	return coro_bus_broadcast_v(bus, &data, 1) > 0 ? 0 : -1;
 }
 
 /* IMPLEMENTED */
 int coro_bus_try_broadcast(struct coro_bus *bus, unsigned data)
+{
+	return coro_bus_try_broadcast_v(bus, &data, 1) > 0 ? 0 : -1;
+}
+
+int coro_bus_broadcast_v(struct coro_bus *bus, const unsigned *data, unsigned count)
 {
 	coro_bus_errno_set(CORO_BUS_ERR_NONE);
-	bool no_channels = true;
-	for (int i = 0; i < bus->channel_count; i++)
+	/* The channel which woke this coroutine up last time. */
+	int woken_by = -1;
+	while (true)
 	{
-		struct coro_bus_channel *cur_channel = get_channel_by_descriptor(bus, i);
-		if(!cur_channel) continue;
-		if(no_channels) no_channels = false;
-		if(cur_channel->data.size == cur_channel->size_limit)
+		int rc = coro_bus_try_broadcast_v(bus, data, count);
+		int blocked = -1;
+		if (rc < 0 && coro_bus_errno() == CORO_BUS_ERR_WOULD_BLOCK)
+			blocked = broadcast_find_blocked(bus);
+		if (woken_by >= 0 && woken_by != blocked)
+			broadcast_pass_wakeup(bus, woken_by);
+		if (blocked < 0) return rc;
+		/*
+		 * Only one channel at a time can be waited on. It can't
+		 * be helped, all of them must have a free slot at once.
+		 */
+		struct coro_bus_channel *cur_channel = get_channel_by_descriptor(bus, blocked);
+		woken_by = blocked;
+		if (wakeup_queue_suspend(&cur_channel->send_queue, 1) != 0)
 		{
-				coro_bus_errno_set(CORO_BUS_ERR_WOULD_BLOCK);
+			/* The closed one is not an addressee anymore, go on. */
+			if (coro_bus_errno() != CORO_BUS_ERR_NO_CHANNEL)
 				return -1;
+			coro_bus_errno_set(CORO_BUS_ERR_NONE);
+			woken_by = -1;
 		}
 	}
+}
+
+int coro_bus_try_broadcast_v(struct coro_bus *bus, const unsigned *data, unsigned count)
+{
+	coro_bus_errno_set(CORO_BUS_ERR_NONE);
+	bool no_channels = true;
+	/* As many as the fullest of the blocking channels takes. */
+	size_t send_size = count;
+	struct coro_bus_channel *cur_channel;
+	rlist_foreach_entry(cur_channel, &bus->channel_list, in_bus)
+	{
+		if (cur_channel->data.elem_size != sizeof(*data)) continue;
+		no_channels = false;
+		if (!broadcast_is_blocking(cur_channel)) continue;
+		if (!channel_is_writable(cur_channel))
+		{
+			coro_bus_errno_set(CORO_BUS_ERR_WOULD_BLOCK);
+			return -1;
+		}
+		size_t free_space = cur_channel->size_limit - data_ring_size(&cur_channel->data);
+		if (free_space < send_size)
+			send_size = free_space;
+	}
 	if (no_channels)
 	{
 		coro_bus_errno_set(CORO_BUS_ERR_NO_CHANNEL);
 		return -1;
 	}
-        for (int i = 0; i < bus->channel_count; i++)
-        {
-                struct coro_bus_channel *cur_channel = get_channel_by_descriptor(bus, i);
-                if(!cur_channel) continue;
-                data_vector_append(&cur_channel->data, data);
-                wakeup_queue_wakeup_first(&cur_channel->recv_queue);
-        }
-	return 0;
+	rlist_foreach_entry(cur_channel, &bus->channel_list, in_bus)
+	{
+		if (cur_channel->data.elem_size != sizeof(*data)) continue;
+		broadcast_deliver(cur_channel, data, send_size);
+	}
+	return send_size;
 }
 
 #endif
@@ -384,27 +919,11 @@ int coro_bus_send_v(struct coro_bus *bus, int channel, const unsigned *data, uns
         {
                 sent_size = coro_bus_try_send_v(bus, channel, data, count);
                 if (sent_size > 0) break;
-
-                enum coro_bus_error_code err = coro_bus_errno();
-                if (err == CORO_BUS_ERR_NO_CHANNEL)
-                {
-                        coro_bus_errno_set(CORO_BUS_ERR_NO_CHANNEL);
-                        return -1;
-                }
-                else if (err == CORO_BUS_ERR_WOULD_BLOCK)
-                {
-                        struct coro_bus_channel *send_channel = get_channel_by_descriptor(bus, channel);
-                        if (!send_channel)
-                        {
-                                coro_bus_errno_set(CORO_BUS_ERR_NO_CHANNEL);
-                                return -1;
-                        }
-                        wakeup_queue_suspend(&send_channel->send_queue);
-                }
+                if (coro_bus_errno() != CORO_BUS_ERR_WOULD_BLOCK) return -1;
+                struct coro_bus_channel *send_channel = get_channel_by_descriptor(bus, channel);
+                if (wakeup_queue_suspend(&send_channel->send_queue, count) != 0)
+                	return -1;
         }
-	struct coro_bus_channel *send_channel = get_channel_by_descriptor(bus, channel);
-	if (send_channel && send_channel->data.size < send_channel->size_limit)
-		wakeup_queue_wakeup_first(&send_channel->send_queue);
 	return sent_size;
 }
 
@@ -412,21 +931,18 @@ int coro_bus_send_v(struct coro_bus *bus, int channel, const unsigned *data, uns
 int coro_bus_try_send_v(struct coro_bus *bus, int channel, const unsigned *data, unsigned count)
 {
         coro_bus_errno_set(CORO_BUS_ERR_NONE);
-        struct coro_bus_channel *send_channel = get_channel_by_descriptor(bus, channel);
+        struct coro_bus_channel *send_channel = get_channel_checked(bus, channel, sizeof(*data));
         if (!send_channel)
-        {
-                coro_bus_errno_set(CORO_BUS_ERR_NO_CHANNEL);
                 return -1;
-        }
-        if (send_channel->data.size == send_channel->size_limit)
+        if (!channel_is_writable(send_channel))
         {
                 coro_bus_errno_set(CORO_BUS_ERR_WOULD_BLOCK);
                 return -1;
         }
-	unsigned int free_space = send_channel->size_limit - send_channel->data.size;
+	unsigned int free_space = send_channel->size_limit - data_ring_size(&send_channel->data);
 	int send_size = free_space > count ? count : free_space;
-        data_vector_append_many(&send_channel->data, data, send_size);
-        wakeup_queue_wakeup_first(&send_channel->recv_queue);
+        data_ring_append_many(&send_channel->data, data, send_size);
+        wakeup_queue_wakeup_many(&send_channel->recv_queue, send_size);
         return send_size;
 }
 
@@ -446,11 +962,9 @@ int coro_bus_recv_v(struct coro_bus *bus, int channel, unsigned *data, unsigned
                         coro_bus_errno_set(CORO_BUS_ERR_NO_CHANNEL);
                         return -1;
                 }
-                wakeup_queue_suspend(&recv_channel->recv_queue);
+                if (wakeup_queue_suspend(&recv_channel->recv_queue, capacity) != 0)
+                	return -1;
         }
-	struct coro_bus_channel *recv_channel = get_channel_by_descriptor(bus, channel);
-	if (recv_channel->data.size > 0)
-		wakeup_queue_wakeup_first(&recv_channel->recv_queue);
 	return recv_size;
 }
 
@@ -458,20 +972,18 @@ int coro_bus_recv_v(struct coro_bus *bus, int channel, unsigned *data, unsigned
 int coro_bus_try_recv_v(struct coro_bus *bus, int channel, unsigned *data, unsigned capacity)
 {
         coro_bus_errno_set(CORO_BUS_ERR_NONE);
-        struct coro_bus_channel *recv_channel = get_channel_by_descriptor(bus, channel);
+        struct coro_bus_channel *recv_channel = get_channel_checked(bus, channel, sizeof(*data));
         if (!recv_channel)
-        {
-                 coro_bus_errno_set(CORO_BUS_ERR_NO_CHANNEL);
-                 return -1;
-        }
-        if (recv_channel->data.size == 0)
+                return -1;
+        if (!channel_is_readable(recv_channel))
         {
                 coro_bus_errno_set(CORO_BUS_ERR_WOULD_BLOCK);
                 return -1;
         }
-	unsigned int recv_size = recv_channel->data.size < capacity ? recv_channel->data.size : capacity;
-        data_vector_pop_first_many(&recv_channel->data, data, recv_size);
-        wakeup_queue_wakeup_first(&recv_channel->send_queue);
+	size_t size = data_ring_size(&recv_channel->data);
+	unsigned int recv_size = size < capacity ? size : capacity;
+        data_ring_pop_first_many(&recv_channel->data, data, recv_size);
+        wakeup_queue_wakeup_many(&recv_channel->send_queue, recv_size);
         return recv_size;
 }
 
@@ -1,5 +1,6 @@
 #pragma once
 
+#include <stdbool.h>
 #include <stddef.h>
 
 /**
@@ -15,14 +16,21 @@ enum coro_bus_error_code {
 	CORO_BUS_ERR_NO_CHANNEL,
 	CORO_BUS_ERR_WOULD_BLOCK,
 	CORO_BUS_ERR_NOT_IMPLEMENTED,
+	/** A blocking call was interrupted by coro_cancel(). */
+	CORO_BUS_ERR_CANCELLED,
+	/**
+	 * The channel's message size is not the requested one. Or the
+	 * sizes of a new channel are zero or too big.
+	 */
+	CORO_BUS_ERR_WRONG_SIZE,
 };
 
 struct coro_bus;
 
-/** Get the latest error happened in coro_bus. */
+/** Get the latest error happened in coro_bus in this thread. */
 enum coro_bus_error_code coro_bus_errno(void);
 
-/** Set the global coro_bus error. */
+/** Set the coro_bus error in this thread. */
 void coro_bus_errno_set(enum coro_bus_error_code err);
 
 /** Create a new messaging bus with no channels in it. */
@@ -43,9 +51,29 @@ void coro_bus_delete(struct coro_bus *bus);
  *
  * @retval >=0 Descriptor of the channel. It must be passed to the
  *     send/recv functions.
+ * @retval -1 Error. Check coro_bus_errno() for reason.
+ *     - CORO_BUS_ERR_WRONG_SIZE - the size limit is zero or the
+ *       messages don't fit into the memory.
  */
 int coro_bus_channel_open(struct coro_bus *bus, size_t size_limit);
 
+/**
+ * Create a channel of messages of @a elem_size bytes each. The
+ * messages are stored inline, without any allocations per message.
+ * The functions taking unsigned work with the channels of
+ * sizeof(unsigned) messages only. Broadcast skips the other ones.
+ * @param bus The bus to create the channel in.
+ * @param size_limit Maximum messages a channel can hold in memory
+ *     at once.
+ * @param elem_size Size of one message.
+ *
+ * @retval >=0 Descriptor of the channel.
+ * @retval -1 Error. Check coro_bus_errno() for reason.
+ *     - CORO_BUS_ERR_WRONG_SIZE - a size is zero or the messages
+ *       don't fit into the memory.
+ */
+int coro_bus_channel_open_typed(struct coro_bus *bus, size_t size_limit, size_t elem_size);
+
 /**
  * Destroy the channel identified by the given descriptor. The
  * channel must exist. All pending messages of the channel are
@@ -67,6 +95,8 @@ void coro_bus_channel_close(struct coro_bus *bus, int channel);
  * @retval 0 Success.
  * @retval -1 Error. Check coro_bus_errno() for reason.
  *     - CORO_BUS_ERR_NO_CHANNEL - the channel doesn't exist.
+ *     - CORO_BUS_ERR_WRONG_SIZE - the channel is not of unsigned.
+ *     - CORO_BUS_ERR_CANCELLED - the coroutine is cancelled.
  */
 int coro_bus_send(struct coro_bus *bus, int channel, unsigned data);
 
@@ -81,6 +111,7 @@ int coro_bus_send(struct coro_bus *bus, int channel, unsigned data);
  * @retval 0 Success.
  * @retval -1 Error. Check coro_bus_errno() for reason.
  *     - CORO_BUS_ERR_NO_CHANNEL - the channel doesn't exist.
+ *     - CORO_BUS_ERR_WRONG_SIZE - the channel is not of unsigned.
  *     - CORO_BUS_ERR_WOULD_BLOCK - the channel is full.
  */
 int coro_bus_try_send(struct coro_bus *bus, int channel, unsigned data);
@@ -97,6 +128,8 @@ int coro_bus_try_send(struct coro_bus *bus, int channel, unsigned data);
  *     message.
  * @retval -1 Error. Check coro_bus_errno() for reason.
  *     - CORO_BUS_ERR_NO_CHANNEL - the channel doesn't exist.
+ *     - CORO_BUS_ERR_WRONG_SIZE - the channel is not of unsigned.
+ *     - CORO_BUS_ERR_CANCELLED - the coroutine is cancelled.
  */
 int coro_bus_recv(struct coro_bus *bus, int channel, unsigned *data);
 
@@ -112,24 +145,213 @@ int coro_bus_recv(struct coro_bus *bus, int channel, unsigned *data);
  *     message.
  * @retval -1 Error. Check coro_bus_errno() for reason.
  *     - CORO_BUS_ERR_NO_CHANNEL - the channel doesn't exist.
+ *     - CORO_BUS_ERR_WRONG_SIZE - the channel is not of unsigned.
  *     - CORO_BUS_ERR_WOULD_BLOCK - the channel is empty.
  */
 int coro_bus_try_recv(struct coro_bus *bus, int channel, unsigned *data);
 
 
+/**
+ * Same as coro_bus_send(), but for a message of any size.
+ * @param data Message to copy into the channel.
+ * @param size Size of the message. Must be the channel's one.
+ *
+ * @retval 0 Success.
+ * @retval -1 Error. Check coro_bus_errno() for reason.
+ *     - CORO_BUS_ERR_NO_CHANNEL - the channel doesn't exist.
+ *     - CORO_BUS_ERR_WRONG_SIZE - the channel has another size.
+ *     - CORO_BUS_ERR_CANCELLED - the coroutine is cancelled.
+ */
+int coro_bus_send_elem(struct coro_bus *bus, int channel, const void *data, size_t size);
+
+/** Non-blocking version of coro_bus_send_elem(). */
+int coro_bus_try_send_elem(struct coro_bus *bus, int channel, const void *data, size_t size);
+
+/** Same as coro_bus_recv(), but for a message of any size. */
+int coro_bus_recv_elem(struct coro_bus *bus, int channel, void *data, size_t size);
+
+/** Non-blocking version of coro_bus_recv_elem(). */
+int coro_bus_try_recv_elem(struct coro_bus *bus, int channel, void *data, size_t size);
+
+/**
+ * Reserve a slot at the end of the channel to fill a message in
+ * place, without copying it. Suspends while the channel is full.
+ * The message becomes visible to the receivers only with
+ * coro_bus_send_commit(). Until then the other senders of the
+ * channel wait, so the reservation must be committed soon.
+ *
+ * @retval not NULL The slot of the channel's message size.
+ * @retval NULL Error. Check coro_bus_errno() for reason.
+ *     - CORO_BUS_ERR_NO_CHANNEL - the channel doesn't exist.
+ *     - CORO_BUS_ERR_CANCELLED - the coroutine is cancelled.
+ */
+void *coro_bus_send_reserve(struct coro_bus *bus, int channel);
+
+/**
+ * Non-blocking version of coro_bus_send_reserve(). Fails with
+ * CORO_BUS_ERR_WOULD_BLOCK if the channel is full.
+ */
+void *coro_bus_try_send_reserve(struct coro_bus *bus, int channel);
+
+/**
+ * Publish the message reserved by coro_bus_send_reserve().
+ *
+ * @retval 0 Success.
+ * @retval -1 The channel is closed, CORO_BUS_ERR_NO_CHANNEL.
+ */
+int coro_bus_send_commit(struct coro_bus *bus, int channel);
+
+/**
+ * Get the first message of the channel to read it in place,
+ * without copying. Suspends while the channel is empty. The
+ * message stays in the channel until coro_bus_recv_consume().
+ * Until then the other receivers of the channel wait.
+ *
+ * @retval not NULL The message.
+ * @retval NULL Error. Check coro_bus_errno() for reason.
+ *     - CORO_BUS_ERR_NO_CHANNEL - the channel doesn't exist.
+ *     - CORO_BUS_ERR_CANCELLED - the coroutine is cancelled.
+ */
+const void *coro_bus_recv_peek(struct coro_bus *bus, int channel);
+
+/**
+ * Non-blocking version of coro_bus_recv_peek(). Fails with
+ * CORO_BUS_ERR_WOULD_BLOCK if the channel is empty.
+ */
+const void *coro_bus_try_recv_peek(struct coro_bus *bus, int channel);
+
+/**
+ * Drop the message returned by coro_bus_recv_peek().
+ *
+ * @retval 0 Success.
+ * @retval -1 The channel is closed, CORO_BUS_ERR_NO_CHANNEL.
+ */
+int coro_bus_recv_consume(struct coro_bus *bus, int channel);
+
+
+/** One channel to wait for in coro_bus_select(). */
+struct coro_bus_select_op {
+	/** Descriptor of the channel. */
+	int channel;
+	/** Wait for a free slot. Otherwise wait for a message. */
+	bool is_send;
+};
+
+/**
+ * Wait until any of the channels is ready: has a message or a free
+ * slot, depending on the op. The coroutine is suspended once, in
+ * all the channels at the same time. The operation itself is not
+ * done, the caller does it with a try-function. It still might
+ * fail if another coroutine gets the message or the slot first,
+ * then just select again. A closed channel is ready too, the
+ * operation on it fails right away. A channel closed during the
+ * wait fails the select, its descriptor might be already reused.
+ * When many ops are ready, a different one is returned each time,
+ * so none of them starves.
+ * @param bus Bus where the channels are located.
+ * @param ops Channels to wait for.
+ * @param count Number of the ops.
+ *
+ * @retval >=0 Index of the ready op.
+ * @retval -1 Error. Check coro_bus_errno() for reason.
+ *     - CORO_BUS_ERR_NO_CHANNEL - no ops, or a channel is closed
+ *       during the wait.
+ *     - CORO_BUS_ERR_CANCELLED - the coroutine is cancelled.
+ */
+int coro_bus_select(struct coro_bus *bus, const struct coro_bus_select_op *ops, int count);
+
+/**
+ * Same as coro_bus_select(), but fails with
+ * CORO_BUS_ERR_WOULD_BLOCK if no op is ready.
+ */
+int coro_bus_try_select(struct coro_bus *bus, const struct coro_bus_select_op *ops, int count);
+
+/**
+ * A thread-safe bus, for the coroutines of
+ * coro_sched_run_threads() and for plain threads. It has the same
+ * semantics as the bus above, but only the basic functions. A
+ * blocked coroutine is suspended, a blocked thread sleeps in the
+ * kernel. The errors are reported via coro_bus_errno() of the
+ * calling thread.
+ *
+ * coro_sched_run_threads() returns when all its coroutines are
+ * suspended, it doesn't know about the plain threads. While those
+ * can wake the coroutines up, the scheduler has to be kept busy.
+ *
+ * A closed channel is freed only with the bus, and its descriptor
+ * is not reused.
+ */
+struct coro_bus_mt;
+
+/** Create a bus which can have up to @a channel_max channels. */
+struct coro_bus_mt *coro_bus_mt_new(int channel_max);
+
+/** Destroy the bus. Nobody can use it anymore. */
+void coro_bus_mt_delete(struct coro_bus_mt *bus);
+
+/**
+ * Create a channel for up to @a size_limit messages, which must
+ * be positive.
+ *
+ * @retval >=0 Descriptor of the channel.
+ * @retval -1 CORO_BUS_ERR_NO_CHANNEL - all channel_max are taken.
+ */
+int coro_bus_mt_channel_open(struct coro_bus_mt *bus, size_t size_limit);
+
+/** Thread-safe coro_bus_channel_close(). */
+void coro_bus_mt_channel_close(struct coro_bus_mt *bus, int channel);
+
+/** Thread-safe coro_bus_send(). */
+int coro_bus_mt_send(struct coro_bus_mt *bus, int channel, unsigned data);
+
+/** Thread-safe coro_bus_try_send(). */
+int coro_bus_mt_try_send(struct coro_bus_mt *bus, int channel, unsigned data);
+
+/** Thread-safe coro_bus_recv(). */
+int coro_bus_mt_recv(struct coro_bus_mt *bus, int channel, unsigned *data);
+
+/** Thread-safe coro_bus_try_recv(). */
+int coro_bus_mt_try_recv(struct coro_bus_mt *bus, int channel, unsigned *data);
+
 #if NEED_BROADCAST /* Bonus 1 */
 
+/** What a broadcast does with a full channel. */
+enum coro_bus_overflow {
+	/** Wait until the channel has space. The default. */
+	CORO_BUS_OVERFLOW_BLOCK = 0,
+	/** Drop the oldest messages of the channel to make space. */
+	CORO_BUS_OVERFLOW_DROP_OLDEST,
+	/** Drop the new messages which don't fit. */
+	CORO_BUS_OVERFLOW_DROP_NEWEST,
+};
+
+/**
+ * Set what the broadcasts do when the channel is full. The usual
+ * sends are not affected. A slow subscriber with a dropping
+ * policy doesn't slow the broadcasts down. A message can't be
+ * dropped while reserved or peeked, so the new ones are dropped
+ * then.
+ *
+ * @retval 0 Success.
+ * @retval -1 Error. Check coro_bus_errno() for reason.
+ *     - CORO_BUS_ERR_NO_CHANNEL - the channel doesn't exist.
+ *     - CORO_BUS_ERR_WRONG_SIZE - the channel is not of unsigned.
+ */
+int coro_bus_channel_set_overflow(struct coro_bus *bus, int channel, enum coro_bus_overflow overflow);
+
 /**
  * Send the given message to all the registered channels at once.
- * If any of the channels are full, then the message isn't sent
- * anywhere, and the coroutine is suspended until can submit the
- * data to all the channels.
+ * If any of the blocking channels are full, then the message isn't
+ * sent anywhere, and the coroutine is suspended until can submit
+ * the data to all of them. The full channels with a dropping
+ * policy get it according to the policy.
  * @param bus Bus where the channels are located.
  * @param data Data to send.
  *
  * @retval 0 Success. Sent to all the channels.
  * @retval -1 Error. Check coro_bus_errno() for reason.
  *     - CORO_BUS_ERR_NO_CHANNEL - no channels in the bus.
+ *     - CORO_BUS_ERR_CANCELLED - the coroutine is cancelled.
  */
 int coro_bus_broadcast(struct coro_bus *bus, unsigned data);
 
@@ -146,6 +368,34 @@ int coro_bus_broadcast(struct coro_bus *bus, unsigned data);
  */
 int coro_bus_try_broadcast(struct coro_bus *bus, unsigned data);
 
+/**
+ * Same as coro_bus_broadcast(), but can send multiple messages at
+ * once. Sends as many as the fullest of the blocking channels
+ * fits, to all the channels. The ones with a dropping policy can
+ * lose some of them.
+ * @param bus Bus where the channels are located.
+ * @param data Array of messages to send.
+ * @param count Size of @a data.
+ *
+ * @retval >0 Success, how many first messages of @a data were
+ *     sent.
+ * @retval -1 Error. Check coro_bus_errno() for reason.
+ *     - CORO_BUS_ERR_NO_CHANNEL - no channels in the bus.
+ *     - CORO_BUS_ERR_CANCELLED - the coroutine is cancelled.
+ */
+int coro_bus_broadcast_v(struct coro_bus *bus, const unsigned *data, unsigned count);
+
+/**
+ * Same as coro_bus_broadcast_v(), but if any of the blocking
+ * channels are full, it instantly returns, not suspends.
+ *
+ * @retval >0 Success, how many messages were sent.
+ * @retval -1 Error. Check coro_bus_errno() for reason.
+ *     - CORO_BUS_ERR_NO_CHANNEL - no channels in the bus.
+ *     - CORO_BUS_ERR_WOULD_BLOCK - a blocking channel is full.
+ */
+int coro_bus_try_broadcast_v(struct coro_bus *bus, const unsigned *data, unsigned count);
+
 #endif /* Bonus 1 */
 
 #if NEED_BATCH /* Bonus 2 */
@@ -166,6 +416,8 @@ int coro_bus_try_broadcast(struct coro_bus *bus, unsigned data);
  *     messages are sent, they are guaranteed data[0-2].
  * @retval -1 Error. Check coro_bus_errno() for reason.
  *     - CORO_BUS_ERR_NO_CHANNEL - the channel doesn't exist.
+ *     - CORO_BUS_ERR_WRONG_SIZE - the channel is not of unsigned.
+ *     - CORO_BUS_ERR_CANCELLED - the coroutine is cancelled.
  */
 int coro_bus_send_v(struct coro_bus *bus, int channel, const unsigned *data, unsigned count);
 
@@ -182,6 +434,7 @@ int coro_bus_send_v(struct coro_bus *bus, int channel, const unsigned *data, uns
  *     messages are sent, they are guaranteed data[0-2].
  * @retval -1 Error. Check coro_bus_errno() for reason.
  *     - CORO_BUS_ERR_NO_CHANNEL - the channel doesn't exist.
+ *     - CORO_BUS_ERR_WRONG_SIZE - the channel is not of unsigned.
  *     - CORO_BUS_ERR_WOULD_BLOCK - the channel is full.
  */
 int coro_bus_try_send_v(struct coro_bus *bus, int channel, const unsigned *data, unsigned count);
@@ -203,6 +456,8 @@ int coro_bus_try_send_v(struct coro_bus *bus, int channel, const unsigned *data,
  *     data[0-2].
  * @retval -1 Error. Check coro_bus_errno() for reason.
  *     - CORO_BUS_ERR_NO_CHANNEL - the channel doesn't exist.
+ *     - CORO_BUS_ERR_WRONG_SIZE - the channel is not of unsigned.
+ *     - CORO_BUS_ERR_CANCELLED - the coroutine is cancelled.
  */
 int coro_bus_recv_v(struct coro_bus *bus, int channel, unsigned *data, unsigned capacity);
 
@@ -220,6 +475,7 @@ int coro_bus_recv_v(struct coro_bus *bus, int channel, unsigned *data, unsigned
  *     data[0-2].
  * @retval -1 Error. Check coro_bus_errno() for reason.
  *     - CORO_BUS_ERR_NO_CHANNEL - the channel doesn't exist.
+ *     - CORO_BUS_ERR_WRONG_SIZE - the channel is not of unsigned.
  *     - CORO_BUS_ERR_WOULD_BLOCK - the channel is empty.
  */
 int coro_bus_try_recv_v(struct coro_bus *bus, int channel, unsigned *data, unsigned capacity);
@@ -0,0 +1,369 @@
+#include "corobus.h"
+#include "libcoro.h"
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+/**
+ * Throughput of a corobus channel of different sizes, with one
+ * producer and one consumer. The producer fills the channel up,
+ * then the consumer drains it, and so on. Then the same for big
+ * records, copied and passed in place. See the Makefile's
+ * bench_bus target.
+ */
+
+enum {
+	BENCH_MSG_COUNT = 4000000,
+	BENCH_RECORD_COUNT = 1000000,
+	BENCH_RECORD_SIZE = 4096,
+	BENCH_RECORD_SLOTS = 64,
+	BENCH_CROWD_SIZE = 1000,
+	BENCH_CROWD_MSG_COUNT = 1000,
+	BENCH_CROWD_SLOTS = 10,
+	BENCH_CROWD_BATCH = 10,
+	BENCH_TABLE_SIZE = 100000,
+	BENCH_TABLE_OPEN = 10,
+	BENCH_TABLE_BROADCAST_COUNT = 1000000,
+	BENCH_PUBSUB_SUBSCRIBERS = 8,
+	BENCH_PUBSUB_SLOTS = 64,
+	BENCH_PUBSUB_BATCH = 16,
+	BENCH_PUBSUB_MSG_COUNT = 4000000,
+};
+
+struct bench_record {
+	unsigned id;
+	char payload[BENCH_RECORD_SIZE - sizeof(unsigned)];
+};
+
+static uint64_t
+bench_now_ns(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+static struct coro_bus *bench_bus = NULL;
+
+static void *
+bench_producer_f(void *arg)
+{
+	int channel = (int)(long)arg;
+	for (unsigned i = 0; i < BENCH_MSG_COUNT; ++i) {
+		if (coro_bus_send(bench_bus, channel, i) != 0)
+			abort();
+	}
+	return NULL;
+}
+
+static void *
+bench_consumer_f(void *arg)
+{
+	int channel = (int)(long)arg;
+	for (unsigned i = 0; i < BENCH_MSG_COUNT; ++i) {
+		unsigned data;
+		if (coro_bus_recv(bench_bus, channel, &data) != 0 || data != i)
+			abort();
+	}
+	return NULL;
+}
+
+static void
+bench_channel(size_t size)
+{
+	int channel = coro_bus_channel_open(bench_bus, size);
+	if (channel < 0)
+		abort();
+	uint64_t start = bench_now_ns();
+	struct coro *producer = coro_new(bench_producer_f,
+		(void *)(long)channel);
+	struct coro *consumer = coro_new(bench_consumer_f,
+		(void *)(long)channel);
+	coro_join(producer);
+	coro_join(consumer);
+	uint64_t duration = bench_now_ns() - start;
+	coro_bus_channel_close(bench_bus, channel);
+	printf("channel of %zu: %.0f msg/s\n", size,
+		(double)BENCH_MSG_COUNT * 1000000000 / duration);
+}
+
+static void
+bench_record_fill(struct bench_record *rec, unsigned id)
+{
+	rec->id = id;
+	memset(rec->payload, (char)id, sizeof(rec->payload));
+}
+
+static void *
+bench_record_producer_f(void *arg)
+{
+	int channel = (int)(long)arg;
+	struct bench_record rec;
+	for (unsigned i = 0; i < BENCH_RECORD_COUNT; ++i) {
+		bench_record_fill(&rec, i);
+		if (coro_bus_send_elem(bench_bus, channel, &rec,
+				       sizeof(rec)) != 0)
+			abort();
+	}
+	return NULL;
+}
+
+static void *
+bench_record_consumer_f(void *arg)
+{
+	int channel = (int)(long)arg;
+	struct bench_record rec;
+	for (unsigned i = 0; i < BENCH_RECORD_COUNT; ++i) {
+		if (coro_bus_recv_elem(bench_bus, channel, &rec,
+				       sizeof(rec)) != 0 || rec.id != i)
+			abort();
+	}
+	return NULL;
+}
+
+static void *
+bench_record_reserve_f(void *arg)
+{
+	int channel = (int)(long)arg;
+	for (unsigned i = 0; i < BENCH_RECORD_COUNT; ++i) {
+		struct bench_record *rec =
+			coro_bus_send_reserve(bench_bus, channel);
+		if (rec == NULL)
+			abort();
+		bench_record_fill(rec, i);
+		coro_bus_send_commit(bench_bus, channel);
+	}
+	return NULL;
+}
+
+static void *
+bench_record_peek_f(void *arg)
+{
+	int channel = (int)(long)arg;
+	for (unsigned i = 0; i < BENCH_RECORD_COUNT; ++i) {
+		const struct bench_record *rec =
+			coro_bus_recv_peek(bench_bus, channel);
+		if (rec == NULL || rec->id != i)
+			abort();
+		coro_bus_recv_consume(bench_bus, channel);
+	}
+	return NULL;
+}
+
+static void
+bench_records(coro_f producer_f, coro_f consumer_f, const char *name)
+{
+	int channel = coro_bus_channel_open_typed(bench_bus,
+		BENCH_RECORD_SLOTS, sizeof(struct bench_record));
+	if (channel < 0)
+		abort();
+	uint64_t start = bench_now_ns();
+	struct coro *producer = coro_new(producer_f, (void *)(long)channel);
+	struct coro *consumer = coro_new(consumer_f, (void *)(long)channel);
+	coro_join(producer);
+	coro_join(consumer);
+	uint64_t duration = bench_now_ns() - start;
+	coro_bus_channel_close(bench_bus, channel);
+	printf("%d byte records, %s: %.0f msg/s\n", BENCH_RECORD_SIZE, name,
+		(double)BENCH_RECORD_COUNT * 1000000000 / duration);
+}
+
+static bool bench_crowd_is_batch = false;
+
+static void *
+bench_crowd_producer_f(void *arg)
+{
+	int channel = (int)(long)arg;
+	unsigned data[BENCH_CROWD_BATCH] = {0};
+	unsigned sent = 0;
+	while (sent < BENCH_CROWD_MSG_COUNT) {
+		int rc;
+		if (bench_crowd_is_batch)
+			rc = coro_bus_send_v(bench_bus, channel, data,
+				BENCH_CROWD_BATCH);
+		else
+			rc = coro_bus_send(bench_bus, channel, 0) == 0 ? 1 : -1;
+		if (rc < 0)
+			abort();
+		sent += rc;
+		/* Let the others run, like a real work would. */
+		coro_yield();
+	}
+	return NULL;
+}
+
+static void *
+bench_crowd_consumer_f(void *arg)
+{
+	int channel = (int)(long)arg;
+	unsigned data[BENCH_CROWD_BATCH];
+	unsigned received = 0;
+	while (received < BENCH_CROWD_MSG_COUNT) {
+		int rc;
+		if (bench_crowd_is_batch)
+			rc = coro_bus_recv_v(bench_bus, channel, data,
+				BENCH_CROWD_BATCH);
+		else
+			rc = coro_bus_recv(bench_bus, channel, data) == 0 ? 1 : -1;
+		if (rc < 0)
+			abort();
+		received += rc;
+		coro_yield();
+	}
+	return NULL;
+}
+
+/**
+ * Many producers and consumers on one channel. Ideally each
+ * wakeup lets the woken coroutine make progress.
+ */
+static void
+bench_crowd(bool is_batch)
+{
+	bench_crowd_is_batch = is_batch;
+	int channel = coro_bus_channel_open(bench_bus, BENCH_CROWD_SLOTS);
+	if (channel < 0)
+		abort();
+	struct coro **coros = malloc(sizeof(*coros) * BENCH_CROWD_SIZE * 2);
+	struct coro_sched_stats stats_before, stats_after;
+	coro_sched_stats(&stats_before);
+	uint64_t start = bench_now_ns();
+	/* The producers go first, to fill the channel and block. */
+	for (int i = 0; i < BENCH_CROWD_SIZE; ++i) {
+		coros[i] = coro_new(bench_crowd_producer_f,
+			(void *)(long)channel);
+	}
+	for (int i = 0; i < BENCH_CROWD_SIZE; ++i) {
+		coros[BENCH_CROWD_SIZE + i] = coro_new(bench_crowd_consumer_f,
+			(void *)(long)channel);
+	}
+	for (int i = 0; i < BENCH_CROWD_SIZE * 2; ++i)
+		coro_join(coros[i]);
+	uint64_t duration = bench_now_ns() - start;
+	coro_sched_stats(&stats_after);
+	free(coros);
+	coro_bus_channel_close(bench_bus, channel);
+	/* Batches are not always full, count the messages only. */
+	double msg_count = (double)BENCH_CROWD_SIZE * BENCH_CROWD_MSG_COUNT;
+	const char *name = is_batch ? "batch" : "single";
+	printf("%d producers and consumers, %s: %.0f msg/s\n",
+		BENCH_CROWD_SIZE, name, msg_count * 1000000000 / duration);
+	printf("%d producers and consumers, %s: %.2f wakeups per msg\n",
+		BENCH_CROWD_SIZE, name,
+		(stats_after.wakeup_count - stats_before.wakeup_count) /
+		msg_count);
+	printf("%d producers and consumers, %s: %.2f switches per msg\n",
+		BENCH_CROWD_SIZE, name,
+		(stats_after.switch_count - stats_before.switch_count) /
+		msg_count);
+}
+
+/**
+ * Open and close many channels, then broadcast to the few which
+ * are left open among the closed ones.
+ */
+static void
+bench_table(void)
+{
+	int *channels = malloc(sizeof(*channels) * BENCH_TABLE_SIZE);
+	uint64_t start = bench_now_ns();
+	for (int i = 0; i < BENCH_TABLE_SIZE; ++i)
+		channels[i] = coro_bus_channel_open(bench_bus, 1);
+	for (int i = BENCH_TABLE_OPEN; i < BENCH_TABLE_SIZE; ++i)
+		coro_bus_channel_close(bench_bus, channels[i]);
+	uint64_t duration = bench_now_ns() - start;
+	printf("%d channels: %.0f opens and closes/s\n", BENCH_TABLE_SIZE,
+		(double)BENCH_TABLE_SIZE * 2 * 1000000000 / duration);
+
+	start = bench_now_ns();
+	for (unsigned i = 0; i < BENCH_TABLE_BROADCAST_COUNT; ++i) {
+		unsigned data;
+		if (coro_bus_try_broadcast(bench_bus, i) != 0)
+			abort();
+		for (int j = 0; j < BENCH_TABLE_OPEN; ++j) {
+			if (coro_bus_try_recv(bench_bus, channels[j], &data) != 0)
+				abort();
+		}
+	}
+	duration = bench_now_ns() - start;
+	printf("%d of %d channels open: %.0f broadcasts/s\n",
+		BENCH_TABLE_OPEN, BENCH_TABLE_SIZE,
+		(double)BENCH_TABLE_BROADCAST_COUNT * 1000000000 / duration);
+	for (int i = 0; i < BENCH_TABLE_OPEN; ++i)
+		coro_bus_channel_close(bench_bus, channels[i]);
+	free(channels);
+}
+
+/**
+ * Batched broadcast to the subscribers which read everything at
+ * once, with or without one more which never reads. The stuck one
+ * drops its oldest messages and shouldn't slow the others down.
+ */
+static void
+bench_pubsub(bool with_stuck)
+{
+	int channels[BENCH_PUBSUB_SUBSCRIBERS + 1];
+	int count = BENCH_PUBSUB_SUBSCRIBERS + (with_stuck ? 1 : 0);
+	for (int i = 0; i < count; ++i) {
+		channels[i] = coro_bus_channel_open(bench_bus,
+			BENCH_PUBSUB_SLOTS);
+		if (coro_bus_channel_set_overflow(bench_bus, channels[i],
+				CORO_BUS_OVERFLOW_DROP_OLDEST) != 0)
+			abort();
+	}
+	unsigned batch[BENCH_PUBSUB_BATCH] = {0};
+	uint64_t start = bench_now_ns();
+	for (int i = 0; i < BENCH_PUBSUB_MSG_COUNT / BENCH_PUBSUB_BATCH; ++i) {
+		if (coro_bus_try_broadcast_v(bench_bus, batch,
+				BENCH_PUBSUB_BATCH) != BENCH_PUBSUB_BATCH)
+			abort();
+		for (int j = 0; j < BENCH_PUBSUB_SUBSCRIBERS; ++j) {
+			if (coro_bus_try_recv_v(bench_bus, channels[j], batch,
+					BENCH_PUBSUB_BATCH) != BENCH_PUBSUB_BATCH)
+				abort();
+		}
+	}
+	uint64_t duration = bench_now_ns() - start;
+	for (int i = 0; i < count; ++i)
+		coro_bus_channel_close(bench_bus, channels[i]);
+	printf("broadcast to %d subscribers%s: %.0f msg/s\n",
+		BENCH_PUBSUB_SUBSCRIBERS, with_stuck ? " and a stuck one" : "",
+		(double)BENCH_PUBSUB_MSG_COUNT * 1000000000 / duration);
+}
+
+static void *
+bench_main_f(void *arg)
+{
+	(void)arg;
+	bench_bus = coro_bus_new();
+	bench_channel(10);
+	bench_channel(1000);
+	bench_channel(1000000);
+	bench_records(bench_record_producer_f, bench_record_consumer_f,
+		"copied");
+	bench_records(bench_record_reserve_f, bench_record_peek_f,
+		"in place");
+	bench_crowd(false);
+	bench_crowd(true);
+	bench_table();
+	bench_pubsub(false);
+	bench_pubsub(true);
+	coro_bus_delete(bench_bus);
+	return NULL;
+}
+
+int
+main(void)
+{
+	coro_sched_init();
+	struct coro *main_coro = coro_new(bench_main_f, NULL);
+	coro_sched_run();
+	coro_join(main_coro);
+	coro_sched_destroy();
+	return 0;
+}
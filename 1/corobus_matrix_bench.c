@@ -0,0 +1,264 @@
+#include "corobus.h"
+#include "libcoro.h"
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+/**
+ * A matrix of corobus scenarios: 1:1, N:1, 1:N and N:M producers
+ * and consumers, single and batched calls, different channel
+ * sizes, broadcast to K channels. Each scenario is one CSV line on
+ * stdout, so the runs are easy to compare. See the Makefile's
+ * bench_bus_matrix target.
+ *
+ * The throughput is of the received messages, for a broadcast it
+ * counts each copy. The latency is from the send call to the
+ * return of the receive, of each BENCH_SAMPLE_STEP-th message.
+ */
+
+enum {
+	BENCH_MSG_COUNT = 200000,
+	BENCH_BATCH = 16,
+	/** The clock isn't free, so not every message is timed. */
+	BENCH_SAMPLE_STEP = 16,
+	BENCH_SAMPLE_COUNT = BENCH_MSG_COUNT / BENCH_SAMPLE_STEP,
+	BENCH_MAX_PEERS = 16,
+};
+
+struct bench_scenario {
+	const char *name;
+	int producer_count;
+	int consumer_count;
+	/** Channels of a broadcast, one consumer each. 0 - no broadcast. */
+	int broadcast_count;
+	bool is_batch;
+	size_t size_limit;
+};
+
+static uint64_t
+bench_now_ns(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static int
+bench_cmp_u64(const void *a, const void *b)
+{
+	uint64_t l = *(const uint64_t *)a;
+	uint64_t r = *(const uint64_t *)b;
+	return l < r ? -1 : l > r;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+static struct coro_bus *bench_bus = NULL;
+static const struct bench_scenario *bench_cur = NULL;
+static int bench_channels[BENCH_MAX_PEERS];
+/** Send time of each sampled message, 0 if not sent yet. */
+static uint64_t bench_send_ns[BENCH_SAMPLE_COUNT];
+static uint64_t bench_samples[BENCH_SAMPLE_COUNT * BENCH_MAX_PEERS];
+static size_t bench_sample_count = 0;
+static size_t bench_recv_count = 0;
+
+static int
+bench_send(const unsigned *data, unsigned count)
+{
+	if (bench_cur->broadcast_count != 0) {
+		if (bench_cur->is_batch)
+			return coro_bus_broadcast_v(bench_bus, data, count);
+		return coro_bus_broadcast(bench_bus, data[0]) == 0 ? 1 : -1;
+	}
+	if (bench_cur->is_batch)
+		return coro_bus_send_v(bench_bus, bench_channels[0], data, count);
+	return coro_bus_send(bench_bus, bench_channels[0], data[0]) == 0 ?
+	       1 : -1;
+}
+
+static void *
+bench_producer_f(void *arg)
+{
+	unsigned per_producer = BENCH_MSG_COUNT / bench_cur->producer_count;
+	unsigned next = (unsigned)(long)arg * per_producer;
+	unsigned end = next + per_producer;
+	unsigned data[BENCH_BATCH];
+	while (next < end) {
+		unsigned count = 1;
+		if (bench_cur->is_batch)
+			count = end - next < BENCH_BATCH ? end - next : BENCH_BATCH;
+		for (unsigned i = 0; i < count; ++i) {
+			unsigned id = next + i;
+			data[i] = id;
+			/* A partially sent batch is retried, keep the time. */
+			if (id % BENCH_SAMPLE_STEP == 0 &&
+			    bench_send_ns[id / BENCH_SAMPLE_STEP] == 0)
+				bench_send_ns[id / BENCH_SAMPLE_STEP] = bench_now_ns();
+		}
+		int rc = bench_send(data, count);
+		if (rc < 0)
+			abort();
+		next += rc;
+	}
+	return NULL;
+}
+
+static void *
+bench_consumer_f(void *arg)
+{
+	int channel = bench_channels[(int)(long)arg];
+	unsigned data[BENCH_BATCH];
+	while (true) {
+		int rc;
+		if (bench_cur->is_batch)
+			rc = coro_bus_recv_v(bench_bus, channel, data, BENCH_BATCH);
+		else
+			rc = coro_bus_recv(bench_bus, channel, data) == 0 ? 1 : -1;
+		if (rc < 0) {
+			/* Closed when everything is received. */
+			if (coro_bus_errno() != CORO_BUS_ERR_NO_CHANNEL)
+				abort();
+			return NULL;
+		}
+		uint64_t now = 0;
+		for (int i = 0; i < rc; ++i) {
+			if (data[i] % BENCH_SAMPLE_STEP != 0)
+				continue;
+			if (now == 0)
+				now = bench_now_ns();
+			bench_samples[bench_sample_count++] =
+				now - bench_send_ns[data[i] / BENCH_SAMPLE_STEP];
+		}
+		bench_recv_count += rc;
+	}
+}
+
+static uint64_t
+bench_percentile(int permille)
+{
+	return bench_samples[bench_sample_count * permille / 1000];
+}
+
+static void
+bench_run(const struct bench_scenario *s)
+{
+	bench_cur = s;
+	int channel_count = s->broadcast_count != 0 ? s->broadcast_count : 1;
+	for (int i = 0; i < channel_count; ++i) {
+		bench_channels[i] = coro_bus_channel_open(bench_bus,
+			s->size_limit);
+		if (bench_channels[i] < 0)
+			abort();
+	}
+	memset(bench_send_ns, 0, sizeof(bench_send_ns));
+	bench_sample_count = 0;
+	bench_recv_count = 0;
+	size_t total = (size_t)BENCH_MSG_COUNT * channel_count;
+	struct coro *consumers[BENCH_MAX_PEERS];
+	struct coro *producers[BENCH_MAX_PEERS];
+
+	struct coro_sched_stats stats_before, stats_after;
+	coro_sched_stats(&stats_before);
+	uint64_t start = bench_now_ns();
+	/* The consumers go first, to block and wait for the messages. */
+	for (int i = 0; i < s->consumer_count; ++i) {
+		long channel = s->broadcast_count != 0 ? i : 0;
+		consumers[i] = coro_new(bench_consumer_f, (void *)channel);
+	}
+	for (int i = 0; i < s->producer_count; ++i)
+		producers[i] = coro_new(bench_producer_f, (void *)(long)i);
+	for (int i = 0; i < s->producer_count; ++i)
+		coro_join(producers[i]);
+	while (bench_recv_count < total)
+		coro_yield();
+	uint64_t duration = bench_now_ns() - start;
+	coro_sched_stats(&stats_after);
+	for (int i = 0; i < channel_count; ++i)
+		coro_bus_channel_close(bench_bus, bench_channels[i]);
+	for (int i = 0; i < s->consumer_count; ++i)
+		coro_join(consumers[i]);
+
+	qsort(bench_samples, bench_sample_count, sizeof(bench_samples[0]),
+		bench_cmp_u64);
+	printf("%s,%d,%d,%d,%s,%zu,%.0f,%llu,%llu,%llu,%llu,%.3f,%.3f\n",
+		s->name, s->producer_count, s->consumer_count, channel_count,
+		s->is_batch ? "batch" : "single", s->size_limit,
+		(double)total * 1000000000 / duration,
+		(unsigned long long)bench_percentile(500),
+		(unsigned long long)bench_percentile(900),
+		(unsigned long long)bench_percentile(990),
+		(unsigned long long)bench_percentile(999),
+		(double)(stats_after.wakeup_count - stats_before.wakeup_count) /
+		total,
+		(double)(stats_after.switch_count - stats_before.switch_count) /
+		total);
+}
+
+static void *
+bench_main_f(void *arg)
+{
+	(void)arg;
+	static const struct {
+		const char *name;
+		int producer_count;
+		int consumer_count;
+	} patterns[] = {
+		{"1:1", 1, 1},
+		{"N:1", 4, 1},
+		{"1:N", 1, 4},
+		{"N:M", 4, 4},
+	};
+	static const size_t size_limits[] = {1, 16, 1024};
+	static const int broadcast_counts[] = {1, 4, 16};
+
+	bench_bus = coro_bus_new();
+	printf("scenario,producers,consumers,channels,call,size_limit,"
+	       "msg_per_sec,p50_ns,p90_ns,p99_ns,p999_ns,"
+	       "wakeups_per_msg,switches_per_msg\n");
+	for (size_t p = 0; p < sizeof(patterns) / sizeof(patterns[0]); ++p) {
+		for (int is_batch = 0; is_batch <= 1; ++is_batch) {
+			for (size_t l = 0;
+			     l < sizeof(size_limits) / sizeof(size_limits[0]);
+			     ++l) {
+				struct bench_scenario s = {
+					.name = patterns[p].name,
+					.producer_count = patterns[p].producer_count,
+					.consumer_count = patterns[p].consumer_count,
+					.is_batch = is_batch,
+					.size_limit = size_limits[l],
+				};
+				bench_run(&s);
+			}
+		}
+	}
+	for (size_t b = 0;
+	     b < sizeof(broadcast_counts) / sizeof(broadcast_counts[0]); ++b) {
+		for (int is_batch = 0; is_batch <= 1; ++is_batch) {
+			struct bench_scenario s = {
+				.name = "broadcast",
+				.producer_count = 1,
+				.consumer_count = broadcast_counts[b],
+				.broadcast_count = broadcast_counts[b],
+				.is_batch = is_batch,
+				.size_limit = 16,
+			};
+			bench_run(&s);
+		}
+	}
+	coro_bus_delete(bench_bus);
+	return NULL;
+}
+
+int
+main(void)
+{
+	coro_sched_init();
+	struct coro *main_coro = coro_new(bench_main_f, NULL);
+	coro_sched_run();
+	coro_join(main_coro);
+	coro_sched_destroy();
+	return 0;
+}
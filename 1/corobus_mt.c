@@ -0,0 +1,429 @@
+#include "corobus.h"
+
+#include "libcoro.h"
+#include "rlist.h"
+
+#include <assert.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <linux/futex.h>
+#include <sys/syscall.h>
+
+/**
+ * The thread-safe flavour of the bus. The messages go through a
+ * bounded MPMC ring by Dmitry Vyukov: each cell has a sequence
+ * number telling whether it is free for the lap of the writer or
+ * filled for the lap of the reader. Then a send or a receive is
+ * one CAS on a position, without locks.
+ *
+ * Only the waiters take a lock. A coroutine is suspended and woken
+ * up with coro_wakeup(), which works across the threads of
+ * coro_sched_run_threads(). A plain thread, not a coroutine, is
+ * parked on a futex.
+ */
+
+enum {
+	MT_CACHE_LINE = 64,
+};
+
+struct mt_cell
+{
+	size_t seq;
+	unsigned data;
+};
+
+struct mt_ring
+{
+	struct mt_cell *cells;
+	size_t capacity;
+	/**
+	 * How many messages can be in the ring. The cells are at least
+	 * 2, because with one the sequence of the filled cell would be
+	 * the one of the free cell of the next lap.
+	 */
+	size_t size_limit;
+	/** The positions are hot, keep them in own cache lines. */
+	size_t push_pos __attribute__((aligned(MT_CACHE_LINE)));
+	size_t pop_pos __attribute__((aligned(MT_CACHE_LINE)));
+};
+
+static void mt_ring_create(struct mt_ring *ring, size_t size_limit)
+{
+	size_t capacity = size_limit < 2 ? 2 : size_limit;
+	ring->cells = malloc(sizeof(ring->cells[0]) * capacity);
+	for (size_t i = 0; i < capacity; i++)
+		ring->cells[i].seq = i;
+	ring->capacity = capacity;
+	ring->size_limit = size_limit;
+	ring->push_pos = 0;
+	ring->pop_pos = 0;
+}
+
+static bool mt_ring_push(struct mt_ring *ring, unsigned data)
+{
+	size_t pos = __atomic_load_n(&ring->push_pos, __ATOMIC_RELAXED);
+	struct mt_cell *cell;
+	while (true)
+	{
+		cell = &ring->cells[pos % ring->capacity];
+		size_t seq = __atomic_load_n(&cell->seq, __ATOMIC_ACQUIRE);
+		intptr_t diff = (intptr_t)seq - (intptr_t)pos;
+		if (diff == 0) {
+			/*
+			 * The read position only grows, so a stale one can
+			 * only make the ring look fuller than it is.
+			 */
+			if (ring->size_limit < ring->capacity &&
+			    pos - __atomic_load_n(&ring->pop_pos, __ATOMIC_ACQUIRE) >=
+			    ring->size_limit)
+				return false;
+			if (__atomic_compare_exchange_n(&ring->push_pos, &pos, pos + 1, true,
+							__ATOMIC_RELAXED, __ATOMIC_RELAXED))
+				break;
+		} else if (diff < 0) {
+			/* The cell is not read yet on the previous lap. */
+			return false;
+		} else {
+			pos = __atomic_load_n(&ring->push_pos, __ATOMIC_RELAXED);
+		}
+	}
+	cell->data = data;
+	__atomic_store_n(&cell->seq, pos + 1, __ATOMIC_RELEASE);
+	return true;
+}
+
+static bool mt_ring_pop(struct mt_ring *ring, unsigned *data)
+{
+	size_t pos = __atomic_load_n(&ring->pop_pos, __ATOMIC_RELAXED);
+	struct mt_cell *cell;
+	while (true)
+	{
+		cell = &ring->cells[pos % ring->capacity];
+		size_t seq = __atomic_load_n(&cell->seq, __ATOMIC_ACQUIRE);
+		intptr_t diff = (intptr_t)seq - (intptr_t)(pos + 1);
+		if (diff == 0) {
+			if (__atomic_compare_exchange_n(&ring->pop_pos, &pos, pos + 1, true,
+							__ATOMIC_RELAXED, __ATOMIC_RELAXED))
+				break;
+		} else if (diff < 0) {
+			/* The cell is not written yet on this lap. */
+			return false;
+		} else {
+			pos = __atomic_load_n(&ring->pop_pos, __ATOMIC_RELAXED);
+		}
+	}
+	*data = cell->data;
+	/* Free for the writer of the next lap. */
+	__atomic_store_n(&cell->seq, pos + ring->capacity, __ATOMIC_RELEASE);
+	return true;
+}
+
+/** A coroutine or a thread waiting in a queue of a channel. */
+struct mt_waiter
+{
+	struct rlist base;
+	/** NULL for a thread, which waits on the futex. */
+	struct coro *coro;
+	uint32_t futex;
+};
+
+/** Waiters of one side of a channel. */
+struct mt_wait_queue
+{
+	struct rlist waiters;
+	/** Read without the lock to skip it when nobody waits. */
+	size_t count;
+	bool lock;
+};
+
+/** Let the other hyper-thread run while spinning. */
+static inline void mt_cpu_relax(void)
+{
+#if defined(__x86_64__) || defined(__i386__)
+	__asm__ volatile("pause");
+#elif defined(__aarch64__)
+	__asm__ volatile("yield");
+#endif
+}
+
+static void mt_wait_queue_lock(struct mt_wait_queue *queue)
+{
+	while (__atomic_test_and_set(&queue->lock, __ATOMIC_ACQUIRE)) {
+		while (__atomic_load_n(&queue->lock, __ATOMIC_RELAXED))
+			mt_cpu_relax();
+	}
+}
+
+static void mt_wait_queue_unlock(struct mt_wait_queue *queue)
+{
+	__atomic_clear(&queue->lock, __ATOMIC_RELEASE);
+}
+
+static void mt_wait_queue_add(struct mt_wait_queue *queue, struct mt_waiter *waiter)
+{
+	mt_wait_queue_lock(queue);
+	rlist_add_tail_entry(&queue->waiters, waiter, base);
+	__atomic_add_fetch(&queue->count, 1, __ATOMIC_SEQ_CST);
+	mt_wait_queue_unlock(queue);
+}
+
+/**
+ * Take the waiter out of the queue, if it is still there.
+ * @retval true It was in the queue.
+ * @retval false A waker took it already.
+ */
+static bool mt_wait_queue_del(struct mt_wait_queue *queue, struct mt_waiter *waiter)
+{
+	mt_wait_queue_lock(queue);
+	bool is_linked = !rlist_empty(&waiter->base);
+	if (is_linked) {
+		rlist_del_entry(waiter, base);
+		__atomic_sub_fetch(&queue->count, 1, __ATOMIC_SEQ_CST);
+	}
+	mt_wait_queue_unlock(queue);
+	return is_linked;
+}
+
+/** Wake up to @a count first waiters. */
+static void mt_wait_queue_wakeup(struct mt_wait_queue *queue, size_t count)
+{
+	/*
+	 * Pairs with the fence of the waiter. Either the waiter sees
+	 * the change in the ring, or this thread sees the waiter.
+	 */
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	if (__atomic_load_n(&queue->count, __ATOMIC_RELAXED) == 0)
+		return;
+	mt_wait_queue_lock(queue);
+	for (; count > 0 && !rlist_empty(&queue->waiters); --count) {
+		struct mt_waiter *waiter = rlist_shift_entry(&queue->waiters, struct mt_waiter, base);
+		__atomic_sub_fetch(&queue->count, 1, __ATOMIC_SEQ_CST);
+		/*
+		 * Under the lock, or the waiter could see that it is out
+		 * of the queue, leave and free the entry before the use.
+		 */
+		if (waiter->coro != NULL) {
+			coro_wakeup(waiter->coro);
+		} else {
+			__atomic_store_n(&waiter->futex, 1, __ATOMIC_RELEASE);
+			syscall(SYS_futex, &waiter->futex, FUTEX_WAKE_PRIVATE, 1, NULL, NULL, 0);
+		}
+	}
+	mt_wait_queue_unlock(queue);
+}
+
+struct coro_bus_mt_channel
+{
+	struct mt_ring ring;
+	struct mt_wait_queue send_queue;
+	struct mt_wait_queue recv_queue;
+	bool is_closed;
+};
+
+struct coro_bus_mt
+{
+	/** Fixed, so the lookups need no lock. */
+	struct coro_bus_mt_channel **channels;
+	int channel_max;
+	int channel_count;
+};
+
+struct coro_bus_mt *coro_bus_mt_new(int channel_max)
+{
+	coro_bus_errno_set(CORO_BUS_ERR_NONE);
+	struct coro_bus_mt *bus = calloc(1, sizeof(*bus));
+	bus->channels = calloc(channel_max, sizeof(bus->channels[0]));
+	bus->channel_max = channel_max;
+	return bus;
+}
+
+void coro_bus_mt_delete(struct coro_bus_mt *bus)
+{
+	coro_bus_errno_set(CORO_BUS_ERR_NONE);
+	for (int i = 0; i < bus->channel_count; i++)
+	{
+		struct coro_bus_mt_channel *channel = bus->channels[i];
+		assert(rlist_empty(&channel->send_queue.waiters));
+		assert(rlist_empty(&channel->recv_queue.waiters));
+		free(channel->ring.cells);
+		free(channel);
+	}
+	free(bus->channels);
+	free(bus);
+}
+
+int coro_bus_mt_channel_open(struct coro_bus_mt *bus, size_t size_limit)
+{
+	coro_bus_errno_set(CORO_BUS_ERR_NONE);
+	assert(size_limit > 0);
+	struct coro_bus_mt_channel *channel;
+	if (posix_memalign((void **)&channel, MT_CACHE_LINE, sizeof(*channel)) != 0)
+		abort();
+	mt_ring_create(&channel->ring, size_limit);
+	rlist_create(&channel->send_queue.waiters);
+	channel->send_queue.count = 0;
+	channel->send_queue.lock = false;
+	rlist_create(&channel->recv_queue.waiters);
+	channel->recv_queue.count = 0;
+	channel->recv_queue.lock = false;
+	channel->is_closed = false;
+
+	int descriptor = __atomic_fetch_add(&bus->channel_count, 1, __ATOMIC_RELAXED);
+	if (descriptor >= bus->channel_max)
+	{
+		__atomic_sub_fetch(&bus->channel_count, 1, __ATOMIC_RELAXED);
+		free(channel->ring.cells);
+		free(channel);
+		coro_bus_errno_set(CORO_BUS_ERR_NO_CHANNEL);
+		return -1;
+	}
+	__atomic_store_n(&bus->channels[descriptor], channel, __ATOMIC_RELEASE);
+	return descriptor;
+}
+
+/** Get an open channel, or set the error. */
+static struct coro_bus_mt_channel *mt_get_channel(struct coro_bus_mt *bus, int descriptor)
+{
+	struct coro_bus_mt_channel *channel = NULL;
+	if (descriptor >= 0 && descriptor < bus->channel_max)
+		channel = __atomic_load_n(&bus->channels[descriptor], __ATOMIC_ACQUIRE);
+	if (channel == NULL || __atomic_load_n(&channel->is_closed, __ATOMIC_ACQUIRE))
+	{
+		coro_bus_errno_set(CORO_BUS_ERR_NO_CHANNEL);
+		return NULL;
+	}
+	return channel;
+}
+
+void coro_bus_mt_channel_close(struct coro_bus_mt *bus, int descriptor)
+{
+	struct coro_bus_mt_channel *channel = mt_get_channel(bus, descriptor);
+	if (!channel)
+		return;
+	coro_bus_errno_set(CORO_BUS_ERR_NONE);
+	__atomic_store_n(&channel->is_closed, true, __ATOMIC_RELEASE);
+	mt_wait_queue_wakeup(&channel->send_queue, SIZE_MAX);
+	mt_wait_queue_wakeup(&channel->recv_queue, SIZE_MAX);
+}
+
+/**
+ * Wait until a send or a receive can be retried.
+ * @param is_send Wait for a free slot, otherwise for a message.
+ * @param data The message to send or the buffer to receive into.
+ *     The operation is tried again after joining the queue,
+ *     because the ring might change by then.
+ * @retval 1 The operation succeeded while joining the queue.
+ * @retval 0 Woken up, retry.
+ * @retval -1 The coroutine is cancelled, the error is set.
+ */
+static int mt_wait(struct coro_bus_mt_channel *channel, bool is_send, unsigned *data)
+{
+	struct mt_wait_queue *queue = is_send ? &channel->send_queue : &channel->recv_queue;
+	struct mt_waiter waiter;
+	waiter.coro = coro_this();
+	waiter.futex = 0;
+	mt_wait_queue_add(queue, &waiter);
+	/* Pairs with the fence of the waker and of the close. */
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	if (__atomic_load_n(&channel->is_closed, __ATOMIC_ACQUIRE))
+	{
+		mt_wait_queue_del(queue, &waiter);
+		return 0;
+	}
+	bool is_done = is_send ? mt_ring_push(&channel->ring, *data) :
+		       mt_ring_pop(&channel->ring, data);
+	if (is_done)
+	{
+		/*
+		 * A wakeup might already be sent. To a coroutine it
+		 * is a spurious return of a later suspend, which is
+		 * fine.
+		 */
+		mt_wait_queue_del(queue, &waiter);
+		return 1;
+	}
+	if (waiter.coro == NULL)
+	{
+		while (__atomic_load_n(&waiter.futex, __ATOMIC_ACQUIRE) == 0)
+			syscall(SYS_futex, &waiter.futex, FUTEX_WAIT_PRIVATE, 0, NULL, NULL, 0);
+		return 0;
+	}
+	bool is_woken_up = coro_suspend();
+	if (mt_wait_queue_del(queue, &waiter) && !is_woken_up)
+	{
+		coro_bus_errno_set(CORO_BUS_ERR_CANCELLED);
+		return -1;
+	}
+	return 0;
+}
+
+int coro_bus_mt_try_send(struct coro_bus_mt *bus, int channel, unsigned data)
+{
+	coro_bus_errno_set(CORO_BUS_ERR_NONE);
+	struct coro_bus_mt_channel *send_channel = mt_get_channel(bus, channel);
+	if (!send_channel)
+		return -1;
+	if (!mt_ring_push(&send_channel->ring, data))
+	{
+		coro_bus_errno_set(CORO_BUS_ERR_WOULD_BLOCK);
+		return -1;
+	}
+	mt_wait_queue_wakeup(&send_channel->recv_queue, 1);
+	return 0;
+}
+
+int coro_bus_mt_send(struct coro_bus_mt *bus, int channel, unsigned data)
+{
+	coro_bus_errno_set(CORO_BUS_ERR_NONE);
+	while (true)
+	{
+		if (!coro_bus_mt_try_send(bus, channel, data)) return 0;
+		if (coro_bus_errno() != CORO_BUS_ERR_WOULD_BLOCK) return -1;
+		struct coro_bus_mt_channel *send_channel = bus->channels[channel];
+		int rc = mt_wait(send_channel, true, &data);
+		if (rc < 0)
+			return -1;
+		if (rc > 0)
+		{
+			mt_wait_queue_wakeup(&send_channel->recv_queue, 1);
+			coro_bus_errno_set(CORO_BUS_ERR_NONE);
+			return 0;
+		}
+	}
+}
+
+int coro_bus_mt_try_recv(struct coro_bus_mt *bus, int channel, unsigned *data)
+{
+	coro_bus_errno_set(CORO_BUS_ERR_NONE);
+	struct coro_bus_mt_channel *recv_channel = mt_get_channel(bus, channel);
+	if (!recv_channel)
+		return -1;
+	if (!mt_ring_pop(&recv_channel->ring, data))
+	{
+		coro_bus_errno_set(CORO_BUS_ERR_WOULD_BLOCK);
+		return -1;
+	}
+	mt_wait_queue_wakeup(&recv_channel->send_queue, 1);
+	return 0;
+}
+
+int coro_bus_mt_recv(struct coro_bus_mt *bus, int channel, unsigned *data)
+{
+	coro_bus_errno_set(CORO_BUS_ERR_NONE);
+	while (true)
+	{
+		if (!coro_bus_mt_try_recv(bus, channel, data)) return 0;
+		if (coro_bus_errno() != CORO_BUS_ERR_WOULD_BLOCK) return -1;
+		struct coro_bus_mt_channel *recv_channel = bus->channels[channel];
+		int rc = mt_wait(recv_channel, false, data);
+		if (rc < 0)
+			return -1;
+		if (rc > 0)
+		{
+			mt_wait_queue_wakeup(&recv_channel->send_queue, 1);
+			coro_bus_errno_set(CORO_BUS_ERR_NONE);
+			return 0;
+		}
+	}
+}
@@ -1,3 +1,5 @@
+#define _GNU_SOURCE
+
 #include "libcoro.h"
 
 #include "rlist.h"
@@ -10,346 +12,3308 @@
 #include <signal.h>
 #include <errno.h>
 #include <string.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <limits.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+#if LIBCORO_IO == LIBCORO_IO_URING
+#include <poll.h>
+#include <linux/io_uring.h>
+#endif
+#if LIBCORO_CTX == LIBCORO_CTX_UCONTEXT
+#include <ucontext.h>
+#endif
 
 #define handle_error() do {														\
 	printf("Error %s\n", strerror(errno));										\
 	exit(-1);																	\
 } while(0)
 
-enum coro_state {
-	CORO_STATE_RUNNING,
-	CORO_STATE_SUSPENDED,
-	CORO_STATE_FINISHED,
-};
-
-/** Main coroutine structure, its context. */
-struct coro {
-	/** Coroutine state. */
-	enum coro_state state;
-	/** A value, returned by func. */
-	void *ret;
-	/** Stack, used by the coroutine. */
-	void *stack;
-	/** An argument for the function func. */
-	void *func_arg;
-	/** A function to call as a coroutine. */
-	coro_f func;
-	/** Last remembered coroutine context. */
-	sigjmp_buf ctx;
+/**
+ * Saved execution context of a coroutine. What it consists of
+ * depends on the selected backend.
+ */
+struct coro_ctx {
+#if LIBCORO_CTX == LIBCORO_CTX_ASM
 	/**
-	 * Coroutine which is trying to join this one right now.
+	 * Stack pointer. All the callee-saved registers are
+	 * stored on the stack right below it.
 	 */
-	struct coro *joiner;
-	/** Links in a coroutine list, used by the scheduler. */
-	struct rlist link;
+	void *sp;
+#elif LIBCORO_CTX == LIBCORO_CTX_UCONTEXT
+	ucontext_t uc;
+#else
+	sigjmp_buf buf;
+#endif
 };
 
-struct coro_engine {
-	/**
-	 * Scheduler is the main coroutine - it represents the
-	 * context in which the scheduler itself runs.
-	 */
-	struct coro sched;
-	/** Which coroutine works at this moment. */
-	struct coro *this;
+#if LIBCORO_CTX == LIBCORO_CTX_ASM
+
+/**
+ * Save the callee-saved registers of the current context on its
+ * stack, store the stack pointer into *from_sp, and continue from
+ * to_sp. Everything else is saved by the caller as per the ABI.
+ * On x86-64 the control words of SSE and x87 are callee-saved too,
+ * so a coroutine changing the rounding mode doesn't change it for
+ * the others.
+ */
+void
+coro_ctx_switch_asm(void **from_sp, void *to_sp);
+
+#if defined(__x86_64__)
+
+__asm__(
+	".text\n"
+	".p2align 4\n"
+	".hidden coro_ctx_switch_asm\n"
+	".globl coro_ctx_switch_asm\n"
+	".type coro_ctx_switch_asm, @function\n"
+"coro_ctx_switch_asm:\n"
+	"pushq %rbp\n"
+	"pushq %rbx\n"
+	"pushq %r12\n"
+	"pushq %r13\n"
+	"pushq %r14\n"
+	"pushq %r15\n"
+	"leaq -8(%rsp), %rsp\n"
+	"stmxcsr (%rsp)\n"
+	"fnstcw 4(%rsp)\n"
+	"movq %rsp, (%rdi)\n"
+	"movq %rsi, %rsp\n"
+	"ldmxcsr (%rsp)\n"
+	"fldcw 4(%rsp)\n"
+	"leaq 8(%rsp), %rsp\n"
+	"popq %r15\n"
+	"popq %r14\n"
+	"popq %r13\n"
+	"popq %r12\n"
+	"popq %rbx\n"
+	"popq %rbp\n"
+	"ret\n"
+	".size coro_ctx_switch_asm, .-coro_ctx_switch_asm\n"
+);
+
+/**
+ * MXCSR and the x87 control word in one word, r15, r14, r13, r12,
+ * rbx, rbp, return address.
+ */
+enum { CORO_CTX_FRAME_WORDS = 8 };
+/** Index of the return address in the initial frame. */
+enum { CORO_CTX_FRAME_RET = 7 };
+/**
+ * A zero fake return address of the entry above the frame. With it
+ * rsp + 8 is 16-aligned at the entry start, as the ABI wants, and
+ * the backtraces terminate.
+ */
+enum { CORO_CTX_FRAME_PAD = 1 };
+
+#elif defined(__aarch64__)
+
+__asm__(
+	".text\n"
+	".p2align 4\n"
+	".hidden coro_ctx_switch_asm\n"
+	".globl coro_ctx_switch_asm\n"
+	".type coro_ctx_switch_asm, %function\n"
+"coro_ctx_switch_asm:\n"
+	"sub sp, sp, #160\n"
+	"stp d8, d9, [sp, #0]\n"
+	"stp d10, d11, [sp, #16]\n"
+	"stp d12, d13, [sp, #32]\n"
+	"stp d14, d15, [sp, #48]\n"
+	"stp x19, x20, [sp, #64]\n"
+	"stp x21, x22, [sp, #80]\n"
+	"stp x23, x24, [sp, #96]\n"
+	"stp x25, x26, [sp, #112]\n"
+	"stp x27, x28, [sp, #128]\n"
+	"stp x29, x30, [sp, #144]\n"
+	"mov x2, sp\n"
+	"str x2, [x0]\n"
+	"mov sp, x1\n"
+	"ldp d8, d9, [sp, #0]\n"
+	"ldp d10, d11, [sp, #16]\n"
+	"ldp d12, d13, [sp, #32]\n"
+	"ldp d14, d15, [sp, #48]\n"
+	"ldp x19, x20, [sp, #64]\n"
+	"ldp x21, x22, [sp, #80]\n"
+	"ldp x23, x24, [sp, #96]\n"
+	"ldp x25, x26, [sp, #112]\n"
+	"ldp x27, x28, [sp, #128]\n"
+	"ldp x29, x30, [sp, #144]\n"
+	"add sp, sp, #160\n"
+	"ret\n"
+	".size coro_ctx_switch_asm, .-coro_ctx_switch_asm\n"
+);
+
+/** d8-d15, x19-x28, x29 (frame pointer), x30 (link register). */
+enum { CORO_CTX_FRAME_WORDS = 20 };
+/** Index of the return address (x30) in the initial frame. */
+enum { CORO_CTX_FRAME_RET = 19 };
+/**
+ * The return address is in x30, nothing is popped. And sp must be
+ * 16-aligned at any time, so the frame is right at the stack top.
+ */
+enum { CORO_CTX_FRAME_PAD = 0 };
+
+#else
+#error "LIBCORO_CTX_ASM is supported only on x86-64 and aarch64"
+#endif
+
+#endif /* LIBCORO_CTX == LIBCORO_CTX_ASM */
+
+#if LIBCORO_CTX != LIBCORO_CTX_SIGNAL
+
+/**
+ * Prepare a context which on the first switch to it starts
+ * executing @a entry on the given stack. The function must never
+ * return. Not used by the signal backend, it creates contexts in
+ * its own way.
+ */
+static void
+coro_ctx_make(struct coro_ctx *ctx, void *stack, size_t stack_size,
+	void (*entry)(void))
+{
+#if LIBCORO_CTX == LIBCORO_CTX_ASM
+	uintptr_t top = ((uintptr_t)stack + stack_size) & ~(uintptr_t)15;
+	/* The entry is "returned to" by the switch function. */
+	void **frame = (void **)top - CORO_CTX_FRAME_WORDS - CORO_CTX_FRAME_PAD;
+	/* The stack pointer at the entry start, as if it was called. */
+	assert(((uintptr_t)&frame[CORO_CTX_FRAME_WORDS] & 15) ==
+	       CORO_CTX_FRAME_PAD * sizeof(*frame));
+	memset(frame, 0, (CORO_CTX_FRAME_WORDS + CORO_CTX_FRAME_PAD) *
+	       sizeof(*frame));
+#if defined(__x86_64__)
+	/* The control words are inherited from the creator. */
+	__asm__ volatile("stmxcsr %0" : "=m"(*(uint32_t *)&frame[0]));
+	__asm__ volatile("fnstcw %0" : "=m"(*((uint16_t *)&frame[0] + 2)));
+#endif
+	frame[CORO_CTX_FRAME_RET] = (void *)entry;
+	ctx->sp = frame;
+#elif LIBCORO_CTX == LIBCORO_CTX_UCONTEXT
+	if (getcontext(&ctx->uc) != 0)
+		handle_error();
+	ctx->uc.uc_stack.ss_sp = stack;
+	ctx->uc.uc_stack.ss_size = stack_size;
+	ctx->uc.uc_link = NULL;
+	makecontext(&ctx->uc, entry, 0);
+#endif
+}
+
+#endif /* LIBCORO_CTX != LIBCORO_CTX_SIGNAL */
+
+/**
+ * Stack pointer of a switched out context. Nothing below it is
+ * used till the context is switched to. NULL - the backend doesn't
+ * tell, sigjmp_buf keeps it mangled.
+ */
+static void *
+coro_ctx_sp(const struct coro_ctx *ctx)
+{
+#if LIBCORO_CTX == LIBCORO_CTX_ASM
+	return ctx->sp;
+#elif LIBCORO_CTX == LIBCORO_CTX_UCONTEXT && defined(__x86_64__)
+	return (void *)ctx->uc.uc_mcontext.gregs[REG_RSP];
+#elif LIBCORO_CTX == LIBCORO_CTX_UCONTEXT && defined(__aarch64__)
+	return (void *)ctx->uc.uc_mcontext.sp;
+#else
+	(void)ctx;
+	return NULL;
+#endif
+}
+
+/** Save the current context into @a from and jump to @a to. */
+static inline void
+coro_ctx_switch(struct coro_ctx *from, struct coro_ctx *to)
+{
+#if LIBCORO_CTX == LIBCORO_CTX_ASM
+	coro_ctx_switch_asm(&from->sp, to->sp);
+#elif LIBCORO_CTX == LIBCORO_CTX_UCONTEXT
+	if (swapcontext(&from->uc, &to->uc) != 0)
+		handle_error();
+#else
+	if (sigsetjmp(from->buf, 0) == 0)
+		siglongjmp(to->buf, 1);
+#endif
+}
 
+/**
+ * Coroutine stack. It is an own anonymous mapping with a PROT_NONE
+ * guard page right below it, so an overflow crashes immediately
+ * instead of corrupting the neighbour memory. The pages are
+ * committed by the kernel lazily, when touched.
+ */
+struct coro_stack {
+	/** Start of the usable memory, right above the guard page. */
+	void *base;
+	/** Usable size in bytes, a multiple of the page size. */
+	size_t size;
 	/**
-	 * Coroutines to run in this iteration of the loop. The
-	 * list gets populated once at the start of the iteration.
+	 * While the coroutine is in the pool, its stack is not used
+	 * below this address. That part can be given back to the
+	 * kernel.
 	 */
-	struct rlist coros_running_now;
+	char *idle_end;
+	/** The idle part is given back, and is zero-filled now. */
+	bool is_trimmed;
+};
+
+enum {
+	/** Stack size used when nothing else is specified. */
+	CORO_STACK_SIZE_DEFAULT = 1024 * 1024,
 	/**
-	 * Coroutines to run in the next iteration of the loop.
-	 * The list gets populated by wakeups and yields and new
-	 * coros.
+	 * Stacks of up to 2^(CORO_STACK_CLASS_COUNT - 1) pages are
+	 * rounded up to a power of two of pages. Then a pooled
+	 * stack fits any request of its class.
 	 */
-	struct rlist coros_running_next;
-	/** Joined coroutines to be reused. */
-	struct rlist coros_pool;
-	/** Total number of coroutines, including the pool. */
-	size_t coro_count;
+	CORO_STACK_CLASS_COUNT = 16,
 	/**
-	 * Buffer, used by the coroutine constructor to escape
-	 * from the signal handler back into the constructor to
-	 * rollback sigaltstack etc.
+	 * Space below the frame of a pooled coroutine which is kept
+	 * by the trim, for the frames of the context switch. Only
+	 * when its saved stack pointer is not known.
 	 */
-	sigjmp_buf start_point;
+	CORO_STACK_TRIM_MARGIN = 4 * 1024,
 };
 
-static void
-coro_engine_create(struct coro_engine *engine)
+static size_t
+coro_page_size(void)
 {
-	memset(engine, 0, sizeof(*engine));
-	rlist_create(&engine->sched.link);
-	rlist_create(&engine->coros_running_now);
-	rlist_create(&engine->coros_running_next);
-	rlist_create(&engine->coros_pool);
+	static size_t page_size = 0;
+	if (page_size == 0)
+		page_size = sysconf(_SC_PAGESIZE);
+	return page_size;
 }
 
-static void
-coro_engine_resume_next(struct coro_engine *engine)
+/** Size class of a stack. The last one takes all the big stacks. */
+static int
+coro_stack_class(size_t size)
 {
-	assert(!rlist_empty(&engine->coros_running_now));
-	struct coro *to = rlist_shift_entry(&engine->coros_running_now,
-		struct coro, link);
-	struct coro *from = engine->this;
-	assert(from != NULL);
+	size_t page_count = size / coro_page_size();
+	int cls = 0;
+	while (cls < CORO_STACK_CLASS_COUNT - 1 &&
+	       ((size_t)1 << cls) < page_count)
+		++cls;
+	return cls;
+}
 
-	engine->this = NULL;
-	if (sigsetjmp(from->ctx, 0) == 0)
-		siglongjmp(to->ctx, 1);
-	assert(rlist_empty(&from->link));
-	assert(engine->this == NULL);
-	engine->this = from;
+/**
+ * Turn a requested stack size into a real one - not too small,
+ * aligned by pages, and rounded up to its size class.
+ */
+static size_t
+coro_stack_size_normalize(size_t size)
+{
+	if (size < (size_t)SIGSTKSZ)
+		size = SIGSTKSZ;
+	size_t page_size = coro_page_size();
+	size = (size + page_size - 1) & ~(page_size - 1);
+	int cls = coro_stack_class(size);
+	if (cls < CORO_STACK_CLASS_COUNT - 1)
+		size = page_size << cls;
+	return size;
 }
 
 static void
-coro_engine_suspend(struct coro_engine *engine)
+coro_stack_create(struct coro_stack *stack, size_t size)
 {
-	struct coro *this = engine->this;
-	if (this == NULL) {
-		printf("Error: deadlock - suspension with no active "
-			"coroutines\n");
-		exit(-1);
-	}
-	assert(rlist_empty(&this->link));
-	assert(this->state == CORO_STATE_RUNNING);
-	this->state = CORO_STATE_SUSPENDED;
-	coro_engine_resume_next(engine);
+	assert(size == coro_stack_size_normalize(size));
+	size_t page_size = coro_page_size();
+	char *map = mmap(NULL, size + page_size, PROT_READ | PROT_WRITE,
+		MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE | MAP_STACK, -1, 0);
+	if (map == MAP_FAILED)
+		handle_error();
+	if (mprotect(map, page_size, PROT_NONE) != 0)
+		handle_error();
+	stack->base = map + page_size;
+	stack->size = size;
+	stack->idle_end = stack->base;
+	stack->is_trimmed = false;
 }
 
+/**
+ * Remember the lowest address of the stack which is used by a
+ * pooled coroutine.
+ */
 static void
-coro_engine_yield(struct coro_engine *engine)
+coro_stack_set_idle_end(struct coro_stack *stack, void *sp)
 {
-	struct coro *this = engine->this;
-	assert(rlist_empty(&this->link));
-	assert(this->state == CORO_STATE_RUNNING);
-	rlist_add_tail_entry(&engine->coros_running_next, this, link);
-	coro_engine_resume_next(engine);
+	assert((char *)sp <= (char *)stack->base + stack->size);
+	uintptr_t end = (uintptr_t)sp & ~(uintptr_t)(coro_page_size() - 1);
+	if (end < (uintptr_t)stack->base)
+		end = (uintptr_t)stack->base;
+	stack->idle_end = (char *)end;
 }
 
+/**
+ * Give the idle part of the stack of a pooled coroutine back to
+ * the kernel. The mapping stays, and the pages are committed
+ * again when touched.
+ */
 static void
-coro_engine_wakeup(struct coro_engine *engine, struct coro *coro)
+coro_stack_trim(struct coro_stack *stack)
 {
-	if (coro->state == CORO_STATE_RUNNING)
-		return;
-	if (coro->state == CORO_STATE_FINISHED)
-		return;
-	assert(coro->state == CORO_STATE_SUSPENDED);
-	assert(rlist_empty(&coro->link));
-	coro->state = CORO_STATE_RUNNING;
-	rlist_add_tail_entry(&engine->coros_running_next, coro, link);
+	char *base = stack->base;
+	if (stack->idle_end > base &&
+	    madvise(base, stack->idle_end - base, MADV_DONTNEED) != 0)
+		handle_error();
+	stack->is_trimmed = true;
 }
 
 static void
-coro_engine_run(struct coro_engine *engine)
+coro_stack_destroy(struct coro_stack *stack)
 {
-	while (true) {
-		assert(rlist_empty(&engine->coros_running_now));
-		rlist_splice_tail(&engine->coros_running_now,
-			&engine->coros_running_next);
-		if (rlist_empty(&engine->coros_running_now))
-			break;
+	size_t page_size = coro_page_size();
+	if (munmap((char *)stack->base - page_size,
+		   stack->size + page_size) != 0)
+		handle_error();
+}
 
-		assert(engine->this == NULL);
-		engine->this = &engine->sched;
-		assert(rlist_empty(&engine->sched.link));
-		/*
-		 * Add the scheduler to the tail so the control
-		 * comes back in the end of this iteration of the
-		 * loop.
-		 */
-		rlist_add_tail_entry(&engine->coros_running_now,
-			&engine->sched, link);
-		coro_engine_resume_next(engine);
-		assert(rlist_empty(&engine->coros_running_now));
-		assert(engine->this == &engine->sched);
-		engine->this = NULL;
+/**
+ * How much of the stack is actually resident in memory. The
+ * buffer @a vec must have a byte per each page of the stack.
+ */
+static size_t
+coro_stack_resident_size(const struct coro_stack *stack, unsigned char *vec)
+{
+	if (mincore(stack->base, stack->size, vec) != 0)
+		handle_error();
+	size_t page_size = coro_page_size();
+	size_t page_count = stack->size / page_size;
+	size_t res = 0;
+	for (size_t i = 0; i < page_count; ++i) {
+		if ((vec[i] & 1) != 0)
+			res += page_size;
 	}
+	return res;
 }
 
-static void
-coro_engine_destroy(struct coro_engine *engine)
+enum {
+	/** Timer wheel resolution. */
+	CORO_TICK_NS = 1000000,
+	/** The wheel levels have 2^CORO_WHEEL_BITS slots each. */
+	CORO_WHEEL_BITS = 6,
+	CORO_WHEEL_SIZE = 1 << CORO_WHEEL_BITS,
+	CORO_WHEEL_MASK = CORO_WHEEL_SIZE - 1,
+	/**
+	 * With 4 levels of 64 slots by 1ms the wheel covers ~4.6
+	 * hours. Longer timers are re-added when reach the top.
+	 */
+	CORO_WHEEL_LEVELS = 4,
+};
+
+static uint64_t
+coro_clock_ns(void)
 {
-	assert(engine->this == NULL);
-	assert(rlist_empty(&engine->coros_running_now));
-	assert(rlist_empty(&engine->coros_running_next));
-	while (!rlist_empty(&engine->coros_pool)) {
-		struct coro *c = rlist_shift_entry(&engine->coros_pool,
-			struct coro, link);
-		free(c->stack);
-		free(c);
-		assert(engine->coro_count > 0);
-		--engine->coro_count;
-	}
-	assert(engine->coro_count == 0);
-	memset(engine, '#', sizeof(*engine));
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
 }
 
-static __thread struct coro_engine *new_coro_engine = NULL;
+/** Monotonic time in the timer ticks. */
+static uint64_t
+coro_clock_tick(void)
+{
+	return coro_clock_ns() / CORO_TICK_NS;
+}
+
+/**
+ * Tick by which @a sec seconds pass for sure. Everything is
+ * rounded up, because a timeout must never be shorter than asked,
+ * and a part of the current tick has already passed.
+ */
+static uint64_t
+coro_clock_deadline(double sec)
+{
+	uint64_t now = coro_clock_tick();
+	if (sec <= 0)
+		return now;
+	double ticks = sec * (1000000000.0 / CORO_TICK_NS);
+	if (ticks >= (double)(UINT64_MAX / 4))
+		return UINT64_MAX / 2;
+	uint64_t res = (uint64_t)ticks;
+	if ((double)res < ticks)
+		++res;
+	return now + res + 1;
+}
+
+struct coro_timer {
+	/** Link in a slot of the wheel. Empty when not armed. */
+	struct rlist link;
+	/** Tick at which the timer expires. */
+	uint64_t deadline;
+};
 
 /**
- * The core part of the coroutines creation - this signal handler
- * runs on a separate stack using sigaltstack. At invocation it
- * remembers its current context and jumps back to the coroutine
- * constructor. Later the coroutine continues from here.
+ * Hierarchical timer wheel. The level N has 64 slots, each
+ * covering 64^N ticks. Timers are added and removed in O(1). When
+ * the lower level makes a full turn, the next slot of the upper
+ * one is spread over the lower levels. Only the first level slots
+ * are ever fired, and each of them has the timers of exactly one
+ * tick.
  */
+struct coro_timer_wheel {
+	/** The next tick to process. */
+	uint64_t tick;
+	/** Number of the armed timers. */
+	size_t count;
+	struct rlist slots[CORO_WHEEL_LEVELS][CORO_WHEEL_SIZE];
+};
+
 static void
-coro_body(int signum)
+coro_timer_wheel_create(struct coro_timer_wheel *wheel)
 {
-	(void)signum;
-	struct coro_engine *my_engine = new_coro_engine;
-	new_coro_engine = NULL;
+	wheel->tick = coro_clock_tick();
+	wheel->count = 0;
+	for (int i = 0; i < CORO_WHEEL_LEVELS; ++i) {
+		for (int j = 0; j < CORO_WHEEL_SIZE; ++j)
+			rlist_create(&wheel->slots[i][j]);
+	}
+}
 
-	struct coro *c = my_engine->this;
-	my_engine->this = NULL;
-	/*
-	 * On invocation jump back to the constructor right after
-	 * remembering the context.
-	 */
-	if (sigsetjmp(c->ctx, 0) == 0)
-		siglongjmp(my_engine->start_point, 1);
-	/*
-	 * If the execution is here, then the coroutine should
-	 * finally start work.
-	 */
-	my_engine->this = c;
-	while (true) {
-		c->ret = c->func(c->func_arg);
-		c->func = NULL;
-		assert(c->state == CORO_STATE_RUNNING);
-		c->state = CORO_STATE_FINISHED;
-		if (c->joiner != NULL)
-			coro_engine_wakeup(my_engine, c->joiner);
-		coro_engine_resume_next(my_engine);
+/** Put the timer into the slot matching its deadline. */
+static void
+coro_timer_wheel_insert(struct coro_timer_wheel *wheel, struct coro_timer *timer)
+{
+	uint64_t deadline = timer->deadline;
+	int level = 0;
+	if (deadline < wheel->tick) {
+		/* Already expired, fire on the next tick. */
+		deadline = wheel->tick;
+	} else {
+		uint64_t delta = deadline - wheel->tick;
+		while (level < CORO_WHEEL_LEVELS - 1 &&
+		       delta >> (CORO_WHEEL_BITS * (level + 1)) != 0)
+			++level;
 		/*
-		 * Here it is restarted already, must have its
-		 * state restored.
+		 * Too far even for the top level. Park in its farthest
+		 * slot and be re-added when the slot is reached.
 		 */
-		assert(c->state == CORO_STATE_RUNNING);
-		assert(c->func != NULL);
+		if (delta >> (CORO_WHEEL_BITS * CORO_WHEEL_LEVELS) != 0)
+			deadline = wheel->tick +
+				(1ULL << (CORO_WHEEL_BITS * CORO_WHEEL_LEVELS)) - 1;
 	}
+	size_t index = (deadline >> (CORO_WHEEL_BITS * level)) &
+		CORO_WHEEL_MASK;
+	rlist_add_tail(&wheel->slots[level][index], &timer->link);
 }
 
-static struct coro *
-coro_engine_spawn_new(struct coro_engine *engine, coro_f func, void *func_arg)
+static void
+coro_timer_wheel_add(struct coro_timer_wheel *wheel, struct coro_timer *timer,
+	uint64_t deadline)
 {
-	struct coro *c = malloc(sizeof(*c));
-	c->state = CORO_STATE_RUNNING;
-	c->ret = NULL;
-	int stack_size = 1024 * 1024;
-	if (stack_size < SIGSTKSZ)
-		stack_size = SIGSTKSZ;
-	c->stack = malloc(stack_size);
-	c->func = func;
-	c->func_arg = func_arg;
-	c->joiner = NULL;
-	rlist_create(&c->link);
-	/*
-	 * SIGUSR2 is used. First of all, block new signals to be
-	 * able to set a new handler.
-	 */
-	sigset_t news, olds, suss;
-	sigemptyset(&news);
-	sigaddset(&news, SIGUSR2);
-	if (sigprocmask(SIG_BLOCK, &news, &olds) != 0)
-		handle_error();
+	assert(rlist_empty(&timer->link));
 	/*
-	 * New handler should jump onto a new stack and remember
-	 * that position. Afterwards the stack is disabled and
-	 * becomes dedicated to that single coroutine.
+	 * An empty wheel isn't advanced, catch up with the clock
+	 * first.
 	 */
-	struct sigaction newsa, oldsa;
-	newsa.sa_handler = coro_body;
-	newsa.sa_flags = SA_ONSTACK;
-	sigemptyset(&newsa.sa_mask);
-	if (sigaction(SIGUSR2, &newsa, &oldsa) != 0)
-		handle_error();
-	/* Create that new stack. */
-	stack_t oldst, newst;
-	newst.ss_sp = c->stack;
-	newst.ss_size = stack_size;
-	newst.ss_flags = 0;
-	if (sigaltstack(&newst, &oldst) != 0)
-		handle_error();
-
-	/* Jump onto the stack and remember its position. */
-	assert(new_coro_engine == NULL);
-	new_coro_engine = engine;
-	struct coro *old_this = engine->this;
-	engine->this = c;
-	sigemptyset(&suss);
-	if (sigsetjmp(engine->start_point, 1) == 0) {
-		raise(SIGUSR2);
-		while (engine->this != NULL)
-			sigsuspend(&suss);
+	if (wheel->count == 0) {
+		uint64_t now = coro_clock_tick();
+		if (now > wheel->tick)
+			wheel->tick = now;
 	}
-	assert(new_coro_engine == NULL);
-	engine->this = old_this;
-
-	/*
-	 * Return the old stack, unblock SIGUSR2. In other words,
-	 * rollback all global changes. The newly created stack
-	 * now is remembered only by the new coroutine, and can be
-	 * used by it only.
-	 */
-	if (sigaltstack(NULL, &newst) != 0)
-		handle_error();
-	newst.ss_flags = SS_DISABLE;
-	if (sigaltstack(&newst, NULL) != 0)
-		handle_error();
-	if ((oldst.ss_flags & SS_DISABLE) == 0 &&
-	    sigaltstack(&oldst, NULL) != 0)
-		handle_error();
-	if (sigaction(SIGUSR2, &oldsa, NULL) != 0)
-		handle_error();
-	if (sigprocmask(SIG_SETMASK, &olds, NULL) != 0)
-		handle_error();
-
-	/* Now scheduler can work with that coroutine. */
-	++engine->coro_count;
-	assert(rlist_empty(&c->link));
-	rlist_add_tail_entry(&engine->coros_running_next, c, link);
-	return c;
+	timer->deadline = deadline;
+	coro_timer_wheel_insert(wheel, timer);
+	++wheel->count;
 }
 
-static struct coro *
-coro_engine_spawn(struct coro_engine *engine, coro_f func, void *func_arg)
+static void
+coro_timer_wheel_del(struct coro_timer_wheel *wheel, struct coro_timer *timer)
 {
-	if (rlist_empty(&engine->coros_pool))
-		return coro_engine_spawn_new(engine, func, func_arg);
-
-	struct coro *c = rlist_shift_entry(&engine->coros_pool,
-		struct coro, link);
-	c->func = func;
-	c->func_arg = func_arg;
-	c->state = CORO_STATE_RUNNING;
-	assert(rlist_empty(&c->link));
-	rlist_add_tail_entry(&engine->coros_running_next, c, link);
-	return c;
+	assert(!rlist_empty(&timer->link));
+	assert(wheel->count > 0);
+	rlist_del(&timer->link);
+	--wheel->count;
+}
+
+/**
+ * Spread the current slot of the level over the lower levels.
+ * Returns the slot index, so the caller knows if the level made a
+ * full turn too.
+ */
+static size_t
+coro_timer_wheel_cascade(struct coro_timer_wheel *wheel, int level)
+{
+	size_t index = (wheel->tick >> (CORO_WHEEL_BITS * level)) &
+		CORO_WHEEL_MASK;
+	struct rlist list;
+	rlist_create(&list);
+	rlist_splice(&list, &wheel->slots[level][index]);
+	while (!rlist_empty(&list)) {
+		struct coro_timer *timer = rlist_shift_entry(&list,
+			struct coro_timer, link);
+		coro_timer_wheel_insert(wheel, timer);
+	}
+	return index;
+}
+
+/**
+ * Process all the ticks up to and including @a now. The expired
+ * timers are moved into @a expired and aren't armed anymore after
+ * they are removed from it.
+ */
+static void
+coro_timer_wheel_advance(struct coro_timer_wheel *wheel, uint64_t now,
+	struct rlist *expired)
+{
+	while (wheel->tick <= now) {
+		if (wheel->count == 0) {
+			wheel->tick = now + 1;
+			return;
+		}
+		size_t index = wheel->tick & CORO_WHEEL_MASK;
+		if (index == 0) {
+			for (int level = 1; level < CORO_WHEEL_LEVELS; ++level) {
+				if (coro_timer_wheel_cascade(wheel, level) != 0)
+					break;
+			}
+		}
+		struct rlist *slot = &wheel->slots[0][index];
+		while (!rlist_empty(slot)) {
+			struct rlist *link = rlist_shift(slot);
+			rlist_add_tail(expired, link);
+			--wheel->count;
+		}
+		++wheel->tick;
+	}
+}
+
+/**
+ * The tick up to which the wheel can sleep without missing
+ * anything. It is the nearest deadline, or the next turn of the
+ * first level if the timers are all on the upper levels. Then the
+ * sleep is just split into a few. UINT64_MAX means no timers.
+ */
+static uint64_t
+coro_timer_wheel_next(const struct coro_timer_wheel *wheel)
+{
+	if (wheel->count == 0)
+		return UINT64_MAX;
+	uint64_t tick = wheel->tick;
+	while (rlist_empty(&wheel->slots[0][tick & CORO_WHEEL_MASK])) {
+		if (((tick + 1) & CORO_WHEEL_MASK) == 0)
+			return tick + 1;
+		++tick;
+	}
+	return tick;
+}
+
+struct coro;
+
+/** State of an fd, which coroutines wait for. */
+struct coro_fd {
+	/**
+	 * CORO_FD_READ/WRITE, which are known to be ready. They
+	 * are set by the edges from the epoll, and reset by the
+	 * operations getting EAGAIN.
+	 */
+	uint32_t ready;
+	/** Bumped on each edge, to see if any came during an operation. */
+	uint32_t seq;
+	/** The fd is added to the epoll. */
+	bool is_registered;
+	/** Coroutines waiting for the fd. struct coro_fd_wait. */
+	struct rlist waits;
+};
+
+/** A coroutine waiting for an fd. Lives on its stack. */
+struct coro_fd_wait {
+	struct coro *coro;
+	/** CORO_FD_READ/WRITE to wait for. */
+	uint32_t events;
+	/** Link in the fd's waits. Empty when the wait is over. */
+	struct rlist link;
+};
+
+/**
+ * Edge-triggered epoll reactor. An fd is added to the epoll once,
+ * for all the events, on the first wait. The edges are remembered
+ * in the fd states, so an operation on an fd which is still ready
+ * doesn't need neither epoll_ctl() nor epoll_wait().
+ *
+ * In the multi-thread mode all the engines share one reactor. Any
+ * thread can poll it, but only one at a time.
+ */
+struct coro_reactor {
+	/** -1 until the first wait. */
+	int epoll_fd;
+	/** Interrupts epoll_wait() when new work comes. */
+	int event_fd;
+	/** States of the fds, indexed by the fd. */
+	struct coro_fd *fds;
+	/** Size of the fds array. */
+	int fd_capacity;
+	/** Number of the coroutines waiting for the fds. */
+	long wait_count;
+	/** The reactor is shared by threads and needs locking. */
+	bool is_shared;
+	/** Protects the fds when the reactor is shared. */
+	bool lock;
+	/** Some thread polls the epoll now. */
+	bool is_polling;
+	/** The polling thread is blocked in epoll_wait(). */
+	bool is_blocked;
+};
+
+enum {
+	/** Max events taken from the epoll at once. */
+	CORO_POLL_BATCH = 128,
+};
+
+#if LIBCORO_IO == LIBCORO_IO_URING
+
+/**
+ * io_uring of an engine, driven via the raw syscalls. The I/O
+ * operations are queued as SQEs by the coroutines and submitted
+ * all at once in the end of the scheduler loop iteration. The
+ * completions wake the coroutines up. No SQPOLL, so the kernel
+ * looks at the SQEs only inside io_uring_enter().
+ */
+struct coro_uring {
+	/** -1 when not opened or not supported. */
+	int fd;
+	/** The open was tried already. */
+	bool is_probed;
+	unsigned *sq_head;
+	unsigned *sq_tail;
+	unsigned *sq_flags;
+	unsigned *sq_array;
+	unsigned sq_mask;
+	unsigned sq_entries;
+	struct io_uring_sqe *sqes;
+	unsigned *cq_head;
+	unsigned *cq_tail;
+	unsigned cq_mask;
+	struct io_uring_cqe *cqes;
+	/** The SQ and CQ rings, mapped together. */
+	void *ring;
+	size_t ring_size;
+	size_t sqes_size;
+	/** SQEs queued but not submitted yet. */
+	unsigned to_submit;
+	/** Operations submitted and not completed yet. */
+	long inflight;
+};
+
+/**
+ * An operation in the ring. Lives on the stack of the coroutine
+ * waiting for it.
+ */
+struct coro_uring_op {
+	struct coro *coro;
+	/** Result, the same as of the syscall, or -errno. */
+	int res;
+	bool is_done;
+};
+
+enum {
+	CORO_URING_ENTRIES = 256,
+};
+
+static void
+coro_uring_create(struct coro_uring *u)
+{
+	memset(u, 0, sizeof(*u));
+	u->fd = -1;
+}
+
+/**
+ * Set up the ring. Fails if the kernel doesn't have io_uring, or
+ * it is too old or forbidden. Then the engine stays with epoll.
+ */
+static int
+coro_uring_open(struct coro_uring *u)
+{
+	struct io_uring_params params;
+	memset(&params, 0, sizeof(params));
+	int fd = syscall(__NR_io_uring_setup, CORO_URING_ENTRIES, &params);
+	if (fd < 0)
+		return -1;
+	const unsigned features = IORING_FEAT_SINGLE_MMAP |
+		IORING_FEAT_NODROP | IORING_FEAT_EXT_ARG;
+	if ((params.features & features) != features) {
+		close(fd);
+		return -1;
+	}
+	size_t sq_size = params.sq_off.array +
+		params.sq_entries * sizeof(unsigned);
+	size_t cq_size = params.cq_off.cqes +
+		params.cq_entries * sizeof(struct io_uring_cqe);
+	u->ring_size = sq_size > cq_size ? sq_size : cq_size;
+	u->ring = mmap(NULL, u->ring_size, PROT_READ | PROT_WRITE,
+		MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+	if (u->ring == MAP_FAILED)
+		handle_error();
+	u->sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+	u->sqes = mmap(NULL, u->sqes_size, PROT_READ | PROT_WRITE,
+		MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQES);
+	if (u->sqes == MAP_FAILED)
+		handle_error();
+	char *ring = u->ring;
+	u->sq_head = (unsigned *)(ring + params.sq_off.head);
+	u->sq_tail = (unsigned *)(ring + params.sq_off.tail);
+	u->sq_flags = (unsigned *)(ring + params.sq_off.flags);
+	u->sq_array = (unsigned *)(ring + params.sq_off.array);
+	u->sq_mask = *(unsigned *)(ring + params.sq_off.ring_mask);
+	u->sq_entries = params.sq_entries;
+	u->cq_head = (unsigned *)(ring + params.cq_off.head);
+	u->cq_tail = (unsigned *)(ring + params.cq_off.tail);
+	u->cq_mask = *(unsigned *)(ring + params.cq_off.ring_mask);
+	u->cqes = (struct io_uring_cqe *)(ring + params.cq_off.cqes);
+	u->fd = fd;
+	return 0;
+}
+
+static void
+coro_uring_destroy(struct coro_uring *u)
+{
+	assert(u->inflight == 0);
+	if (u->fd < 0)
+		return;
+	munmap(u->sqes, u->sqes_size);
+	munmap(u->ring, u->ring_size);
+	close(u->fd);
+}
+
+/**
+ * Submit the queued SQEs. If @a deadline is not 0, then also wait
+ * for a completion until the deadline tick. UINT64_MAX means no
+ * deadline.
+ */
+static void
+coro_uring_enter(struct coro_uring *u, uint64_t deadline)
+{
+	unsigned flags = 0;
+	unsigned min_complete = 0;
+	struct io_uring_getevents_arg arg;
+	struct __kernel_timespec ts;
+	memset(&arg, 0, sizeof(arg));
+	if (deadline != 0) {
+		flags |= IORING_ENTER_GETEVENTS | IORING_ENTER_EXT_ARG;
+		min_complete = 1;
+		if (deadline != UINT64_MAX) {
+			uint64_t now = coro_clock_tick();
+			uint64_t ns = deadline > now ?
+				(deadline - now) * CORO_TICK_NS : 0;
+			ts.tv_sec = ns / 1000000000;
+			ts.tv_nsec = ns % 1000000000;
+			arg.ts = (uintptr_t)&ts;
+		}
+	} else if (u->to_submit == 0) {
+		return;
+	}
+	int rc = syscall(__NR_io_uring_enter, u->fd, u->to_submit,
+		min_complete, flags, &arg, sizeof(arg));
+	if (rc >= 0) {
+		u->to_submit -= rc;
+		return;
+	}
+	if (errno != EINTR && errno != ETIME && errno != EAGAIN &&
+	    errno != EBUSY)
+		handle_error();
+}
+
+/** Take a free SQE, submitting the queued ones if there are none. */
+static struct io_uring_sqe *
+coro_uring_get_sqe(struct coro_uring *u)
+{
+	unsigned tail = *u->sq_tail;
+	if (tail - __atomic_load_n(u->sq_head, __ATOMIC_ACQUIRE) ==
+	    u->sq_entries) {
+		coro_uring_enter(u, 0);
+		assert(tail != __atomic_load_n(u->sq_head, __ATOMIC_ACQUIRE) +
+		       u->sq_entries);
+	}
+	unsigned index = tail & u->sq_mask;
+	struct io_uring_sqe *sqe = &u->sqes[index];
+	memset(sqe, 0, sizeof(*sqe));
+	u->sq_array[index] = index;
+	__atomic_store_n(u->sq_tail, tail + 1, __ATOMIC_RELEASE);
+	++u->to_submit;
+	return sqe;
+}
+
+#endif /* LIBCORO_IO == LIBCORO_IO_URING */
+
+enum coro_state {
+	CORO_STATE_RUNNING,
+	CORO_STATE_SUSPENDED,
+	CORO_STATE_FINISHED,
+};
+
+struct coro_engine;
+
+/** Main coroutine structure, its context. */
+struct coro {
+	/**
+	 * Coroutine state. Is accessed atomically, because in the
+	 * multi-thread mode the wakeups can come from any thread.
+	 */
+	enum coro_state state;
+	/**
+	 * The coroutine is executed by some thread right now, or
+	 * its context is not completely saved yet. Such coroutine
+	 * can't be resumed by another thread.
+	 */
+	bool on_cpu;
+	/**
+	 * A wakeup came while the coroutine was running. Is used
+	 * only in the multi-thread mode, where such wakeups can't
+	 * be just dropped - they might be racing with the
+	 * suspension.
+	 */
+	bool wakeup_pending;
+	/** A value, returned by func. */
+	void *ret;
+	/** Stack, used by the coroutine. */
+	struct coro_stack stack;
+	/** An argument for the function func. */
+	void *func_arg;
+	/** A function to call as a coroutine. */
+	coro_f func;
+	/** Last remembered coroutine context. */
+	struct coro_ctx ctx;
+	/**
+	 * Coroutine which is trying to join this one right now.
+	 */
+	struct coro *joiner;
+	/**
+	 * Mask of enum coro_release: who is done with the
+	 * coroutine. Whoever sets the second bit, recycles it.
+	 */
+	int release_mask;
+	/** Group the coroutine is a child of. NULL if none. */
+	struct coro_group *group;
+	/** Link in the list of the children of the group. */
+	struct rlist group_link;
+	/** The coroutine is asked to stop its work. */
+	bool is_cancelled;
+	/** Coroutine-local storage, see coro_local_get(). */
+	void *locals[CORO_LOCAL_COUNT];
+	/**
+	 * Engine running the coroutine. It changes when the
+	 * coroutine is stolen by another thread.
+	 */
+	struct coro_engine *owner;
+	/**
+	 * Engine which created the coroutine and has it in the list
+	 * of all coroutines.
+	 */
+	struct coro_engine *home;
+	/**
+	 * Link in the remote wakeup queue of the owner engine, or in
+	 * the remote pool queue of the home engine.
+	 */
+	struct coro *remote_next;
+	/**
+	 * Timer of a timed suspension. While it is armed, the
+	 * coroutine is bound to the owner engine, whose wheel keeps
+	 * the timer.
+	 */
+	struct coro_timer timer;
+	/** The last timed suspension has ended by the timeout. */
+	bool is_timed_out;
+	/** Defines the run queue the coroutine goes to. */
+	enum coro_priority priority;
+	/**
+	 * Unique ID for the stats and the trace. 0 if not given yet:
+	 * it is given on start when the stats are on, or with the
+	 * first slice in the trace.
+	 */
+	uint64_t id;
+	struct coro_stats stats;
+	/** When became runnable. 0 if unknown. */
+	uint64_t runnable_since;
+	/** When got the CPU. 0 if unknown. */
+	uint64_t slice_start;
+	/** Links in a coroutine list, used by the scheduler. */
+	struct rlist link;
+	/** Link in the list of all coroutines of the engine. */
+	struct rlist engine_link;
+};
+
+/**
+ * A detached coroutine is recycled by whoever comes last: the
+ * coroutine finishing, or coro_detach().
+ */
+enum coro_release {
+	CORO_RELEASE_FINISHED = 1,
+	CORO_RELEASE_DETACHED = 2,
+};
+
+/** Children spawned together, to be joined at once. */
+struct coro_group {
+	/** Number of the children not finished yet. */
+	long count;
+	/** Coroutine waiting in coro_group_join(). NULL if none. */
+	struct coro *waiter;
+	/** The children not finished yet, to be cancelled. */
+	struct rlist children;
+	/** The children are cancelled, the new ones too. */
+	bool is_cancelled;
+	/** Protects the children list, the counter's drop and the waiter. */
+	bool lock;
+};
+
+/** A time slice of a coroutine in the trace. */
+struct coro_trace_event {
+	uint64_t coro_id;
+	uint64_t start_ns;
+	uint64_t duration_ns;
+	/** Engine which ran the coroutine. */
+	int engine_id;
+};
+
+struct coro_engine {
+	/**
+	 * Scheduler is the main coroutine - it represents the
+	 * context in which the scheduler itself runs.
+	 */
+	struct coro sched;
+	/** Which coroutine works at this moment. */
+	struct coro *this;
+	/**
+	 * Coroutine which worked before the last switch. It is
+	 * released by the next context right after the switch.
+	 */
+	struct coro *prev;
+	/**
+	 * The previous coroutine is a finished detached one. It is
+	 * recycled right after the switch, when its stack is free.
+	 */
+	bool is_prev_released;
+
+	/**
+	 * Coroutines to run in this iteration of the loop. The
+	 * list gets populated once at the start of the iteration.
+	 */
+	struct rlist coros_running_now;
+	/**
+	 * Coroutines to run in the next iteration of the loop, one
+	 * list per priority. The lists get populated by wakeups and
+	 * yields and new coros. In the multi-thread mode the other
+	 * threads can steal from them, so they are protected by
+	 * the lock.
+	 */
+	struct rlist coros_running_next[CORO_PRIO_COUNT];
+	/**
+	 * High priority coroutines woken up during the current
+	 * iteration. They run before the rest of the iteration
+	 * while the budget lasts, and in the next iteration
+	 * otherwise. Protected by the lock too.
+	 */
+	struct rlist coros_running_urgent;
+	/** How many urgent coroutines can still run out of order. */
+	int urgent_budget;
+	/** Protects the running queues in the multi-thread mode. */
+	bool lock;
+	/**
+	 * Coroutines woken up by the other threads. It is a
+	 * lock-free stack, which the engine drains into its own
+	 * queue on each iteration of the loop.
+	 */
+	struct coro *remote_head;
+	/**
+	 * Thread set the engine works in, when in the multi-thread
+	 * mode. Otherwise NULL.
+	 */
+	struct coro_mt *mt;
+	/** Index of the engine in the thread set. */
+	int id;
+	/** Timers of the coroutines suspended with a timeout. */
+	struct coro_timer_wheel timers;
+	/** Own reactor, used when the engine works alone. */
+	struct coro_reactor reactor;
+#if LIBCORO_IO == LIBCORO_IO_URING
+	/**
+	 * The ring is used instead of the epoll when the engine
+	 * works alone and the kernel supports it.
+	 */
+	struct coro_uring uring;
+#endif
+	/**
+	 * Reactor in use. In the multi-thread mode it is the one of
+	 * the first engine.
+	 */
+	struct coro_reactor *io;
+	/**
+	 * Joined coroutines to be reused, by stack size class. The
+	 * recently joined ones are in the head, the idle ones drift
+	 * to the tail.
+	 */
+	struct rlist coros_pool[CORO_STACK_CLASS_COUNT];
+	/** Number of the pooled coroutines, by class. */
+	size_t pool_size[CORO_STACK_CLASS_COUNT];
+	/**
+	 * The smallest pool size of each class since the last trim.
+	 * That many coroutines of the tail weren't needed at all.
+	 */
+	size_t pool_min[CORO_STACK_CLASS_COUNT];
+	/** Total number of the pooled coroutines. */
+	size_t pool_count;
+	/**
+	 * Detached coroutines of this engine which have finished in
+	 * other threads. A lock-free stack, drained into the pool
+	 * when the pool has nothing to give.
+	 */
+	struct coro *pool_remote_head;
+	/** Limit of pool_count. The extra joined coroutines are freed. */
+	size_t pool_max;
+	/** When the pool was trimmed last time. */
+	uint64_t pool_trim_tick;
+	/** Stacks given back to the kernel, in total. */
+	uint64_t pool_trim_count;
+	/** Pooled coroutines freed by the trim or the limit, in total. */
+	uint64_t pool_free_count;
+	/** All the coroutines, including the pool. */
+	struct rlist coros_all;
+	/** Total number of coroutines, including the pool. */
+	size_t coro_count;
+	struct coro_sched_stats stats;
+	/** Collect the per-coroutine stats. */
+	bool is_stats_enabled;
+	/** Recorded time slices. NULL if the trace is off. */
+	struct coro_trace_event *trace;
+	size_t trace_size;
+	size_t trace_capacity;
+	uint64_t trace_start_ns;
+	/** Stack size for the coroutines which don't specify it. */
+	size_t stack_size;
+	/**
+	 * Context, used by the coroutine constructor to let the
+	 * new coroutine remember its own context and come back
+	 * into the constructor. For the signal backend it is also
+	 * an escape from the signal handler to rollback
+	 * sigaltstack etc.
+	 */
+	struct coro_ctx start_point;
+};
+
+/** State of the multi-thread mode, shared by all the engines. */
+struct coro_mt {
+	/** Engines of all the threads. The first one is global. */
+	struct coro_engine **engines;
+	/** Number of the engines and threads. */
+	int engine_count;
+	/**
+	 * Number of the coroutines which are runnable or running
+	 * in all the engines. When it is zero, the work is done.
+	 */
+	long running_count;
+	/**
+	 * Number of the coroutines waiting for a timer or an fd in
+	 * all the engines. They will become runnable, so the work
+	 * isn't done while there are any.
+	 */
+	long wait_count;
+	/** Reactor shared by all the engines. */
+	struct coro_reactor *reactor;
+	/** Number of the threads sleeping until new work comes. */
+	int idle_count;
+	/** Futex, bumped when new work appears for idle threads. */
+	uint32_t work_seq;
+};
+
+enum {
+	/**
+	 * How many times an idle thread looks for work before
+	 * going to sleep.
+	 */
+	CORO_MT_SPIN_COUNT = 100,
+	/**
+	 * How many times per iteration of the loop the woken up
+	 * high priority coroutines can run ahead of the others.
+	 * Keeps the rest of the iteration progressing when the high
+	 * priority ones wake each other up.
+	 */
+	CORO_PRIO_URGENT_BUDGET = 16,
+	/**
+	 * Low priority coroutines run once per that many
+	 * iterations, if anything else is runnable.
+	 */
+	CORO_PRIO_LOW_PERIOD = 4,
+	CORO_POOL_MAX_DEFAULT = 1024,
+	/**
+	 * Once per this many ticks the pooled coroutines, unused
+	 * since the previous trim, give their stack memory back.
+	 * Those which stay unused one more period are freed.
+	 */
+	CORO_POOL_TRIM_PERIOD = 1000,
+	/** The trim time is checked once per this many iterations. */
+	CORO_POOL_TRIM_CHECK_LOOPS = 256,
+};
+
+/** Source of the coroutine IDs, shared by all the engines. */
+static uint64_t coro_id_last = 0;
+
+static inline uint64_t
+coro_id_new(void)
+{
+	return __atomic_add_fetch(&coro_id_last, 1, __ATOMIC_RELAXED);
+}
+
+/** Number of the coroutine-local keys given out. */
+static int coro_local_key_last = 0;
+
+static struct coro_engine glob_engine;
+
+/** Engine of the current thread. NULL means the global one. */
+static __thread struct coro_engine *this_engine = NULL;
+
+/**
+ * How many scheduler loops the current thread is in. A thread not
+ * running any has no current coroutine, even if it shares the
+ * global engine with the thread which does.
+ */
+static __thread int this_thread_run_depth = 0;
+
+/**
+ * Get the engine of the current thread. In the multi-thread mode
+ * a suspended coroutine can continue in another thread, so the
+ * engine has to be fetched again after each switch. The barrier
+ * prevents the compiler from caching the thread-local storage
+ * address across the switches.
+ */
+static __attribute__((noinline)) struct coro_engine *
+coro_engine_current(void)
+{
+	__asm__ volatile("" : : : "memory");
+	struct coro_engine *engine = this_engine;
+	return engine != NULL ? engine : &glob_engine;
+}
+
+static inline void
+coro_cpu_relax(void)
+{
+#if defined(__x86_64__) || defined(__i386__)
+	__asm__ volatile("pause");
+#elif defined(__aarch64__)
+	__asm__ volatile("yield");
+#endif
+}
+
+static void
+coro_reactor_create(struct coro_reactor *r)
+{
+	memset(r, 0, sizeof(*r));
+	r->epoll_fd = -1;
+	r->event_fd = -1;
+}
+
+static void
+coro_reactor_destroy(struct coro_reactor *r)
+{
+	assert(r->wait_count == 0);
+	if (r->epoll_fd >= 0) {
+		close(r->epoll_fd);
+		close(r->event_fd);
+	}
+	free(r->fds);
+}
+
+static inline void
+coro_reactor_lock(struct coro_reactor *r)
+{
+	if (!r->is_shared)
+		return;
+	while (__atomic_test_and_set(&r->lock, __ATOMIC_ACQUIRE)) {
+		while (__atomic_load_n(&r->lock, __ATOMIC_RELAXED))
+			coro_cpu_relax();
+	}
+}
+
+static inline void
+coro_reactor_unlock(struct coro_reactor *r)
+{
+	if (r->is_shared)
+		__atomic_clear(&r->lock, __ATOMIC_RELEASE);
+}
+
+/** Create the epoll on the first need. Under the lock. */
+static int
+coro_reactor_open(struct coro_reactor *r)
+{
+	if (r->epoll_fd >= 0)
+		return 0;
+	int epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+	if (epoll_fd < 0)
+		return -1;
+	int event_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if (event_fd < 0) {
+		close(epoll_fd);
+		return -1;
+	}
+	struct epoll_event ev;
+	ev.events = EPOLLIN | EPOLLET;
+	ev.data.fd = event_fd;
+	if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, event_fd, &ev) != 0)
+		handle_error();
+	r->event_fd = event_fd;
+	__atomic_store_n(&r->epoll_fd, epoll_fd, __ATOMIC_RELEASE);
+	return 0;
+}
+
+/**
+ * Get the state of an fd, creating it if needed. Under the lock.
+ * The array grows geometrically, so the fds are O(1).
+ */
+static struct coro_fd *
+coro_reactor_fd(struct coro_reactor *r, int fd)
+{
+	if (fd >= r->fd_capacity) {
+		int capacity = r->fd_capacity == 0 ? 64 : r->fd_capacity;
+		while (capacity <= fd)
+			capacity *= 2;
+		struct coro_fd *fds = malloc(sizeof(fds[0]) * capacity);
+		/* The waits point at the heads, can't just realloc. */
+		for (int i = 0; i < r->fd_capacity; ++i) {
+			fds[i] = r->fds[i];
+			rlist_create(&fds[i].waits);
+			rlist_splice(&fds[i].waits, &r->fds[i].waits);
+		}
+		free(r->fds);
+		r->fds = fds;
+		for (int i = r->fd_capacity; i < capacity; ++i) {
+			struct coro_fd *f = &fds[i];
+			/* Unknown fds are tried first. */
+			f->ready = CORO_FD_READ | CORO_FD_WRITE;
+			f->seq = 0;
+			f->is_registered = false;
+			rlist_create(&f->waits);
+		}
+		r->fd_capacity = capacity;
+	}
+	return &r->fds[fd];
+}
+
+/** Turn the epoll events into CORO_FD_READ/WRITE. */
+static uint32_t
+coro_reactor_events(uint32_t events)
+{
+	uint32_t res = 0;
+	/* Errors and hangups are for everyone to see. */
+	if ((events & (EPOLLERR | EPOLLHUP)) != 0)
+		return CORO_FD_READ | CORO_FD_WRITE;
+	if ((events & (EPOLLIN | EPOLLRDHUP | EPOLLPRI)) != 0)
+		res |= CORO_FD_READ;
+	if ((events & EPOLLOUT) != 0)
+		res |= CORO_FD_WRITE;
+	return res;
+}
+
+/**
+ * Make the thread blocked in epoll_wait(), if any, come back to
+ * look for new work.
+ */
+static void
+coro_reactor_interrupt(struct coro_reactor *r)
+{
+	if (!__atomic_load_n(&r->is_blocked, __ATOMIC_SEQ_CST))
+		return;
+	uint64_t one = 1;
+	if (write(r->event_fd, &one, sizeof(one)) < 0 && errno != EAGAIN)
+		handle_error();
+}
+
+static inline enum coro_state
+coro_state_get(struct coro *c)
+{
+	return __atomic_load_n(&c->state, __ATOMIC_SEQ_CST);
+}
+
+static inline void
+coro_state_set(struct coro *c, enum coro_state state)
+{
+	__atomic_store_n(&c->state, state, __ATOMIC_SEQ_CST);
+}
+
+static inline bool
+coro_state_cas(struct coro *c, enum coro_state old, enum coro_state new)
+{
+	return __atomic_compare_exchange_n(&c->state, &old, new, false,
+		__ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST);
+}
+
+/**
+ * Sleep while the futex has the given value, but not past the
+ * @a deadline tick. UINT64_MAX means no deadline.
+ */
+static void
+coro_futex_wait(uint32_t *futex, uint32_t value, uint64_t deadline)
+{
+	struct timespec ts, *timeout = NULL;
+	if (deadline != UINT64_MAX) {
+		uint64_t now = coro_clock_tick();
+		if (deadline <= now)
+			return;
+		uint64_t ns = (deadline - now) * CORO_TICK_NS;
+		ts.tv_sec = ns / 1000000000;
+		ts.tv_nsec = ns % 1000000000;
+		timeout = &ts;
+	}
+	syscall(SYS_futex, futex, FUTEX_WAIT_PRIVATE, value, timeout, NULL, 0);
+}
+
+static void
+coro_futex_wake(uint32_t *futex, int count)
+{
+	syscall(SYS_futex, futex, FUTEX_WAKE_PRIVATE, count, NULL, NULL, 0);
+}
+
+/** Wake up the idle threads, if any, to look for new work. */
+static void
+coro_mt_notify(struct coro_mt *mt, int count)
+{
+	/* Pairs with the fence in the idle thread. */
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	if (__atomic_load_n(&mt->idle_count, __ATOMIC_RELAXED) == 0)
+		return;
+	__atomic_add_fetch(&mt->work_seq, 1, __ATOMIC_SEQ_CST);
+	coro_futex_wake(&mt->work_seq, count);
+	coro_reactor_interrupt(mt->reactor);
+}
+
+/** A coroutine became runnable. */
+static inline void
+coro_mt_running_inc(struct coro_mt *mt)
+{
+	if (mt != NULL)
+		__atomic_add_fetch(&mt->running_count, 1, __ATOMIC_SEQ_CST);
+}
+
+/**
+ * A coroutine stops being runnable. When none are left, all the
+ * threads have to stop.
+ */
+static inline void
+coro_mt_running_dec(struct coro_mt *mt)
+{
+	if (mt == NULL)
+		return;
+	if (__atomic_sub_fetch(&mt->running_count, 1, __ATOMIC_SEQ_CST) != 0)
+		return;
+	__atomic_add_fetch(&mt->work_seq, 1, __ATOMIC_SEQ_CST);
+	coro_futex_wake(&mt->work_seq, INT_MAX);
+	coro_reactor_interrupt(mt->reactor);
+}
+
+/** A coroutine starts waiting for a timer or an fd. */
+static inline void
+coro_mt_wait_inc(struct coro_mt *mt)
+{
+	if (mt != NULL)
+		__atomic_add_fetch(&mt->wait_count, 1, __ATOMIC_SEQ_CST);
+}
+
+/** A wait for a timer or an fd is over. */
+static inline void
+coro_mt_wait_dec(struct coro_mt *mt)
+{
+	if (mt == NULL)
+		return;
+	if (__atomic_sub_fetch(&mt->wait_count, 1, __ATOMIC_SEQ_CST) != 0 ||
+	    __atomic_load_n(&mt->running_count, __ATOMIC_SEQ_CST) != 0)
+		return;
+	__atomic_add_fetch(&mt->work_seq, 1, __ATOMIC_SEQ_CST);
+	coro_futex_wake(&mt->work_seq, INT_MAX);
+	coro_reactor_interrupt(mt->reactor);
+}
+
+/**
+ * Nothing is runnable and nothing will be - no coroutines wait
+ * for a timer or an fd.
+ */
+static inline bool
+coro_mt_is_done(struct coro_mt *mt)
+{
+	return __atomic_load_n(&mt->running_count, __ATOMIC_SEQ_CST) == 0 &&
+	       __atomic_load_n(&mt->wait_count, __ATOMIC_SEQ_CST) == 0;
+}
+
+static inline void
+coro_engine_lock(struct coro_engine *engine)
+{
+	if (engine->mt == NULL)
+		return;
+	while (__atomic_test_and_set(&engine->lock, __ATOMIC_ACQUIRE)) {
+		while (__atomic_load_n(&engine->lock, __ATOMIC_RELAXED))
+			coro_cpu_relax();
+	}
+}
+
+static inline bool
+coro_engine_trylock(struct coro_engine *engine)
+{
+	assert(engine->mt != NULL);
+	return !__atomic_test_and_set(&engine->lock, __ATOMIC_ACQUIRE);
+}
+
+static inline void
+coro_engine_unlock(struct coro_engine *engine)
+{
+	if (engine->mt != NULL)
+		__atomic_clear(&engine->lock, __ATOMIC_RELEASE);
+}
+
+static void
+coro_engine_create(struct coro_engine *engine)
+{
+	memset(engine, 0, sizeof(*engine));
+	rlist_create(&engine->sched.link);
+	rlist_create(&engine->coros_running_now);
+	for (int i = 0; i < CORO_PRIO_COUNT; ++i)
+		rlist_create(&engine->coros_running_next[i]);
+	rlist_create(&engine->coros_running_urgent);
+	for (int i = 0; i < CORO_STACK_CLASS_COUNT; ++i)
+		rlist_create(&engine->coros_pool[i]);
+	engine->pool_max = CORO_POOL_MAX_DEFAULT;
+	rlist_create(&engine->coros_all);
+	engine->sched.owner = engine;
+	rlist_create(&engine->sched.timer.link);
+	coro_timer_wheel_create(&engine->timers);
+	coro_reactor_create(&engine->reactor);
+	engine->io = &engine->reactor;
+#if LIBCORO_IO == LIBCORO_IO_URING
+	coro_uring_create(&engine->uring);
+#endif
+	engine->stack_size =
+		coro_stack_size_normalize(CORO_STACK_SIZE_DEFAULT);
+}
+
+/** Free a coroutine for good, with its stack. */
+static void
+coro_engine_coro_delete(struct coro_engine *engine, struct coro *c)
+{
+	rlist_del_entry(c, engine_link);
+	coro_stack_destroy(&c->stack);
+	free(c);
+	assert(engine->coro_count > 0);
+	--engine->coro_count;
+}
+
+/** Take a pooled coroutine out of its class list. */
+static void
+coro_engine_pool_del(struct coro_engine *engine, struct coro *c, int cls)
+{
+	rlist_del_entry(c, link);
+	assert(engine->pool_size[cls] > 0);
+	--engine->pool_size[cls];
+	if (engine->pool_size[cls] < engine->pool_min[cls])
+		engine->pool_min[cls] = engine->pool_size[cls];
+	--engine->pool_count;
+}
+
+/**
+ * Free the coldest pooled coroutines until the pool fits into the
+ * limit. The coroutines can be freed only by the engine whose
+ * list of all the coroutines they are in. In the multi-thread mode
+ * that is fine too, because the pool of an engine gets only its
+ * own coroutines, see coro_engine_recycle().
+ */
+static void
+coro_engine_pool_shrink(struct coro_engine *engine)
+{
+	for (int cls = CORO_STACK_CLASS_COUNT - 1;
+	     cls >= 0 && engine->pool_count > engine->pool_max; --cls) {
+		struct rlist *pool = &engine->coros_pool[cls];
+		while (!rlist_empty(pool) &&
+		       engine->pool_count > engine->pool_max) {
+			struct coro *c = rlist_last_entry(pool, struct coro,
+				link);
+			coro_engine_pool_del(engine, c, cls);
+			coro_engine_coro_delete(engine, c);
+			++engine->pool_free_count;
+		}
+	}
+}
+
+/** Put a joined coroutine into the pool, or free it if it's full. */
+static void
+coro_engine_pool_put(struct coro_engine *engine, struct coro *c)
+{
+	assert(rlist_empty(&c->link));
+	int cls = coro_stack_class(c->stack.size);
+	rlist_add_entry(&engine->coros_pool[cls], c, link);
+	++engine->pool_size[cls];
+	++engine->pool_count;
+	coro_engine_pool_shrink(engine);
+}
+
+/**
+ * Put a finished coroutine into the pool. In the multi-thread mode
+ * it goes to the pool of its home engine. Otherwise the threads
+ * finishing the detached coroutines would only grow their pools,
+ * while the spawning thread keeps creating new ones.
+ */
+static void
+coro_engine_recycle(struct coro_engine *engine, struct coro *c)
+{
+	struct coro_engine *home = c->home;
+	if (home == engine || engine->mt == NULL) {
+		coro_engine_pool_put(engine, c);
+		return;
+	}
+	struct coro *head = __atomic_load_n(&home->pool_remote_head,
+		__ATOMIC_RELAXED);
+	do {
+		c->remote_next = head;
+	} while (!__atomic_compare_exchange_n(&home->pool_remote_head,
+		&head, c, true, __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+}
+
+/** Move the coroutines recycled by the other threads into the pool. */
+static void
+coro_engine_pool_drain_remote(struct coro_engine *engine)
+{
+	if (__atomic_load_n(&engine->pool_remote_head,
+			    __ATOMIC_RELAXED) == NULL)
+		return;
+	struct coro *c = __atomic_exchange_n(&engine->pool_remote_head,
+		NULL, __ATOMIC_ACQUIRE);
+	while (c != NULL) {
+		struct coro *next = c->remote_next;
+		c->remote_next = NULL;
+		coro_engine_pool_put(engine, c);
+		c = next;
+	}
+}
+
+/**
+ * Take a pooled coroutine with a stack of at least the given size.
+ * Returns NULL if there is none.
+ */
+static struct coro *
+coro_engine_pool_take(struct coro_engine *engine, size_t stack_size)
+{
+	int cls = coro_stack_class(stack_size);
+	struct rlist *pool = &engine->coros_pool[cls];
+	if (rlist_empty(pool))
+		coro_engine_pool_drain_remote(engine);
+	/*
+	 * The stacks of a class are all of the same size, except
+	 * for the last class. There only the most recently pooled
+	 * one is checked, so the spawn stays O(1).
+	 */
+	if (rlist_empty(pool) ||
+	    rlist_first_entry(pool, struct coro, link)->stack.size <
+	    stack_size)
+		return NULL;
+	struct coro *c = rlist_first_entry(pool, struct coro, link);
+	coro_engine_pool_del(engine, c, cls);
+	c->stack.is_trimmed = false;
+	return c;
+}
+
+/**
+ * Give back the memory of the pooled coroutines which weren't
+ * needed since the last trim: the stacks get trimmed, and the
+ * already trimmed ones are freed. So the pool follows the real
+ * concurrency, with a lag of one or two periods. With @a is_full
+ * the whole pool is trimmed, and nothing is freed.
+ */
+static void
+coro_engine_pool_trim(struct coro_engine *engine, bool is_full)
+{
+	for (int cls = 0; cls < CORO_STACK_CLASS_COUNT; ++cls) {
+		struct rlist *pool = &engine->coros_pool[cls];
+		size_t idle_count = is_full ? engine->pool_size[cls] :
+			engine->pool_min[cls];
+		struct coro *c, *tmp;
+		rlist_foreach_entry_safe_reverse(c, pool, link, tmp) {
+			if (idle_count-- == 0)
+				break;
+			if (!c->stack.is_trimmed) {
+				void *sp = coro_ctx_sp(&c->ctx);
+				if (sp != NULL)
+					coro_stack_set_idle_end(&c->stack, sp);
+				coro_stack_trim(&c->stack);
+				++engine->pool_trim_count;
+			} else if (!is_full) {
+				coro_engine_pool_del(engine, c, cls);
+				coro_engine_coro_delete(engine, c);
+				++engine->pool_free_count;
+			}
+		}
+		engine->pool_min[cls] = engine->pool_size[cls];
+	}
+	engine->pool_trim_tick = coro_clock_tick();
+}
+
+/**
+ * Trim the pool if the period has passed. Returns the tick of the
+ * next trim, or UINT64_MAX if the pool has nothing to give back.
+ */
+static uint64_t
+coro_engine_pool_maintain(struct coro_engine *engine)
+{
+	coro_engine_pool_drain_remote(engine);
+	if (engine->pool_count == 0)
+		return UINT64_MAX;
+	uint64_t next = engine->pool_trim_tick + CORO_POOL_TRIM_PERIOD;
+	if (coro_clock_tick() < next)
+		return next;
+	coro_engine_pool_trim(engine, false);
+	if (engine->pool_count == 0)
+		return UINT64_MAX;
+	return engine->pool_trim_tick + CORO_POOL_TRIM_PERIOD;
+}
+
+/**
+ * Put a runnable coroutine into the queue of its priority. A high
+ * priority one, which is @a is_woken_up, can run still in this
+ * iteration. Must be called under the lock.
+ */
+static inline void
+coro_engine_enqueue(struct coro_engine *engine, struct coro *coro,
+	bool is_woken_up)
+{
+	struct rlist *queue = &engine->coros_running_next[coro->priority];
+	if (is_woken_up && coro->priority == CORO_PRIO_HIGH)
+		queue = &engine->coros_running_urgent;
+	rlist_add_tail_entry(queue, coro, link);
+}
+
+/** Check if anything is queued to run, without the lock. */
+static inline bool
+coro_engine_has_next(struct coro_engine *engine)
+{
+	for (int i = 0; i < CORO_PRIO_COUNT; ++i) {
+		if (!rlist_empty(&engine->coros_running_next[i]))
+			return true;
+	}
+	return !rlist_empty(&engine->coros_running_urgent);
+}
+
+/**
+ * Make the coroutine run on the next iteration of the loop. See
+ * coro_engine_enqueue() about @a is_woken_up.
+ */
+static void
+coro_engine_push_next(struct coro_engine *engine, struct coro *coro,
+	bool is_woken_up)
+{
+	assert(rlist_empty(&coro->link));
+	if (engine->is_stats_enabled)
+		coro->runnable_since = coro_clock_ns();
+	coro_engine_lock(engine);
+	coro_engine_enqueue(engine, coro, is_woken_up);
+	coro_engine_unlock(engine);
+	if (engine->mt != NULL)
+		coro_mt_notify(engine->mt, 1);
+}
+
+/**
+ * Make the coroutine runnable in an engine of another thread. It
+ * doesn't take any locks, the engine will find the coroutine on
+ * its next iteration.
+ */
+static void
+coro_engine_push_remote(struct coro_engine *engine, struct coro *coro)
+{
+	if (engine->is_stats_enabled)
+		coro->runnable_since = coro_clock_ns();
+	struct coro *head = __atomic_load_n(&engine->remote_head,
+		__ATOMIC_RELAXED);
+	do {
+		coro->remote_next = head;
+	} while (!__atomic_compare_exchange_n(&engine->remote_head, &head,
+		coro, true, __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+	/* Can't know which thread sleeps, so wake all. */
+	coro_mt_notify(engine->mt, INT_MAX);
+}
+
+/** Move the remotely woken up coroutines into the own queue. */
+static void
+coro_engine_drain_remote(struct coro_engine *engine)
+{
+	if (__atomic_load_n(&engine->remote_head, __ATOMIC_RELAXED) == NULL)
+		return;
+	struct coro *c = __atomic_exchange_n(&engine->remote_head, NULL,
+		__ATOMIC_ACQUIRE);
+	/* It was a stack, restore the wakeup order. */
+	struct coro *first = NULL;
+	while (c != NULL) {
+		struct coro *next = c->remote_next;
+		c->remote_next = first;
+		first = c;
+		c = next;
+	}
+	coro_engine_lock(engine);
+	for (c = first; c != NULL; c = c->remote_next) {
+		assert(rlist_empty(&c->link));
+		assert(c->owner == engine);
+		coro_engine_enqueue(engine, c, true);
+	}
+	coro_engine_unlock(engine);
+}
+
+/**
+ * Finish a switch on the side of the resumed context: the
+ * previous coroutine has saved its context and can be continued
+ * by any thread now.
+ */
+static struct coro_engine *
+coro_engine_finish_switch(void)
+{
+	struct coro_engine *engine = coro_engine_current();
+	struct coro *prev = engine->prev;
+	if (prev != NULL) {
+		engine->prev = NULL;
+		__atomic_store_n(&prev->on_cpu, false, __ATOMIC_RELEASE);
+		if (engine->is_prev_released) {
+			engine->is_prev_released = false;
+			prev->ret = NULL;
+			coro_engine_recycle(engine, prev);
+		}
+	}
+	return engine;
+}
+
+/**
+ * Close the time slice of the coroutine leaving the CPU, and open
+ * the one of the coroutine getting it. The scheduler itself isn't
+ * accounted.
+ */
+static void
+coro_engine_account_switch(struct coro_engine *engine, struct coro *from,
+	struct coro *to)
+{
+	uint64_t now = coro_clock_ns();
+	if (from != &engine->sched && from->slice_start != 0) {
+		uint64_t slice = now - from->slice_start;
+		from->stats.run_ns += slice;
+		if (slice > from->stats.max_slice_ns)
+			from->stats.max_slice_ns = slice;
+		if (engine->trace != NULL &&
+		    engine->trace_size < engine->trace_capacity) {
+			struct coro_trace_event *e =
+				&engine->trace[engine->trace_size++];
+			/* Started before the trace. */
+			if (from->id == 0)
+				from->id = coro_id_new();
+			e->coro_id = from->id;
+			e->start_ns = from->slice_start;
+			e->duration_ns = slice;
+			e->engine_id = engine->id;
+		}
+		from->slice_start = 0;
+	}
+	if (to != &engine->sched) {
+		++to->stats.switch_count;
+		if (to->runnable_since != 0) {
+			to->stats.wait_ns += now - to->runnable_since;
+			to->runnable_since = 0;
+		}
+		to->slice_start = now;
+	}
+}
+
+/**
+ * Take an urgent coroutine to run out of order, if there is any
+ * and the budget allows.
+ */
+static struct coro *
+coro_engine_shift_urgent(struct coro_engine *engine)
+{
+	if (engine->urgent_budget == 0 ||
+	    rlist_empty(&engine->coros_running_urgent))
+		return NULL;
+	struct coro *c = NULL;
+	coro_engine_lock(engine);
+	/* Could be stolen meanwhile. */
+	if (!rlist_empty(&engine->coros_running_urgent)) {
+		c = rlist_shift_entry(&engine->coros_running_urgent,
+			struct coro, link);
+		--engine->urgent_budget;
+	}
+	coro_engine_unlock(engine);
+	return c;
+}
+
+/**
+ * Switch to the next coroutine of this iteration. Returns the
+ * engine on which the current coroutine is continued - it can be
+ * different from the original one in the multi-thread mode.
+ */
+static struct coro_engine *
+coro_engine_resume_next(struct coro_engine *engine)
+{
+	assert(!rlist_empty(&engine->coros_running_now));
+	struct coro *to = coro_engine_shift_urgent(engine);
+	if (to == NULL) {
+		to = rlist_shift_entry(&engine->coros_running_now,
+			struct coro, link);
+	}
+	struct coro *from = engine->this;
+	assert(from != NULL);
+
+	engine->this = NULL;
+	engine->prev = from;
+	++engine->stats.switch_count;
+	if (engine->is_stats_enabled)
+		coro_engine_account_switch(engine, from, to);
+	__atomic_store_n(&to->on_cpu, true, __ATOMIC_RELAXED);
+	coro_ctx_switch(&from->ctx, &to->ctx);
+	engine = coro_engine_finish_switch();
+	assert(rlist_empty(&from->link));
+	assert(engine->this == NULL);
+	engine->this = from;
+	return engine;
+}
+
+/**
+ * Switch away from the current coroutine, which has already set
+ * its state to suspended. If it was woken up in between, then it
+ * is already in a running queue and will just continue later.
+ */
+static struct coro_engine *
+coro_engine_park(struct coro_engine *engine)
+{
+	coro_mt_running_dec(engine->mt);
+	return coro_engine_resume_next(engine);
+}
+
+static struct coro_engine *
+coro_engine_suspend(struct coro_engine *engine)
+{
+	struct coro *this = engine->this;
+	if (this == NULL) {
+		printf("Error: deadlock - suspension with no active "
+			"coroutines\n");
+		exit(-1);
+	}
+	assert(rlist_empty(&this->link));
+	assert(this->state == CORO_STATE_RUNNING);
+	coro_state_set(this, CORO_STATE_SUSPENDED);
+	/*
+	 * The wakeup could come from another thread while this
+	 * coroutine was still running. Then the suspension ends
+	 * right away.
+	 */
+	if (engine->mt != NULL &&
+	    __atomic_exchange_n(&this->wakeup_pending, false,
+				__ATOMIC_SEQ_CST) &&
+	    coro_state_cas(this, CORO_STATE_SUSPENDED, CORO_STATE_RUNNING))
+		return engine;
+	return coro_engine_park(engine);
+}
+
+static struct coro_engine *
+coro_engine_yield(struct coro_engine *engine)
+{
+	struct coro *this = engine->this;
+	assert(rlist_empty(&this->link));
+	assert(this->state == CORO_STATE_RUNNING);
+	coro_engine_push_next(engine, this, false);
+	return coro_engine_resume_next(engine);
+}
+
+static void
+coro_engine_wakeup(struct coro_engine *engine, struct coro *coro)
+{
+	/*
+	 * The owner can change, but only inside of one thread set,
+	 * so the set itself stays the same.
+	 */
+	struct coro_mt *mt = coro->owner->mt;
+	if (mt != NULL)
+		__atomic_store_n(&coro->wakeup_pending, true, __ATOMIC_SEQ_CST);
+	if (!coro_state_cas(coro, CORO_STATE_SUSPENDED, CORO_STATE_RUNNING))
+		return;
+	++engine->stats.wakeup_count;
+	coro_mt_running_inc(mt);
+	/*
+	 * The owner can't change while the coroutine is suspended,
+	 * only runnable coroutines are stolen.
+	 */
+	struct coro_engine *owner = coro->owner;
+	if (owner == engine || mt == NULL)
+		coro_engine_push_next(owner, coro, true);
+	else
+		coro_engine_push_remote(owner, coro);
+}
+
+static inline void
+coro_group_lock(struct coro_group *group)
+{
+	while (__atomic_test_and_set(&group->lock, __ATOMIC_ACQUIRE)) {
+		while (__atomic_load_n(&group->lock, __ATOMIC_RELAXED))
+			coro_cpu_relax();
+	}
+}
+
+static inline void
+coro_group_unlock(struct coro_group *group)
+{
+	__atomic_clear(&group->lock, __ATOMIC_RELEASE);
+}
+
+/** Check the cancellation of any coroutine, not only the current one. */
+static inline bool
+coro_state_is_cancelled(const struct coro *coro)
+{
+	return __atomic_load_n(&coro->is_cancelled, __ATOMIC_ACQUIRE);
+}
+
+/**
+ * Ask a coroutine to stop. If it waits for something, then it is
+ * woken up, and the wait ends with the cancellation status.
+ */
+static void
+coro_engine_cancel(struct coro_engine *engine, struct coro *coro)
+{
+	__atomic_store_n(&coro->is_cancelled, true, __ATOMIC_SEQ_CST);
+	coro_engine_wakeup(engine, coro);
+}
+
+/** Cancel all the children of the group, and the future ones. */
+static void
+coro_engine_group_cancel(struct coro_engine *engine, struct coro_group *group)
+{
+	coro_group_lock(group);
+	group->is_cancelled = true;
+	struct coro *c;
+	rlist_foreach_entry(c, &group->children, group_link)
+		coro_engine_cancel(engine, c);
+	coro_group_unlock(group);
+}
+
+/**
+ * A child of the group has finished. The last one wakes the
+ * waiter up. The counter and the waiter are under the lock, so the
+ * waiter either is seen here or sees the zero itself. The group
+ * can be gone right after the unlock.
+ */
+static void
+coro_engine_group_child_done(struct coro_engine *engine,
+	struct coro_group *group, struct coro *child)
+{
+	coro_group_lock(group);
+	rlist_del_entry(child, group_link);
+	struct coro *waiter = NULL;
+	if (__atomic_sub_fetch(&group->count, 1, __ATOMIC_SEQ_CST) == 0)
+		waiter = group->waiter;
+	coro_group_unlock(group);
+	if (waiter != NULL)
+		coro_engine_wakeup(engine, waiter);
+}
+
+/**
+ * Number of the children not finished yet. Under the lock, so the
+ * zero is seen only after the last child is done with the group.
+ */
+static long
+coro_group_count(struct coro_group *group)
+{
+	coro_group_lock(group);
+	long count = group->count;
+	coro_group_unlock(group);
+	return count;
+}
+
+/**
+ * Arm the timer of a coroutine which is going to suspend. Until
+ * the timer is disarmed the coroutine can't be stolen, so the
+ * wheel is touched only by the owner thread.
+ */
+static void
+coro_engine_timer_start(struct coro_engine *engine, struct coro *c,
+	uint64_t deadline)
+{
+	c->is_timed_out = false;
+	coro_timer_wheel_add(&engine->timers, &c->timer, deadline);
+	coro_mt_wait_inc(engine->mt);
+}
+
+static void
+coro_engine_timer_stop(struct coro_engine *engine, struct coro *c)
+{
+	if (rlist_empty(&c->timer.link))
+		return;
+	coro_timer_wheel_del(&engine->timers, &c->timer);
+	coro_mt_wait_dec(engine->mt);
+}
+
+/** Wake up the coroutines whose timers have expired. */
+static void
+coro_engine_process_timers(struct coro_engine *engine)
+{
+	if (engine->timers.count == 0)
+		return;
+	struct rlist expired;
+	rlist_create(&expired);
+	coro_timer_wheel_advance(&engine->timers, coro_clock_tick(), &expired);
+	while (!rlist_empty(&expired)) {
+		struct coro *c = rlist_first_entry(&expired, struct coro,
+			timer.link);
+		/*
+		 * The thieves check the timer under the lock. After it
+		 * is disarmed, the coroutine can go to another thread.
+		 */
+		coro_engine_lock(engine);
+		rlist_del(&c->timer.link);
+		c->is_timed_out = true;
+		coro_engine_unlock(engine);
+		/* Runnable first, so the work never looks finished. */
+		coro_engine_wakeup(engine, c);
+		coro_mt_wait_dec(engine->mt);
+	}
+}
+
+/**
+ * Suspend until a wakeup or the @a deadline tick, whichever comes
+ * first. Returns the engine on which the coroutine continues.
+ */
+static struct coro_engine *
+coro_engine_suspend_until(struct coro_engine *engine, uint64_t deadline)
+{
+	struct coro *this = engine->this;
+	/* Reports the deadlock. */
+	if (this == NULL)
+		return coro_engine_suspend(engine);
+	coro_engine_timer_start(engine, this, deadline);
+	engine = coro_engine_suspend(engine);
+	/* If still armed, then it wasn't stolen and the engine is same. */
+	coro_engine_timer_stop(engine, this);
+	return engine;
+}
+
+static void
+coro_engine_sleep(struct coro_engine *engine, double sec)
+{
+	if (sec <= 0) {
+		coro_engine_yield(engine);
+		return;
+	}
+	struct coro *this = engine->this;
+	uint64_t deadline = coro_clock_deadline(sec);
+	/* The wakeups don't interrupt the sleep, the cancellation does. */
+	do {
+		if (this != NULL && coro_state_is_cancelled(this))
+			return;
+		engine = coro_engine_suspend_until(engine, deadline);
+	} while (!this->is_timed_out);
+}
+
+static bool
+coro_engine_suspend_timeout(struct coro_engine *engine, double sec)
+{
+	struct coro *this = engine->this;
+	if (this != NULL && coro_state_is_cancelled(this))
+		return false;
+	coro_engine_suspend_until(engine, coro_clock_deadline(sec));
+	return !this->is_timed_out && !coro_state_is_cancelled(this);
+}
+
+/**
+ * Suspend until a wakeup. Returns false if the coroutine is
+ * cancelled - then it doesn't suspend at all.
+ */
+static bool
+coro_engine_suspend_cancellable(struct coro_engine *engine)
+{
+	struct coro *this = engine->this;
+	if (this != NULL && coro_state_is_cancelled(this))
+		return false;
+	coro_engine_suspend(engine);
+	return !coro_state_is_cancelled(this);
+}
+
+/**
+ * Wait until the fd is ready for any of @a events. If @a seq is
+ * not NULL, then it is the fd's edge counter seen before the
+ * operation which got EAGAIN. If an edge came since, the wait
+ * ends right away. Otherwise the known readiness is reset. Returns
+ * the engine on which the coroutine continues, NULL on error.
+ */
+static struct coro_engine *
+coro_engine_wait_fd(struct coro_engine *engine, int fd, uint32_t events,
+	const uint32_t *seq)
+{
+	struct coro *this = engine->this;
+	/* Reports the deadlock. */
+	if (this == NULL)
+		return coro_engine_suspend(engine);
+	if (fd < 0) {
+		errno = EBADF;
+		return NULL;
+	}
+	if (coro_state_is_cancelled(this)) {
+		errno = ECANCELED;
+		return NULL;
+	}
+	struct coro_reactor *r = engine->io;
+	coro_reactor_lock(r);
+	if (coro_reactor_open(r) != 0) {
+		coro_reactor_unlock(r);
+		return NULL;
+	}
+	struct coro_fd *f = coro_reactor_fd(r, fd);
+	if (!f->is_registered) {
+		struct epoll_event ev;
+		ev.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+		ev.data.fd = fd;
+		if (epoll_ctl(r->epoll_fd, EPOLL_CTL_ADD, fd, &ev) != 0 &&
+		    errno != EEXIST) {
+			coro_reactor_unlock(r);
+			return NULL;
+		}
+		f->is_registered = true;
+		/* The epoll reports the current state as a first edge. */
+		f->ready = 0;
+	}
+	if (seq == NULL || *seq == f->seq)
+		f->ready &= ~events;
+	if ((f->ready & events) != 0) {
+		coro_reactor_unlock(r);
+		return engine;
+	}
+	struct coro_fd_wait wait;
+	wait.coro = this;
+	wait.events = events;
+	rlist_add_tail(&f->waits, &wait.link);
+	__atomic_add_fetch(&r->wait_count, 1, __ATOMIC_RELAXED);
+	coro_mt_wait_inc(engine->mt);
+	/*
+	 * The other wakeups don't end the wait, except for the
+	 * cancellation. The poller unlinks the wait before the
+	 * wakeup.
+	 */
+	do {
+		coro_reactor_unlock(r);
+		engine = coro_engine_suspend(engine);
+		coro_reactor_lock(r);
+	} while (!rlist_empty(&wait.link) && !coro_state_is_cancelled(this));
+	if (!rlist_empty(&wait.link)) {
+		rlist_del(&wait.link);
+		__atomic_sub_fetch(&r->wait_count, 1, __ATOMIC_RELAXED);
+		coro_reactor_unlock(r);
+		coro_mt_wait_dec(engine->mt);
+		errno = ECANCELED;
+		return NULL;
+	}
+	coro_reactor_unlock(r);
+	return engine;
+}
+
+/** End the waits which are satisfied by the fd's readiness. */
+static void
+coro_engine_wakeup_fd(struct coro_engine *engine, struct coro_fd *f)
+{
+	struct coro_reactor *r = engine->io;
+	struct coro_fd_wait *wait, *tmp;
+	rlist_foreach_entry_safe(wait, &f->waits, link, tmp) {
+		if ((wait->events & f->ready) == 0)
+			continue;
+		struct coro *c = wait->coro;
+		/* After this the wait can be gone from the stack. */
+		rlist_del(&wait->link);
+		__atomic_sub_fetch(&r->wait_count, 1, __ATOMIC_RELAXED);
+		coro_engine_wakeup(engine, c);
+		coro_mt_wait_dec(engine->mt);
+	}
+}
+
+/**
+ * Take the events from the epoll and wake up the waiters. Blocks
+ * until the @a deadline tick: 0 means don't block, UINT64_MAX -
+ * no deadline. In the multi-thread mode @a seq is the work
+ * sequence seen before going idle, the blocking is skipped if it
+ * has changed. Returns false if another thread polls already.
+ */
+static bool
+coro_engine_poll(struct coro_engine *engine, uint64_t deadline,
+	const uint32_t *seq)
+{
+	struct coro_reactor *r = engine->io;
+	int epoll_fd = __atomic_load_n(&r->epoll_fd, __ATOMIC_ACQUIRE);
+	if (epoll_fd < 0)
+		return false;
+	if (r->is_shared &&
+	    __atomic_test_and_set(&r->is_polling, __ATOMIC_ACQUIRE))
+		return false;
+	int timeout = 0;
+	if (deadline == UINT64_MAX) {
+		timeout = -1;
+	} else if (deadline != 0) {
+		uint64_t now = coro_clock_tick();
+		if (deadline > now) {
+			uint64_t ms = ((deadline - now) * CORO_TICK_NS +
+				999999) / 1000000;
+			timeout = ms > INT_MAX ? INT_MAX : (int)ms;
+		}
+	}
+	if (timeout != 0 && seq != NULL) {
+		/* Pairs with the interruption by coro_mt_notify(). */
+		__atomic_store_n(&r->is_blocked, true, __ATOMIC_SEQ_CST);
+		if (__atomic_load_n(&engine->mt->work_seq,
+				    __ATOMIC_SEQ_CST) != *seq)
+			timeout = 0;
+	}
+	struct epoll_event events[CORO_POLL_BATCH];
+	int count = epoll_wait(epoll_fd, events, CORO_POLL_BATCH, timeout);
+	if (seq != NULL)
+		__atomic_store_n(&r->is_blocked, false, __ATOMIC_SEQ_CST);
+	if (count < 0 && errno != EINTR)
+		handle_error();
+	coro_reactor_lock(r);
+	for (int i = 0; i < count; ++i) {
+		int fd = events[i].data.fd;
+		if (fd == r->event_fd) {
+			uint64_t value;
+			if (read(fd, &value, sizeof(value)) < 0 &&
+			    errno != EAGAIN)
+				handle_error();
+			continue;
+		}
+		struct coro_fd *f = coro_reactor_fd(r, fd);
+		f->ready |= coro_reactor_events(events[i].events);
+		++f->seq;
+		coro_engine_wakeup_fd(engine, f);
+	}
+	coro_reactor_unlock(r);
+	if (r->is_shared)
+		__atomic_clear(&r->is_polling, __ATOMIC_RELEASE);
+	return true;
+}
+
+/**
+ * Forget the fd before it is closed, so a new fd with the same
+ * number starts clean. The waiters are woken up to find the fd
+ * closed.
+ */
+static void
+coro_engine_forget_fd(struct coro_engine *engine, int fd)
+{
+	struct coro_reactor *r = engine->io;
+	coro_reactor_lock(r);
+	if (fd >= 0 && fd < r->fd_capacity) {
+		struct coro_fd *f = &r->fds[fd];
+		if (f->is_registered)
+			epoll_ctl(r->epoll_fd, EPOLL_CTL_DEL, fd, NULL);
+		f->is_registered = false;
+		f->ready = CORO_FD_READ | CORO_FD_WRITE;
+		++f->seq;
+		coro_engine_wakeup_fd(engine, f);
+	}
+	coro_reactor_unlock(r);
+}
+
+/**
+ * Get the fd's known readiness and its edge counter, to pass into
+ * coro_engine_wait_fd() if the operation fails.
+ */
+static uint32_t
+coro_engine_fd_ready(struct coro_engine *engine, int fd, uint32_t *seq)
+{
+	struct coro_reactor *r = engine->io;
+	uint32_t ready = CORO_FD_READ | CORO_FD_WRITE;
+	*seq = 0;
+	coro_reactor_lock(r);
+	if (fd >= 0 && fd < r->fd_capacity) {
+		ready = r->fds[fd].ready;
+		*seq = r->fds[fd].seq;
+	}
+	coro_reactor_unlock(r);
+	return ready;
+}
+
+#if LIBCORO_IO == LIBCORO_IO_URING
+
+/**
+ * Check if the I/O of the engine goes through the ring. It is
+ * opened on the first need. The multi-thread mode always uses the
+ * shared epoll.
+ */
+static bool
+coro_engine_uses_uring(struct coro_engine *engine)
+{
+	if (engine->mt != NULL)
+		return false;
+	struct coro_uring *u = &engine->uring;
+	if (!u->is_probed) {
+		u->is_probed = true;
+		coro_uring_open(u);
+	}
+	return u->fd >= 0;
+}
+
+static inline long
+coro_engine_uring_inflight(struct coro_engine *engine)
+{
+	return engine->uring.inflight;
+}
+
+/**
+ * Submit the queued operations, and wake up the coroutines whose
+ * operations are complete. @a deadline is the same as for
+ * coro_uring_enter().
+ */
+static void
+coro_engine_uring_enter(struct coro_engine *engine, uint64_t deadline)
+{
+	struct coro_uring *u = &engine->uring;
+	if (u->fd < 0)
+		return;
+	coro_uring_enter(u, deadline);
+	while (true) {
+		unsigned head = *u->cq_head;
+		unsigned tail = __atomic_load_n(u->cq_tail, __ATOMIC_ACQUIRE);
+		for (; head != tail; ++head) {
+			struct io_uring_cqe *cqe = &u->cqes[head & u->cq_mask];
+			struct coro_uring_op *op =
+				(struct coro_uring_op *)(uintptr_t)cqe->user_data;
+			struct coro *c = op->coro;
+			op->res = cqe->res;
+			op->is_done = true;
+			assert(u->inflight > 0);
+			--u->inflight;
+			coro_engine_wakeup(engine, c);
+			coro_mt_wait_dec(engine->mt);
+		}
+		__atomic_store_n(u->cq_head, head, __ATOMIC_RELEASE);
+		/* The kernel keeps what didn't fit, take it too. */
+		if ((__atomic_load_n(u->sq_flags, __ATOMIC_ACQUIRE) &
+		     IORING_SQ_CQ_OVERFLOW) == 0)
+			break;
+		if (syscall(__NR_io_uring_enter, u->fd, 0, 0,
+			    IORING_ENTER_GETEVENTS, NULL, 0) < 0 &&
+		    errno != EINTR && errno != EAGAIN && errno != EBUSY)
+			handle_error();
+	}
+}
+
+/**
+ * Do an operation via the ring and wait for its completion. The
+ * other wakeups don't interrupt the wait, the operation uses the
+ * coroutine's stack. If the kernel returns EAGAIN instead of
+ * waiting for the fd, then it is waited explicitly and the
+ * operation is repeated. Returns the result or -errno.
+ */
+static int
+coro_engine_uring_io(struct coro_engine *engine, uint8_t opcode, int fd,
+	const void *addr, uint32_t len, uint64_t off, uint32_t flags)
+{
+	/* Reports the deadlock. */
+	if (engine->this == NULL)
+		coro_engine_suspend(engine);
+	struct coro *this = engine->this;
+	bool is_cancellable = opcode != IORING_OP_ASYNC_CANCEL;
+	while (true) {
+		if (is_cancellable && coro_state_is_cancelled(this))
+			return -ECANCELED;
+		struct coro_uring_op op;
+		op.coro = engine->this;
+		op.res = 0;
+		op.is_done = false;
+		struct io_uring_sqe *sqe = coro_uring_get_sqe(&engine->uring);
+		sqe->opcode = opcode;
+		sqe->fd = fd;
+		sqe->addr = (uintptr_t)addr;
+		sqe->len = len;
+		sqe->off = off;
+		/* All the operation flags are in one union. */
+		sqe->rw_flags = flags;
+		sqe->user_data = (uintptr_t)&op;
+		++engine->uring.inflight;
+		do {
+			engine = coro_engine_suspend(engine);
+			/*
+			 * The buffer and the op are on the stack, so the
+			 * kernel must be done with them before return.
+			 */
+			if (!op.is_done && is_cancellable &&
+			    coro_state_is_cancelled(this)) {
+				is_cancellable = false;
+				coro_engine_uring_io(engine,
+					IORING_OP_ASYNC_CANCEL, -1, &op, 0, 0,
+					0);
+			}
+		} while (!op.is_done);
+		if (op.res != -EAGAIN || opcode == IORING_OP_POLL_ADD ||
+		    opcode == IORING_OP_ASYNC_CANCEL)
+			return op.res;
+		uint32_t events = opcode == IORING_OP_WRITE ||
+			opcode == IORING_OP_SEND ? POLLOUT : POLLIN;
+		int rc = coro_engine_uring_io(engine, IORING_OP_POLL_ADD, fd,
+			NULL, 0, 0, events);
+		if (rc < 0)
+			return rc;
+	}
+}
+
+/** Turn the ring's -errno into the syscall style result. */
+static inline ssize_t
+coro_uring_result(int res)
+{
+	if (res >= 0)
+		return res;
+	errno = -res;
+	return -1;
+}
+
+#else /* LIBCORO_IO != LIBCORO_IO_URING */
+
+static inline long
+coro_engine_uring_inflight(struct coro_engine *engine)
+{
+	(void)engine;
+	return 0;
+}
+
+static inline void
+coro_engine_uring_enter(struct coro_engine *engine, uint64_t deadline)
+{
+	(void)engine;
+	(void)deadline;
+}
+
+#endif /* LIBCORO_IO != LIBCORO_IO_URING */
+
+/**
+ * Run one iteration of the scheduler loop. Each coroutine which
+ * is runnable at its start gets a chance to work. Returns false
+ * if there was nothing to run.
+ */
+static bool
+coro_engine_run_once(struct coro_engine *engine)
+{
+	assert(rlist_empty(&engine->coros_running_now));
+	struct rlist *now = &engine->coros_running_now;
+	struct rlist *next = engine->coros_running_next;
+	coro_engine_lock(engine);
+	/* The urgent ones didn't fit into the previous iteration. */
+	rlist_splice_tail(now, &engine->coros_running_urgent);
+	rlist_splice_tail(now, &next[CORO_PRIO_HIGH]);
+	rlist_splice_tail(now, &next[CORO_PRIO_NORMAL]);
+	if (rlist_empty(now) ||
+	    engine->stats.loop_count % CORO_PRIO_LOW_PERIOD == 0)
+		rlist_splice_tail(now, &next[CORO_PRIO_LOW]);
+	coro_engine_unlock(engine);
+	if (rlist_empty(now))
+		return false;
+	++engine->stats.loop_count;
+	engine->urgent_budget = CORO_PRIO_URGENT_BUDGET;
+
+	assert(engine->this == NULL);
+	engine->this = &engine->sched;
+	assert(rlist_empty(&engine->sched.link));
+	/*
+	 * Add the scheduler to the tail so the control comes back
+	 * in the end of this iteration of the loop.
+	 */
+	rlist_add_tail_entry(&engine->coros_running_now,
+		&engine->sched, link);
+	struct coro_engine *sched_engine = coro_engine_resume_next(engine);
+	/* The scheduler itself never migrates. */
+	assert(sched_engine == engine);
+	(void)sched_engine;
+	assert(rlist_empty(&engine->coros_running_now));
+	assert(engine->this == &engine->sched);
+	engine->this = NULL;
+	return true;
+}
+
+/**
+ * Run while anything is runnable. When only the coroutines
+ * waiting for timers and fds are left, the thread sleeps in the
+ * kernel until an fd is ready or the nearest deadline.
+ */
+static void
+coro_engine_run(struct coro_engine *engine)
+{
+	++this_thread_run_depth;
+	while (true) {
+		coro_engine_process_timers(engine);
+		if (coro_engine_run_once(engine)) {
+			/* Busy coroutines must not starve the I/O. */
+			if (engine->io->wait_count != 0)
+				coro_engine_poll(engine, 0, NULL);
+			/* All the iteration's operations go at once. */
+			coro_engine_uring_enter(engine, 0);
+			if (engine->stats.loop_count %
+			    CORO_POOL_TRIM_CHECK_LOOPS == 0)
+				coro_engine_pool_maintain(engine);
+			continue;
+		}
+		uint64_t deadline = coro_timer_wheel_next(&engine->timers);
+		if (deadline == UINT64_MAX && engine->io->wait_count == 0 &&
+		    coro_engine_uring_inflight(engine) == 0)
+			break;
+		/* The idle stacks are given back while sleeping too. */
+		uint64_t trim_deadline = coro_engine_pool_maintain(engine);
+		if (trim_deadline < deadline)
+			deadline = trim_deadline;
+		/* The epoll isn't used while the ring is. */
+		if (coro_engine_uring_inflight(engine) != 0) {
+			coro_engine_uring_enter(engine, deadline);
+			continue;
+		}
+		if (engine->io->wait_count != 0) {
+			coro_engine_poll(engine, deadline, NULL);
+			continue;
+		}
+		uint64_t now = coro_clock_tick();
+		if (deadline <= now)
+			continue;
+		uint64_t ns = (deadline - now) * CORO_TICK_NS;
+		struct timespec ts;
+		ts.tv_sec = ns / 1000000000;
+		ts.tv_nsec = ns % 1000000000;
+		nanosleep(&ts, NULL);
+	}
+	--this_thread_run_depth;
+}
+
+/**
+ * Move a half of the coroutines of one queue of the victim into
+ * the @a stolen list. Returns how many were moved.
+ */
+static size_t
+coro_engine_steal_queue(struct coro_engine *engine, struct rlist *queue,
+	struct rlist *stolen)
+{
+	size_t count = 0;
+	struct coro *c, *tmp;
+	rlist_foreach_entry(c, queue, link)
+		++count;
+	size_t to_steal = (count + 1) / 2;
+	count = 0;
+	rlist_foreach_entry_safe(c, queue, link, tmp) {
+		if (count == to_steal)
+			break;
+		/* Not switched out yet, can't be taken. */
+		if (__atomic_load_n(&c->on_cpu, __ATOMIC_ACQUIRE))
+			continue;
+		/* Bound to the engine by the armed timer. */
+		if (!rlist_empty(&c->timer.link))
+			continue;
+		rlist_del_entry(c, link);
+		rlist_add_tail_entry(stolen, c, link);
+		c->owner = engine;
+		++count;
+	}
+	return count;
+}
+
+/**
+ * Take a half of the runnable coroutines of each priority from
+ * another engine. Returns false if found nothing. Busy engines
+ * are skipped, and then @a is_contended is set - there might be
+ * something to steal later.
+ */
+static bool
+coro_engine_steal(struct coro_engine *engine, bool *is_contended)
+{
+	struct coro_mt *mt = engine->mt;
+	for (int i = 1; i < mt->engine_count; ++i) {
+		struct coro_engine *victim =
+			mt->engines[(engine->id + i) % mt->engine_count];
+		if (!coro_engine_has_next(victim))
+			continue;
+		if (!coro_engine_trylock(victim)) {
+			*is_contended = true;
+			continue;
+		}
+		struct rlist stolen[CORO_PRIO_COUNT];
+		for (int p = 0; p < CORO_PRIO_COUNT; ++p)
+			rlist_create(&stolen[p]);
+		/* They are late already, so go first in the new engine. */
+		size_t count = coro_engine_steal_queue(engine,
+			&victim->coros_running_urgent,
+			&stolen[CORO_PRIO_HIGH]);
+		for (int p = 0; p < CORO_PRIO_COUNT; ++p) {
+			count += coro_engine_steal_queue(engine,
+				&victim->coros_running_next[p], &stolen[p]);
+		}
+		coro_engine_unlock(victim);
+		if (count == 0)
+			continue;
+		coro_engine_lock(engine);
+		for (int p = 0; p < CORO_PRIO_COUNT; ++p) {
+			rlist_splice_tail(&engine->coros_running_next[p],
+				&stolen[p]);
+		}
+		coro_engine_unlock(engine);
+		return true;
+	}
+	return false;
+}
+
+/**
+ * Scheduler loop of one thread in the multi-thread mode. Runs the
+ * own coroutines, steals when has none, and sleeps when there is
+ * nothing to steal. Returns when all threads are out of work.
+ */
+static void
+coro_engine_run_mt(struct coro_engine *engine)
+{
+	struct coro_mt *mt = engine->mt;
+	int spin_count = 0;
+	++this_thread_run_depth;
+	while (true) {
+		coro_engine_drain_remote(engine);
+		coro_engine_process_timers(engine);
+		if (__atomic_load_n(&engine->io->wait_count,
+				    __ATOMIC_RELAXED) != 0)
+			coro_engine_poll(engine, 0, NULL);
+		/* Completions of the ring used before the threads. */
+		if (coro_engine_uring_inflight(engine) != 0)
+			coro_engine_uring_enter(engine, 0);
+		if (coro_engine_run_once(engine)) {
+			spin_count = 0;
+			if (engine->stats.loop_count %
+			    CORO_POOL_TRIM_CHECK_LOOPS == 0)
+				coro_engine_pool_maintain(engine);
+			continue;
+		}
+		bool is_contended = false;
+		if (coro_engine_steal(engine, &is_contended)) {
+			spin_count = 0;
+			continue;
+		}
+		if (coro_mt_is_done(mt))
+			break;
+		if (is_contended || ++spin_count < CORO_MT_SPIN_COUNT) {
+			coro_cpu_relax();
+			continue;
+		}
+		spin_count = 0;
+		/*
+		 * Become idle and check everything again. Whoever adds
+		 * work after this point, will see the idle thread and
+		 * bump the sequence.
+		 */
+		uint32_t seq = __atomic_load_n(&mt->work_seq, __ATOMIC_SEQ_CST);
+		__atomic_add_fetch(&mt->idle_count, 1, __ATOMIC_SEQ_CST);
+		__atomic_thread_fence(__ATOMIC_SEQ_CST);
+		is_contended = false;
+		if (__atomic_load_n(&engine->remote_head,
+				    __ATOMIC_RELAXED) == NULL &&
+		    !coro_mt_is_done(mt) &&
+		    !coro_engine_steal(engine, &is_contended) &&
+		    !is_contended) {
+			uint64_t deadline =
+				coro_timer_wheel_next(&engine->timers);
+			/* The idle stacks are given back while sleeping too. */
+			uint64_t trim_deadline = coro_engine_pool_maintain(engine);
+			if (trim_deadline < deadline)
+				deadline = trim_deadline;
+			/* The ring can't wake the thread, check it soon. */
+			if (coro_engine_uring_inflight(engine) != 0) {
+				uint64_t soon = coro_clock_tick() + 1;
+				if (soon < deadline)
+					deadline = soon;
+			}
+			/*
+			 * One of the idle threads waits for the fds, the
+			 * others - for the futex.
+			 */
+			if (__atomic_load_n(&engine->io->wait_count,
+					    __ATOMIC_RELAXED) == 0 ||
+			    !coro_engine_poll(engine, deadline, &seq))
+				coro_futex_wait(&mt->work_seq, seq, deadline);
+		}
+		__atomic_sub_fetch(&mt->idle_count, 1, __ATOMIC_SEQ_CST);
+	}
+	--this_thread_run_depth;
+}
+
+static void
+coro_engine_destroy(struct coro_engine *engine)
+{
+	assert(engine->this == NULL);
+	assert(rlist_empty(&engine->coros_running_now));
+	assert(!coro_engine_has_next(engine));
+	assert(engine->remote_head == NULL);
+	assert(engine->pool_remote_head == NULL);
+	assert(engine->timers.count == 0);
+	free(engine->trace);
+	coro_reactor_destroy(&engine->reactor);
+#if LIBCORO_IO == LIBCORO_IO_URING
+	coro_uring_destroy(&engine->uring);
+#endif
+	engine->pool_max = 0;
+	coro_engine_pool_shrink(engine);
+	assert(engine->pool_count == 0);
+	assert(engine->coro_count == 0);
+	assert(rlist_empty(&engine->coros_all));
+	memset(engine, '#', sizeof(*engine));
+}
+
+/**
+ * Move all the coroutines of a stopped engine into another one.
+ * The source engine becomes empty.
+ */
+static void
+coro_engine_merge(struct coro_engine *dst, struct coro_engine *src)
+{
+	assert(src->this == NULL);
+	assert(rlist_empty(&src->coros_running_now));
+	assert(!coro_engine_has_next(src));
+	assert(src->remote_head == NULL);
+	coro_engine_pool_drain_remote(src);
+	for (int i = 0; i < CORO_STACK_CLASS_COUNT; ++i) {
+		rlist_splice_tail(&dst->coros_pool[i], &src->coros_pool[i]);
+		dst->pool_size[i] += src->pool_size[i];
+		dst->pool_min[i] += src->pool_size[i];
+		src->pool_size[i] = 0;
+		src->pool_min[i] = 0;
+	}
+	dst->pool_count += src->pool_count;
+	src->pool_count = 0;
+	dst->pool_trim_count += src->pool_trim_count;
+	dst->pool_free_count += src->pool_free_count;
+	rlist_splice_tail(&dst->coros_all, &src->coros_all);
+	dst->coro_count += src->coro_count;
+	src->coro_count = 0;
+	dst->stats.loop_count += src->stats.loop_count;
+	dst->stats.switch_count += src->stats.switch_count;
+	dst->stats.wakeup_count += src->stats.wakeup_count;
+	dst->stats.pool_hit_count += src->stats.pool_hit_count;
+	dst->stats.pool_miss_count += src->stats.pool_miss_count;
+	if (dst->trace != NULL && src->trace != NULL) {
+		size_t count = dst->trace_capacity - dst->trace_size;
+		if (count > src->trace_size)
+			count = src->trace_size;
+		memcpy(&dst->trace[dst->trace_size], src->trace,
+			count * sizeof(src->trace[0]));
+		dst->trace_size += count;
+	}
+}
+
+static __thread struct coro_engine *new_coro_engine = NULL;
+
+/**
+ * The core part of the coroutines creation - this function runs
+ * on the new coroutine's stack. At invocation it remembers its
+ * current context and jumps back to the coroutine constructor.
+ * Later the coroutine continues from here.
+ */
+static void
+coro_body(void)
+{
+	struct coro_engine *my_engine = new_coro_engine;
+	new_coro_engine = NULL;
+
+	struct coro *c = my_engine->this;
+	my_engine->this = NULL;
+	/*
+	 * On invocation jump back to the constructor right after
+	 * remembering the context.
+	 */
+	coro_ctx_switch(&c->ctx, &my_engine->start_point);
+	/*
+	 * If the execution is here, then the coroutine should
+	 * finally start work. Possibly in another thread.
+	 */
+	my_engine = coro_engine_finish_switch();
+	my_engine->this = c;
+	/*
+	 * The frame stays here while the coroutine is pooled. Below it
+	 * are only the switch frames, unless the trim knows better.
+	 */
+	coro_stack_set_idle_end(&c->stack, (char *)__builtin_frame_address(0) -
+				CORO_STACK_TRIM_MARGIN);
+	while (true) {
+		c->ret = c->func(c->func_arg);
+		my_engine = coro_engine_current();
+		c->func = NULL;
+		assert(c->state == CORO_STATE_RUNNING);
+		coro_state_set(c, CORO_STATE_FINISHED);
+		struct coro *joiner = __atomic_load_n(&c->joiner,
+			__ATOMIC_SEQ_CST);
+		if (joiner != NULL)
+			coro_engine_wakeup(my_engine, joiner);
+		if (c->group != NULL) {
+			coro_engine_group_child_done(my_engine, c->group, c);
+			c->group = NULL;
+		}
+		if (__atomic_fetch_or(&c->release_mask, CORO_RELEASE_FINISHED,
+				      __ATOMIC_SEQ_CST) == CORO_RELEASE_DETACHED)
+			my_engine->is_prev_released = true;
+		coro_mt_running_dec(my_engine->mt);
+		my_engine = coro_engine_resume_next(my_engine);
+		/*
+		 * Here it is restarted already, must have its
+		 * state restored.
+		 */
+		assert(c->state == CORO_STATE_RUNNING);
+		assert(c->func != NULL);
+	}
+}
+
+#if LIBCORO_CTX == LIBCORO_CTX_SIGNAL
+
+/**
+ * Signal handler which runs on a separate stack using
+ * sigaltstack. Starts the coroutine body right on this stack.
+ */
+static void
+coro_body_sig(int signum)
+{
+	(void)signum;
+	coro_body();
+}
+
+/**
+ * The signal handler is process-wide, so the threads can't create
+ * coroutines via the signal concurrently.
+ */
+static pthread_mutex_t coro_body_sig_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+/**
+ * Make the coroutine enter coro_body() on its own stack via a
+ * signal delivered on sigaltstack. This costs a dozen syscalls,
+ * but doesn't need anything except for the basic POSIX.
+ */
+static void
+coro_engine_start_body(struct coro_engine *engine, struct coro *c)
+{
+	pthread_mutex_lock(&coro_body_sig_mutex);
+	/*
+	 * SIGUSR2 is used. First of all, block new signals to be
+	 * able to set a new handler.
+	 */
+	sigset_t news, olds, suss;
+	sigemptyset(&news);
+	sigaddset(&news, SIGUSR2);
+	if (sigprocmask(SIG_BLOCK, &news, &olds) != 0)
+		handle_error();
+	/*
+	 * New handler should jump onto a new stack and remember
+	 * that position. Afterwards the stack is disabled and
+	 * becomes dedicated to that single coroutine.
+	 */
+	struct sigaction newsa, oldsa;
+	newsa.sa_handler = coro_body_sig;
+	newsa.sa_flags = SA_ONSTACK;
+	sigemptyset(&newsa.sa_mask);
+	if (sigaction(SIGUSR2, &newsa, &oldsa) != 0)
+		handle_error();
+	/* Create that new stack. */
+	stack_t oldst, newst;
+	newst.ss_sp = c->stack.base;
+	newst.ss_size = c->stack.size;
+	newst.ss_flags = 0;
+	if (sigaltstack(&newst, &oldst) != 0)
+		handle_error();
+
+	/* Jump onto the stack and remember its position. */
+	sigemptyset(&suss);
+	if (sigsetjmp(engine->start_point.buf, 1) == 0) {
+		raise(SIGUSR2);
+		while (engine->this != NULL)
+			sigsuspend(&suss);
+	}
+
+	/*
+	 * Return the old stack, unblock SIGUSR2. In other words,
+	 * rollback all global changes. The newly created stack
+	 * now is remembered only by the new coroutine, and can be
+	 * used by it only.
+	 */
+	if (sigaltstack(NULL, &newst) != 0)
+		handle_error();
+	newst.ss_flags = SS_DISABLE;
+	if (sigaltstack(&newst, NULL) != 0)
+		handle_error();
+	if ((oldst.ss_flags & SS_DISABLE) == 0 &&
+	    sigaltstack(&oldst, NULL) != 0)
+		handle_error();
+	if (sigaction(SIGUSR2, &oldsa, NULL) != 0)
+		handle_error();
+	if (sigprocmask(SIG_SETMASK, &olds, NULL) != 0)
+		handle_error();
+	pthread_mutex_unlock(&coro_body_sig_mutex);
+}
+
+#else /* LIBCORO_CTX != LIBCORO_CTX_SIGNAL */
+
+/**
+ * Make the coroutine enter coro_body() on its own stack by simply
+ * switching to a freshly made context. No syscalls.
+ */
+static void
+coro_engine_start_body(struct coro_engine *engine, struct coro *c)
+{
+	coro_ctx_make(&c->ctx, c->stack.base, c->stack.size, coro_body);
+	coro_ctx_switch(&engine->start_point, &c->ctx);
+}
+
+#endif /* LIBCORO_CTX != LIBCORO_CTX_SIGNAL */
+
+/** Start the stats of a new coroutine, or of a reused one. */
+static void
+coro_engine_stats_reset(struct coro_engine *engine, struct coro *c)
+{
+	memset(&c->stats, 0, sizeof(c->stats));
+	c->runnable_since = 0;
+	c->slice_start = 0;
+	c->id = 0;
+	if (engine->is_stats_enabled)
+		c->id = coro_id_new();
+}
+
+/**
+ * Tie a new coroutine to its creator: it gets a copy of the
+ * creator's locals, and joins the @a group, if any. A child of a
+ * cancelled group starts cancelled.
+ */
+static void
+coro_engine_spawn_bind(struct coro_engine *engine, struct coro *c,
+	struct coro_group *group)
+{
+	struct coro *creator = engine->this;
+	if (creator != NULL && creator != &engine->sched)
+		memcpy(c->locals, creator->locals, sizeof(c->locals));
+	else
+		memset(c->locals, 0, sizeof(c->locals));
+	c->is_cancelled = false;
+	c->group = group;
+	c->release_mask = 0;
+	if (group == NULL)
+		return;
+	c->release_mask = CORO_RELEASE_DETACHED;
+	coro_group_lock(group);
+	rlist_add_tail_entry(&group->children, c, group_link);
+	c->is_cancelled = group->is_cancelled;
+	coro_group_unlock(group);
+}
+
+static struct coro *
+coro_engine_spawn_new(struct coro_engine *engine, coro_f func, void *func_arg,
+	size_t stack_size, struct coro_group *group)
+{
+	struct coro *c = malloc(sizeof(*c));
+	c->state = CORO_STATE_RUNNING;
+	c->on_cpu = false;
+	c->wakeup_pending = false;
+	c->ret = NULL;
+	coro_stack_create(&c->stack, stack_size);
+	c->func = func;
+	c->func_arg = func_arg;
+	c->joiner = NULL;
+	c->owner = engine;
+	c->home = engine;
+	c->remote_next = NULL;
+	rlist_create(&c->timer.link);
+	c->is_timed_out = false;
+	c->priority = CORO_PRIO_NORMAL;
+	rlist_create(&c->link);
+
+	/* Jump onto the stack and remember its position. */
+	assert(new_coro_engine == NULL);
+	new_coro_engine = engine;
+	struct coro *old_this = engine->this;
+	engine->this = c;
+	coro_engine_start_body(engine, c);
+	assert(new_coro_engine == NULL);
+	assert(engine->this == NULL);
+	engine->this = old_this;
+
+	/* Now scheduler can work with that coroutine. */
+	++engine->coro_count;
+	++engine->stats.pool_miss_count;
+	coro_engine_stats_reset(engine, c);
+	rlist_add_tail_entry(&engine->coros_all, c, engine_link);
+	coro_engine_spawn_bind(engine, c, group);
+	coro_mt_running_inc(engine->mt);
+	coro_engine_push_next(engine, c, false);
+	return c;
+}
+
+/**
+ * Create a coroutine. A child of a @a group is detached from the
+ * start.
+ */
+static struct coro *
+coro_engine_spawn(struct coro_engine *engine, coro_f func, void *func_arg,
+	size_t stack_size, struct coro_group *group)
+{
+	if (stack_size == 0)
+		stack_size = engine->stack_size;
+	else
+		stack_size = coro_stack_size_normalize(stack_size);
+	struct coro *c = coro_engine_pool_take(engine, stack_size);
+	if (c == NULL)
+		return coro_engine_spawn_new(engine, func, func_arg,
+			stack_size, group);
+	c->func = func;
+	c->func_arg = func_arg;
+	c->owner = engine;
+	c->wakeup_pending = false;
+	c->priority = CORO_PRIO_NORMAL;
+	++engine->stats.pool_hit_count;
+	coro_engine_stats_reset(engine, c);
+	coro_engine_spawn_bind(engine, c, group);
+	coro_state_set(c, CORO_STATE_RUNNING);
+	coro_mt_running_inc(engine->mt);
+	coro_engine_push_next(engine, c, false);
+	return c;
 }
 
 static void *
 coro_engine_join(struct coro_engine *engine, struct coro *coro)
 {
+	struct coro *this = engine->this;
 	assert(coro->joiner == NULL);
-	coro->joiner = engine->this;
-	while (coro->state == CORO_STATE_RUNNING ||
-		coro->state == CORO_STATE_SUSPENDED)
-		coro_engine_suspend(engine);
-	assert(coro->state == CORO_STATE_FINISHED);
-	assert(coro->joiner == engine->this);
+	assert((coro->release_mask & CORO_RELEASE_DETACHED) == 0);
+	__atomic_store_n(&coro->joiner, this, __ATOMIC_SEQ_CST);
+	while (coro_state_get(coro) != CORO_STATE_FINISHED) {
+		if (this == NULL) {
+			printf("Error: deadlock - suspension with no active "
+				"coroutines\n");
+			exit(-1);
+		}
+		/*
+		 * Announce the suspension before the final check. Then
+		 * if the coroutine finishes in another thread right
+		 * after the check, the wakeup is not lost.
+		 */
+		coro_state_set(this, CORO_STATE_SUSPENDED);
+		if (coro_state_get(coro) == CORO_STATE_FINISHED &&
+		    coro_state_cas(this, CORO_STATE_SUSPENDED,
+				   CORO_STATE_RUNNING))
+			break;
+		engine = coro_engine_park(engine);
+	}
+	/* It might be still saving its context in another thread. */
+	while (__atomic_load_n(&coro->on_cpu, __ATOMIC_ACQUIRE))
+		coro_cpu_relax();
+	assert(coro->joiner == this);
 	coro->joiner = NULL;
 	void *ret = coro->ret;
 	coro->ret = NULL;
-	assert(rlist_empty(&coro->link));
-	rlist_add_entry(&engine->coros_pool, coro, link);
+	coro_engine_recycle(engine, coro);
 	return ret;
 }
 
-//////////////////////////////////////////////////////////////////
+static void
+coro_engine_detach(struct coro_engine *engine, struct coro *coro)
+{
+	assert(coro->joiner == NULL);
+	if (__atomic_fetch_or(&coro->release_mask, CORO_RELEASE_DETACHED,
+			      __ATOMIC_SEQ_CST) != CORO_RELEASE_FINISHED)
+		return;
+	/* Finished already, so recycle it the same as a join does. */
+	while (__atomic_load_n(&coro->on_cpu, __ATOMIC_ACQUIRE))
+		coro_cpu_relax();
+	coro->ret = NULL;
+	coro_engine_recycle(engine, coro);
+}
 
-static struct coro_engine glob_engine;
+/**
+ * Wait for all the children of the group. Each finished child
+ * decrements the counter, and the last one wakes the waiter up,
+ * so it is suspended only once.
+ */
+static void
+coro_engine_group_join(struct coro_engine *engine, struct coro_group *group)
+{
+	struct coro *this = engine->this;
+	assert(group->waiter == NULL);
+	coro_group_lock(group);
+	group->waiter = this;
+	coro_group_unlock(group);
+	while (coro_group_count(group) != 0) {
+		if (this == NULL) {
+			printf("Error: deadlock - suspension with no active "
+				"coroutines\n");
+			exit(-1);
+		}
+		/* The children of a cancelled coroutine are cancelled too. */
+		if (coro_state_is_cancelled(this) && !group->is_cancelled)
+			coro_engine_group_cancel(engine, group);
+		/* The same protocol as in coro_engine_join(). */
+		coro_state_set(this, CORO_STATE_SUSPENDED);
+		if (coro_group_count(group) == 0 &&
+		    coro_state_cas(this, CORO_STATE_SUSPENDED,
+				   CORO_STATE_RUNNING))
+			break;
+		engine = coro_engine_park(engine);
+	}
+}
+
+static void
+coro_engine_stack_stats(struct coro_engine *engine,
+	struct coro_stack_stats *stats)
+{
+	memset(stats, 0, sizeof(*stats));
+	unsigned char *vec = NULL;
+	size_t vec_size = 0;
+	struct coro *c;
+	rlist_foreach_entry(c, &engine->coros_all, engine_link) {
+		size_t page_count = c->stack.size / coro_page_size();
+		if (page_count > vec_size) {
+			vec_size = page_count;
+			vec = realloc(vec, vec_size);
+		}
+		size_t resident = coro_stack_resident_size(&c->stack, vec);
+		++stats->count;
+		stats->virtual_size += c->stack.size;
+		stats->resident_size += resident;
+		if (resident > stats->max_resident_size)
+			stats->max_resident_size = resident;
+	}
+	free(vec);
+}
+
+static void
+coro_engine_pool_stats(struct coro_engine *engine,
+	struct coro_pool_stats *stats)
+{
+	memset(stats, 0, sizeof(*stats));
+	stats->count = engine->pool_count;
+	stats->max = engine->pool_max;
+	stats->trim_count = engine->pool_trim_count;
+	stats->free_count = engine->pool_free_count;
+	for (int i = 0; i < CORO_STACK_CLASS_COUNT; ++i) {
+		struct coro *c;
+		rlist_foreach_entry(c, &engine->coros_pool[i], link) {
+			stats->virtual_size += c->stack.size;
+			if (c->stack.is_trimmed)
+				++stats->trimmed_count;
+		}
+	}
+}
+
+static void
+coro_engine_trace_start(struct coro_engine *engine, size_t max_events)
+{
+	free(engine->trace);
+	engine->trace = malloc(max_events * sizeof(engine->trace[0]));
+	engine->trace_size = 0;
+	engine->trace_capacity = max_events;
+	engine->trace_start_ns = coro_clock_ns();
+	engine->is_stats_enabled = true;
+}
+
+static int
+coro_engine_trace_stop(struct coro_engine *engine, const char *path)
+{
+	struct coro_trace_event *trace = engine->trace;
+	size_t size = engine->trace_size;
+	engine->trace = NULL;
+	engine->trace_size = 0;
+	engine->trace_capacity = 0;
+	FILE *f = fopen(path, "w");
+	if (f == NULL) {
+		free(trace);
+		return -1;
+	}
+	fprintf(f, "{\"traceEvents\":[");
+	for (size_t i = 0; i < size; ++i) {
+		const struct coro_trace_event *e = &trace[i];
+		/* The format wants microseconds. */
+		fprintf(f, "%s\n{\"name\":\"coro %" PRIu64 "\",\"ph\":\"X\","
+			"\"pid\":1,\"tid\":%d,\"ts\":%.3f,\"dur\":%.3f}",
+			i == 0 ? "" : ",", e->coro_id, e->engine_id,
+			(e->start_ns - engine->trace_start_ns) / 1000.0,
+			e->duration_ns / 1000.0);
+	}
+	fprintf(f, "\n],\"displayTimeUnit\":\"ns\"}\n");
+	free(trace);
+	int rc = ferror(f) ? -1 : 0;
+	if (fclose(f) != 0)
+		rc = -1;
+	return rc;
+}
+
+static void *
+coro_mt_worker_f(void *arg)
+{
+	struct coro_engine *engine = arg;
+	this_engine = engine;
+	coro_engine_run_mt(engine);
+	this_engine = NULL;
+	return NULL;
+}
+
+/**
+ * Run the engine together with thread_count - 1 helper engines in
+ * new threads. When all is done, the coroutines are moved back
+ * into the main engine.
+ */
+static void
+coro_engine_run_threads(struct coro_engine *engine, int thread_count)
+{
+	assert(engine->mt == NULL);
+	struct coro_mt mt;
+	memset(&mt, 0, sizeof(mt));
+	mt.engine_count = thread_count;
+	mt.engines = calloc(thread_count, sizeof(mt.engines[0]));
+	mt.engines[0] = engine;
+	engine->id = 0;
+	for (int i = 1; i < thread_count; ++i) {
+		struct coro_engine *e = malloc(sizeof(*e));
+		coro_engine_create(e);
+		e->id = i;
+		e->stack_size = engine->stack_size;
+		e->pool_max = engine->pool_max;
+		e->io = engine->io;
+		e->is_stats_enabled = engine->is_stats_enabled;
+		if (engine->trace != NULL) {
+			e->trace_capacity = engine->trace_capacity;
+			e->trace = malloc(e->trace_capacity * sizeof(e->trace[0]));
+			e->trace_start_ns = engine->trace_start_ns;
+		}
+		mt.engines[i] = e;
+	}
+	struct coro *c;
+	for (int i = 0; i < CORO_PRIO_COUNT; ++i) {
+		rlist_foreach_entry(c, &engine->coros_running_next[i], link)
+			++mt.running_count;
+	}
+	rlist_foreach_entry(c, &engine->coros_running_urgent, link)
+		++mt.running_count;
+	mt.wait_count = engine->timers.count + engine->io->wait_count +
+		coro_engine_uring_inflight(engine);
+	mt.reactor = engine->io;
+	engine->io->is_shared = true;
+	for (int i = 0; i < thread_count; ++i)
+		mt.engines[i]->mt = &mt;
+
+	pthread_t *threads = calloc(thread_count, sizeof(threads[0]));
+	for (int i = 1; i < thread_count; ++i) {
+		if (pthread_create(&threads[i], NULL, coro_mt_worker_f,
+				   mt.engines[i]) != 0)
+			handle_error();
+	}
+	struct coro_engine *old_engine = this_engine;
+	this_engine = engine;
+	coro_engine_run_mt(engine);
+	this_engine = old_engine;
+	for (int i = 1; i < thread_count; ++i)
+		pthread_join(threads[i], NULL);
+	free(threads);
+	engine->mt = NULL;
+	engine->io->is_shared = false;
+
+	for (int i = 1; i < thread_count; ++i) {
+		struct coro_engine *e = mt.engines[i];
+		e->mt = NULL;
+		coro_engine_merge(engine, e);
+		coro_engine_destroy(e);
+		free(e);
+	}
+	rlist_foreach_entry(c, &engine->coros_all, engine_link) {
+		c->owner = engine;
+		c->home = engine;
+	}
+	coro_engine_pool_drain_remote(engine);
+	/* The pools of the stopped threads are merged into this one. */
+	coro_engine_pool_shrink(engine);
+	free(mt.engines);
+}
+
+//////////////////////////////////////////////////////////////////
 
 void
 coro_sched_init(void)
@@ -360,7 +3324,58 @@ coro_sched_init(void)
 void
 coro_sched_run(void)
 {
-	coro_engine_run(&glob_engine);
+	coro_engine_run(coro_engine_current());
+}
+
+void
+coro_sched_run_threads(int thread_count)
+{
+	struct coro_engine *engine = coro_engine_current();
+	if (thread_count <= 1)
+		coro_engine_run(engine);
+	else
+		coro_engine_run_threads(engine, thread_count);
+}
+
+struct coro_engine *
+coro_engine_new(void)
+{
+	struct coro_engine *engine = malloc(sizeof(*engine));
+	coro_engine_create(engine);
+	return engine;
+}
+
+void
+coro_engine_delete(struct coro_engine *engine)
+{
+	assert(engine != &glob_engine);
+	assert(this_engine != engine);
+	coro_engine_destroy(engine);
+	free(engine);
+}
+
+void
+coro_engine_set_current(struct coro_engine *engine)
+{
+	struct coro_engine *old = coro_engine_current();
+	assert(old->this == NULL);
+	(void)old;
+	this_engine = engine;
+}
+
+struct coro_engine *
+coro_engine_get_current(void)
+{
+	return coro_engine_current();
+}
+
+void
+coro_sched_run_engine(struct coro_engine *engine)
+{
+	struct coro_engine *old = this_engine;
+	this_engine = engine;
+	coro_engine_run(engine);
+	this_engine = old;
 }
 
 void
@@ -369,38 +3384,387 @@ coro_sched_destroy(void)
 	coro_engine_destroy(&glob_engine);
 }
 
+void
+coro_sched_set_stats(bool is_enabled)
+{
+	coro_engine_current()->is_stats_enabled = is_enabled;
+}
+
+void
+coro_sched_stats(struct coro_sched_stats *stats)
+{
+	*stats = coro_engine_current()->stats;
+}
+
+void
+coro_stats(const struct coro *coro, struct coro_stats *stats)
+{
+	*stats = coro->stats;
+}
+
+void
+coro_sched_trace_start(size_t max_events)
+{
+	coro_engine_trace_start(coro_engine_current(), max_events);
+}
+
+int
+coro_sched_trace_stop(const char *path)
+{
+	return coro_engine_trace_stop(coro_engine_current(), path);
+}
+
 struct coro *
 coro_this(void)
 {
-	return glob_engine.this;
+	if (this_thread_run_depth == 0)
+		return NULL;
+	return coro_engine_current()->this;
+}
+
+void
+coro_sched_set_stack_size(size_t size)
+{
+	coro_engine_current()->stack_size = coro_stack_size_normalize(size);
+}
+
+void
+coro_sched_stack_stats(struct coro_stack_stats *stats)
+{
+	coro_engine_stack_stats(coro_engine_current(), stats);
+}
+
+void
+coro_sched_set_pool_max(size_t max)
+{
+	struct coro_engine *engine = coro_engine_current();
+	engine->pool_max = max;
+	coro_engine_pool_shrink(engine);
+}
+
+void
+coro_sched_pool_trim(void)
+{
+	coro_engine_pool_trim(coro_engine_current(), true);
+}
+
+void
+coro_sched_pool_stats(struct coro_pool_stats *stats)
+{
+	coro_engine_pool_stats(coro_engine_current(), stats);
 }
 
 struct coro *
 coro_new(coro_f func, void *func_arg)
 {
-	return coro_engine_spawn(&glob_engine, func, func_arg);
+	return coro_engine_spawn(coro_engine_current(), func, func_arg, 0,
+		NULL);
+}
+
+struct coro *
+coro_new_with_stack(coro_f func, void *func_arg, size_t stack_size)
+{
+	return coro_engine_spawn(coro_engine_current(), func, func_arg,
+		stack_size, NULL);
 }
 
 void *
 coro_join(struct coro *coro)
 {
-	return coro_engine_join(&glob_engine, coro);
+	return coro_engine_join(coro_engine_current(), coro);
+}
+
+void
+coro_detach(struct coro *coro)
+{
+	coro_engine_detach(coro_engine_current(), coro);
+}
+
+struct coro_group *
+coro_group_new(void)
+{
+	struct coro_group *group = malloc(sizeof(*group));
+	group->count = 0;
+	group->waiter = NULL;
+	rlist_create(&group->children);
+	group->is_cancelled = false;
+	group->lock = false;
+	return group;
+}
+
+void
+coro_group_cancel(struct coro_group *group)
+{
+	coro_engine_group_cancel(coro_engine_current(), group);
+}
+
+struct coro *
+coro_group_spawn(struct coro_group *group, coro_f func, void *func_arg)
+{
+	__atomic_add_fetch(&group->count, 1, __ATOMIC_RELAXED);
+	return coro_engine_spawn(coro_engine_current(), func, func_arg, 0,
+		group);
 }
 
 void
+coro_group_join(struct coro_group *group)
+{
+	coro_engine_group_join(coro_engine_current(), group);
+	free(group);
+}
+
+bool
 coro_suspend(void)
 {
-	coro_engine_suspend(&glob_engine);
+	return coro_engine_suspend_cancellable(coro_engine_current());
 }
 
 void
 coro_yield(void)
 {
-	coro_engine_yield(&glob_engine);
+	coro_engine_yield(coro_engine_current());
+}
+
+void
+coro_sleep(double sec)
+{
+	coro_engine_sleep(coro_engine_current(), sec);
+}
+
+bool
+coro_suspend_timeout(double sec)
+{
+	return coro_engine_suspend_timeout(coro_engine_current(), sec);
 }
 
 void
 coro_wakeup(struct coro *coro)
 {
-	coro_engine_wakeup(&glob_engine, coro);
+	coro_engine_wakeup(coro_engine_current(), coro);
+}
+
+void
+coro_cancel(struct coro *coro)
+{
+	coro_engine_cancel(coro_engine_current(), coro);
+}
+
+bool
+coro_is_cancelled(void)
+{
+	struct coro *this = coro_engine_current()->this;
+	return this != NULL && coro_state_is_cancelled(this);
+}
+
+int
+coro_local_key_new(void)
+{
+	int key = __atomic_fetch_add(&coro_local_key_last, 1,
+		__ATOMIC_RELAXED);
+	if (key >= CORO_LOCAL_COUNT) {
+		errno = ENOSPC;
+		return -1;
+	}
+	return key;
+}
+
+void
+coro_local_set(int key, void *value)
+{
+	assert(key >= 0 && key < CORO_LOCAL_COUNT);
+	struct coro *this = coro_engine_current()->this;
+	assert(this != NULL);
+	this->locals[key] = value;
+}
+
+void *
+coro_local_get(int key)
+{
+	assert(key >= 0 && key < CORO_LOCAL_COUNT);
+	struct coro *this = coro_engine_current()->this;
+	return this != NULL ? this->locals[key] : NULL;
+}
+
+void
+coro_set_priority(struct coro *coro, enum coro_priority prio)
+{
+	assert(prio >= 0 && prio < CORO_PRIO_COUNT);
+	coro->priority = prio;
+}
+
+int
+coro_wait_fd(int fd, int events)
+{
+	events &= CORO_FD_READ | CORO_FD_WRITE;
+	if (events == 0) {
+		errno = EINVAL;
+		return -1;
+	}
+#if LIBCORO_IO == LIBCORO_IO_URING
+	struct coro_engine *engine = coro_engine_current();
+	if (coro_engine_uses_uring(engine)) {
+		uint32_t mask = 0;
+		if ((events & CORO_FD_READ) != 0)
+			mask |= POLLIN;
+		if ((events & CORO_FD_WRITE) != 0)
+			mask |= POLLOUT;
+		int rc = coro_engine_uring_io(engine, IORING_OP_POLL_ADD, fd,
+			NULL, 0, 0, mask);
+		return rc < 0 ? coro_uring_result(rc) : 0;
+	}
+#endif
+	if (coro_engine_wait_fd(coro_engine_current(), fd, events,
+				NULL) == NULL)
+		return -1;
+	return 0;
+}
+
+/**
+ * Check if an operation on the fd is worth trying right away, and
+ * remember the fd's edge counter for coro_io_wait().
+ */
+static bool
+coro_io_is_ready(int fd, uint32_t events, uint32_t *seq)
+{
+	return (coro_engine_fd_ready(coro_engine_current(), fd, seq) &
+		events) != 0;
+}
+
+static bool
+coro_io_is_eagain(void)
+{
+	return errno == EAGAIN || errno == EWOULDBLOCK;
+}
+
+static int
+coro_io_wait(int fd, uint32_t events, uint32_t seq)
+{
+	if (coro_engine_wait_fd(coro_engine_current(), fd, events,
+				&seq) == NULL)
+		return -1;
+	return 0;
+}
+
+ssize_t
+coro_read(int fd, void *buf, size_t size)
+{
+#if LIBCORO_IO == LIBCORO_IO_URING
+	struct coro_engine *engine = coro_engine_current();
+	if (coro_engine_uses_uring(engine))
+		return coro_uring_result(coro_engine_uring_io(engine,
+			IORING_OP_READ, fd, buf, size, -1, 0));
+#endif
+	uint32_t seq;
+	while (true) {
+		if (coro_io_is_ready(fd, CORO_FD_READ, &seq)) {
+			ssize_t rc = read(fd, buf, size);
+			if (rc >= 0 || !coro_io_is_eagain())
+				return rc;
+		}
+		if (coro_io_wait(fd, CORO_FD_READ, seq) != 0)
+			return -1;
+	}
+}
+
+ssize_t
+coro_write(int fd, const void *buf, size_t size)
+{
+#if LIBCORO_IO == LIBCORO_IO_URING
+	struct coro_engine *engine = coro_engine_current();
+	if (coro_engine_uses_uring(engine))
+		return coro_uring_result(coro_engine_uring_io(engine,
+			IORING_OP_WRITE, fd, buf, size, -1, 0));
+#endif
+	uint32_t seq;
+	while (true) {
+		if (coro_io_is_ready(fd, CORO_FD_WRITE, &seq)) {
+			ssize_t rc = write(fd, buf, size);
+			if (rc >= 0 || !coro_io_is_eagain())
+				return rc;
+		}
+		if (coro_io_wait(fd, CORO_FD_WRITE, seq) != 0)
+			return -1;
+	}
+}
+
+ssize_t
+coro_recv(int fd, void *buf, size_t size, int flags)
+{
+#if LIBCORO_IO == LIBCORO_IO_URING
+	struct coro_engine *engine = coro_engine_current();
+	if (coro_engine_uses_uring(engine))
+		return coro_uring_result(coro_engine_uring_io(engine,
+			IORING_OP_RECV, fd, buf, size, 0, flags));
+#endif
+	uint32_t seq;
+	while (true) {
+		if (coro_io_is_ready(fd, CORO_FD_READ, &seq)) {
+			ssize_t rc = recv(fd, buf, size, flags);
+			if (rc >= 0 || !coro_io_is_eagain())
+				return rc;
+		}
+		if (coro_io_wait(fd, CORO_FD_READ, seq) != 0)
+			return -1;
+	}
+}
+
+ssize_t
+coro_send(int fd, const void *buf, size_t size, int flags)
+{
+#if LIBCORO_IO == LIBCORO_IO_URING
+	struct coro_engine *engine = coro_engine_current();
+	if (coro_engine_uses_uring(engine))
+		return coro_uring_result(coro_engine_uring_io(engine,
+			IORING_OP_SEND, fd, buf, size, 0, flags));
+#endif
+	uint32_t seq;
+	while (true) {
+		if (coro_io_is_ready(fd, CORO_FD_WRITE, &seq)) {
+			ssize_t rc = send(fd, buf, size, flags);
+			if (rc >= 0 || !coro_io_is_eagain())
+				return rc;
+		}
+		if (coro_io_wait(fd, CORO_FD_WRITE, seq) != 0)
+			return -1;
+	}
+}
+
+int
+coro_accept(int fd, struct sockaddr *addr, socklen_t *addrlen)
+{
+#if LIBCORO_IO == LIBCORO_IO_URING
+	struct coro_engine *engine = coro_engine_current();
+	if (coro_engine_uses_uring(engine))
+		return coro_uring_result(coro_engine_uring_io(engine,
+			IORING_OP_ACCEPT, fd, addr, 0, (uintptr_t)addrlen,
+			SOCK_NONBLOCK | SOCK_CLOEXEC));
+#endif
+	uint32_t seq;
+	while (true) {
+		if (coro_io_is_ready(fd, CORO_FD_READ, &seq)) {
+			int rc = accept4(fd, addr, addrlen,
+				SOCK_NONBLOCK | SOCK_CLOEXEC);
+			if (rc >= 0 || !coro_io_is_eagain())
+				return rc;
+		}
+		if (coro_io_wait(fd, CORO_FD_READ, seq) != 0)
+			return -1;
+	}
+}
+
+int
+coro_close(int fd)
+{
+	struct coro_engine *engine = coro_engine_current();
+#if LIBCORO_IO == LIBCORO_IO_URING
+	/*
+	 * The close doesn't end the operations in the ring, they
+	 * keep the file referenced.
+	 */
+	if (engine->uring.inflight != 0 && engine->this != NULL)
+		coro_engine_uring_io(engine, IORING_OP_ASYNC_CANCEL, fd, NULL,
+			0, 0, IORING_ASYNC_CANCEL_FD | IORING_ASYNC_CANCEL_ALL);
+#endif
+	coro_engine_forget_fd(engine, fd);
+	return close(fd);
 }
@@ -1,8 +1,58 @@
 #pragma once
 
 #include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+
+/**
+ * Context switch backends. The one to use is selected at build
+ * time via -DLIBCORO_CTX=<backend>. By default the fastest one
+ * available on the platform is taken.
+ *
+ * - SIGNAL - sigaltstack + SIGUSR2 to create a coroutine,
+ *   sigsetjmp/siglongjmp to switch. Portable, but creation costs
+ *   a dozen syscalls.
+ * - UCONTEXT - makecontext/swapcontext. Portable, no syscalls on
+ *   creation, but glibc still saves the signal mask on each
+ *   switch.
+ * - ASM - hand-written switch of the callee-saved registers. No
+ *   syscalls at all. Only for x86-64 and aarch64. Is the default
+ *   only on x86-64, the aarch64 one has to be asked for.
+ */
+#define LIBCORO_CTX_SIGNAL 0
+#define LIBCORO_CTX_UCONTEXT 1
+#define LIBCORO_CTX_ASM 2
+
+#ifndef LIBCORO_CTX
+#if defined(__x86_64__)
+#define LIBCORO_CTX LIBCORO_CTX_ASM
+#else
+#define LIBCORO_CTX LIBCORO_CTX_UCONTEXT
+#endif
+#endif
+
+/**
+ * I/O backends, selected via -DLIBCORO_IO=<backend>.
+ *
+ * - EPOLL - edge-triggered epoll. Each operation is a syscall,
+ *   and EAGAIN costs epoll_wait() and a retry.
+ * - URING - io_uring via the raw syscalls. The operations of one
+ *   scheduler loop iteration are submitted by one syscall and
+ *   complete without the readiness round-trip. Is used by the
+ *   engines working alone. Falls back to EPOLL when the kernel
+ *   doesn't support it, and in the multi-thread mode.
+ */
+#define LIBCORO_IO_EPOLL 0
+#define LIBCORO_IO_URING 1
+
+#ifndef LIBCORO_IO
+#define LIBCORO_IO LIBCORO_IO_EPOLL
+#endif
 
 struct coro;
+struct coro_engine;
 typedef void *(*coro_f)(void *);
 
 /** Initialize the coroutines engine. */
@@ -11,11 +61,33 @@ coro_sched_init(void);
 
 /**
  * Run the coroutines processing while there are any runnable
- * ones.
+ * ones, or sleeping ones with a timeout. When only the latter are
+ * left, the thread sleeps in the kernel until the nearest
+ * deadline. Works with the current engine of the thread.
  */
 void
 coro_sched_run(void);
 
+/**
+ * Same as coro_sched_run(), but the coroutines are processed by
+ * @a thread_count threads: the calling one and thread_count - 1
+ * workers. Each thread has an own engine with an own run queue.
+ * New coroutines are added to the engine of the thread creating
+ * them, and idle threads steal runnable coroutines from the busy
+ * ones. Returns when nothing is runnable in any of the threads.
+ * After that all the coroutines belong to the current engine of
+ * the calling thread again.
+ *
+ * In this mode coro_wakeup() can be called from any thread. A
+ * wakeup of a running coroutine is not lost - its next
+ * coro_suspend() returns right away. So the suspension must be
+ * done in a loop checking the awaited condition. A coroutine can
+ * continue in another thread after any switch, and the data
+ * shared by the coroutines must be protected like with threads.
+ */
+void
+coro_sched_run_threads(int thread_count);
+
 /**
  * Destroy the coroutines engine. All coros must be finished by
  * now.
@@ -23,7 +95,185 @@ coro_sched_run(void);
 void
 coro_sched_destroy(void);
 
-/** Get the currently working coroutine. */
+/**
+ * Each thread has a current engine. All the functions below and
+ * coro_sched_run() work with the current engine of the calling
+ * thread. By default it is the global one, created by
+ * coro_sched_init(). Own engines allow to run an independent
+ * scheduler in each thread, sharing nothing.
+ */
+
+/** Create a new engine. It is not current in any thread yet. */
+struct coro_engine *
+coro_engine_new(void);
+
+/**
+ * Delete an engine created by coro_engine_new(). All its coros
+ * must be finished by now, and it can't be current in the calling
+ * thread.
+ */
+void
+coro_engine_delete(struct coro_engine *engine);
+
+/**
+ * Make the engine current in the calling thread. NULL returns the
+ * global engine. Can't be called from a coroutine.
+ */
+void
+coro_engine_set_current(struct coro_engine *engine);
+
+/** Get the current engine of the calling thread. */
+struct coro_engine *
+coro_engine_get_current(void);
+
+/**
+ * Run the coroutines of the given engine the same as
+ * coro_sched_run() does. The engine is current in the calling
+ * thread while it works.
+ */
+void
+coro_sched_run_engine(struct coro_engine *engine);
+
+/**
+ * Set the stack size of the coroutines created after this call
+ * without an explicit size. The default is 1MB. The memory is
+ * only reserved, its pages are committed by the kernel on first
+ * touch. The size is rounded up to a power of two of pages, so the
+ * pooled stacks are reused by size classes.
+ */
+void
+coro_sched_set_stack_size(size_t size);
+
+/** Memory usage of the coroutine stacks. */
+struct coro_stack_stats {
+	/** Number of stacks, including the pooled coroutines. */
+	size_t count;
+	/** Reserved address space, without the guard pages. */
+	size_t virtual_size;
+	/** Memory actually touched and resident in RAM. */
+	size_t resident_size;
+	/** The biggest resident size of a single stack. */
+	size_t max_resident_size;
+};
+
+/**
+ * Collect the stack memory stats. It walks all the stacks and
+ * asks the kernel about their resident pages, so it is not for
+ * hot paths.
+ */
+void
+coro_sched_stack_stats(struct coro_stack_stats *stats);
+
+/**
+ * Set the limit of the pool of joined coroutines, which are
+ * reused by coro_new(). The coroutines joined when the pool is
+ * full are freed right away. The default is 1024. In the
+ * multi-thread mode each thread has a pool of its own with this
+ * limit.
+ */
+void
+coro_sched_set_pool_max(size_t max);
+
+/**
+ * Give the stack memory of all the pooled coroutines back to the
+ * kernel now. It is also done automatically to those which stay
+ * unused for a second, and after one more second they are freed.
+ */
+void
+coro_sched_pool_trim(void);
+
+/** State of the pool of joined coroutines. */
+struct coro_pool_stats {
+	/** Coroutines in the pool. */
+	size_t count;
+	/** Of them with the stack memory given back to the kernel. */
+	size_t trimmed_count;
+	/** Reserved address space of the pooled stacks. */
+	size_t virtual_size;
+	/** The pool size limit. */
+	size_t max;
+	/** Stacks given back to the kernel, in total. */
+	uint64_t trim_count;
+	/** Pooled coroutines freed by the trim or the limit, in total. */
+	uint64_t free_count;
+};
+
+/** Get the pool state of the current engine. */
+void
+coro_sched_pool_stats(struct coro_pool_stats *stats);
+
+/**
+ * Scheduling stats of a coroutine. Are collected only while
+ * enabled with coro_sched_set_stats(), since they cost a clock
+ * read per switch.
+ */
+struct coro_stats {
+	/** How many times the coroutine got the CPU. */
+	uint64_t switch_count;
+	/** Total time on the CPU. */
+	uint64_t run_ns;
+	/** Total time being runnable, but waiting for the CPU. */
+	uint64_t wait_ns;
+	/** The longest time on the CPU without a switch. */
+	uint64_t max_slice_ns;
+};
+
+/** Counters of the engine. Are always collected. */
+struct coro_sched_stats {
+	/** Iterations of the scheduler loop which ran something. */
+	uint64_t loop_count;
+	/** Switches between the coroutines. */
+	uint64_t switch_count;
+	/** Wakeups which made a coroutine runnable. */
+	uint64_t wakeup_count;
+	/** Coroutines created by reusing a joined one. */
+	uint64_t pool_hit_count;
+	/** Coroutines created from scratch. */
+	uint64_t pool_miss_count;
+};
+
+/**
+ * Turn on or off the per-coroutine stats collection in the
+ * current engine.
+ */
+void
+coro_sched_set_stats(bool is_enabled);
+
+/** Get the counters of the current engine. */
+void
+coro_sched_stats(struct coro_sched_stats *stats);
+
+/**
+ * Get the stats of a coroutine. They are reset when a coroutine
+ * is created, also when it is reused from the pool.
+ */
+void
+coro_stats(const struct coro *coro, struct coro_stats *stats);
+
+/**
+ * Start recording each time slice of each coroutine into a trace
+ * of up to @a max_events events. It also enables the stats. When
+ * the trace is full, the new events are dropped.
+ */
+void
+coro_sched_trace_start(size_t max_events);
+
+/**
+ * Stop the trace and save it into a file as JSON of the Chrome
+ * trace event format. It can be opened in Perfetto UI or
+ * chrome://tracing. Each engine is shown as a thread, and each
+ * time slice - as a span named after the coroutine.
+ *
+ * @retval 0 Success.
+ * @retval -1 The file couldn't be written, errno is set.
+ */
+int
+coro_sched_trace_stop(const char *path);
+
+/**
+ * Get the currently working coroutine. NULL in a thread which is
+ * not running the scheduler.
+ */
 struct coro *
 coro_this(void);
 
@@ -38,6 +288,13 @@ coro_this(void);
 struct coro *
 coro_new(coro_f func, void *func_arg);
 
+/**
+ * Same as coro_new(), but with an explicit stack size. 0 means the
+ * default one.
+ */
+struct coro *
+coro_new_with_stack(coro_f func, void *func_arg, size_t stack_size);
+
 /**
  * Join a coroutine. When joined, its resources are freed, and the
  * result of its callback function is returned. Each coroutine
@@ -46,14 +303,82 @@ coro_new(coro_f func, void *func_arg);
 void *
 coro_join(struct coro *coro);
 
+/**
+ * Detach a coroutine instead of joining it. It is recycled right
+ * when finishes, and its result is dropped. After the call the
+ * coroutine must not be used, unless it is known to be still
+ * working.
+ */
+void
+coro_detach(struct coro *coro);
+
+/**
+ * Group of coroutines, which are joined all at once. The joiner
+ * is suspended only once, until the last child finishes, instead
+ * of a coro_join() per each child.
+ */
+struct coro_group;
+
+/** Create an empty group. */
+struct coro_group *
+coro_group_new(void);
+
+/**
+ * Create a coroutine in the group. It is detached: recycled right
+ * when finishes, and its result is dropped. The returned pointer
+ * is valid only until then. The results can be passed via
+ * @a func_arg.
+ */
+struct coro *
+coro_group_spawn(struct coro_group *group, coro_f func, void *func_arg);
+
+/**
+ * Wait until all the children of the group finish, and delete the
+ * group. The children can spawn more children in the group
+ * meanwhile. Only one coroutine can join a group.
+ */
+void
+coro_group_join(struct coro_group *group);
+
+/**
+ * Cancel all the children of the group, also the ones spawned
+ * after this call. See coro_cancel().
+ */
+void
+coro_group_cancel(struct coro_group *group);
+
 /**
  * Pause the current coroutine until its explicitly woken up with
  * coro_wakeup(). Can be used to wait for some event, which will
  * wakeup this coro when happens.
+ *
+ * @retval true Woken up.
+ * @retval false The coroutine is cancelled. If it was cancelled
+ *     before the call, then it doesn't suspend at all.
  */
-void
+bool
 coro_suspend(void);
 
+/**
+ * Same as coro_suspend(), but not longer than @a sec seconds. The
+ * timeout precision is 1 millisecond, and it is never shorter
+ * than asked.
+ *
+ * @retval true Woken up by coro_wakeup().
+ * @retval false The timeout has expired, or the coroutine is
+ *     cancelled.
+ */
+bool
+coro_suspend_timeout(double sec);
+
+/**
+ * Pause the current coroutine for @a sec seconds. The other
+ * coroutines work meanwhile. coro_wakeup() doesn't interrupt the
+ * sleep, coro_cancel() does.
+ */
+void
+coro_sleep(double sec);
+
 /**
  * Pause the current coroutine until the next iteration of the
  * scheduler. Can be used to let the other coroutines work for a
@@ -69,3 +394,137 @@ coro_yield(void);
  */
 void
 coro_wakeup(struct coro *coro);
+
+/**
+ * Scheduling priority of a coroutine. No priority can starve the
+ * others: each coroutine runnable at the start of an iteration of
+ * the scheduler gets the CPU in it, the low ones - at least once
+ * per a few iterations.
+ */
+enum coro_priority {
+	/**
+	 * Runs once per a few iterations, unless nothing else is
+	 * runnable. For bulk background work.
+	 */
+	CORO_PRIO_LOW,
+	/** The default one. */
+	CORO_PRIO_NORMAL,
+	/**
+	 * Runs first in each iteration. When woken up in the middle
+	 * of an iteration, runs right after the current coroutine
+	 * instead of waiting for the next iteration, up to a limited
+	 * number of times per iteration.
+	 */
+	CORO_PRIO_HIGH,
+	CORO_PRIO_COUNT,
+};
+
+/**
+ * Set the priority of a coroutine. It takes effect since the next
+ * time the coroutine becomes runnable. New coroutines have
+ * CORO_PRIO_NORMAL.
+ */
+void
+coro_set_priority(struct coro *coro, enum coro_priority prio);
+
+/**
+ * Ask a coroutine to stop its work. The cancellation is
+ * cooperative: the coroutine is not interrupted, but its waits
+ * end and fail from now on.
+ * - coro_suspend() and coro_suspend_timeout() return false;
+ * - coro_sleep() returns early;
+ * - the I/O functions fail with ECANCELED;
+ * - coro_group_join() cancels the children, and still waits for
+ *   them.
+ * coro_join() is not affected. The coroutine must be still
+ * working or not joined yet.
+ */
+void
+coro_cancel(struct coro *coro);
+
+/** Check if the current coroutine is cancelled. */
+bool
+coro_is_cancelled(void);
+
+/**
+ * Coroutine-local storage. Each coroutine has CORO_LOCAL_COUNT
+ * pointer slots, addressed by the keys. A new coroutine starts
+ * with a copy of the slots of its creator, so a request context
+ * like a trace ID or a deadline follows the whole tree of the
+ * coroutines serving the request.
+ */
+enum {
+	CORO_LOCAL_COUNT = 8,
+};
+
+/**
+ * Get a new key, the same for all coroutines and threads.
+ *
+ * @retval >=0 The key.
+ * @retval -1 All the keys are taken, errno is ENOSPC.
+ */
+int
+coro_local_key_new(void);
+
+/** Set the value of the current coroutine's slot. */
+void
+coro_local_set(int key, void *value);
+
+/**
+ * Get the value of the current coroutine's slot. NULL if it
+ * wasn't set, or if called not from a coroutine.
+ */
+void *
+coro_local_get(int key);
+
+/** Events to wait for on an fd. */
+enum {
+	CORO_FD_READ = 1,
+	CORO_FD_WRITE = 2,
+};
+
+/**
+ * Suspend the current coroutine until the fd is ready for any of
+ * the @a events. The fd is supposed to be non-blocking and not
+ * ready now - the function is called when an operation has
+ * failed with EAGAIN. Errors and hangups make the fd ready for
+ * everything. The fd is watched via an edge-triggered epoll, and
+ * has to be closed with coro_close(). The other wakeups don't
+ * interrupt the wait.
+ *
+ * @retval 0 The fd is ready.
+ * @retval -1 Error, errno is set. For example, the fd can't be
+ *         polled.
+ */
+int
+coro_wait_fd(int fd, int events);
+
+/**
+ * I/O on non-blocking fds. Same as the corresponding syscalls,
+ * but instead of failing with EAGAIN they suspend the current
+ * coroutine until the fd is ready. The fd readiness is cached, so
+ * there are no extra syscalls while the fd stays ready. An
+ * accepted socket is non-blocking already.
+ */
+ssize_t
+coro_read(int fd, void *buf, size_t size);
+
+ssize_t
+coro_write(int fd, const void *buf, size_t size);
+
+ssize_t
+coro_recv(int fd, void *buf, size_t size, int flags);
+
+ssize_t
+coro_send(int fd, const void *buf, size_t size, int flags);
+
+int
+coro_accept(int fd, struct sockaddr *addr, socklen_t *addrlen);
+
+/**
+ * Close the fd, waited by the coroutines before. Its state is
+ * dropped from the engine, and the waiters are woken up to find
+ * the fd closed.
+ */
+int
+coro_close(int fd);
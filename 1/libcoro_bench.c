@@ -0,0 +1,112 @@
+#include "libcoro.h"
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+/**
+ * Microbenchmark of the libcoro context switch backend. Build it
+ * with different -DLIBCORO_CTX=... to compare them. See the
+ * Makefile's bench target.
+ */
+
+#if LIBCORO_CTX == LIBCORO_CTX_ASM
+#define BENCH_CTX_NAME "asm"
+#elif LIBCORO_CTX == LIBCORO_CTX_UCONTEXT
+#define BENCH_CTX_NAME "ucontext"
+#else
+#define BENCH_CTX_NAME "signal"
+#endif
+
+static uint64_t
+bench_now_ns(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+static void *
+bench_nop_f(void *arg)
+{
+	return arg;
+}
+
+static void
+bench_spawn(int count)
+{
+	struct coro **coros = malloc(sizeof(*coros) * count);
+	coro_sched_set_pool_max(count);
+	/* The first round creates everything from scratch. */
+	uint64_t start = bench_now_ns();
+	for (int i = 0; i < count; ++i)
+		coros[i] = coro_new(bench_nop_f, NULL);
+	uint64_t spawn_new = bench_now_ns() - start;
+	for (int i = 0; i < count; ++i)
+		coro_join(coros[i]);
+	/* The second round takes everything from the pool. */
+	start = bench_now_ns();
+	for (int i = 0; i < count; ++i)
+		coros[i] = coro_new(bench_nop_f, NULL);
+	uint64_t spawn_pooled = bench_now_ns() - start;
+	for (int i = 0; i < count; ++i)
+		coro_join(coros[i]);
+	free(coros);
+
+	printf("%s spawn_new: %.1f ns\n", BENCH_CTX_NAME,
+		(double)spawn_new / count);
+	printf("%s spawn_pooled: %.1f ns\n", BENCH_CTX_NAME,
+		(double)spawn_pooled / count);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+static void *
+bench_yield_f(void *arg)
+{
+	long count = (long)arg;
+	for (long i = 0; i < count; ++i)
+		coro_yield();
+	return NULL;
+}
+
+static void
+bench_switch(int coro_count, long yield_count)
+{
+	struct coro **coros = malloc(sizeof(*coros) * coro_count);
+	uint64_t start = bench_now_ns();
+	for (int i = 0; i < coro_count; ++i)
+		coros[i] = coro_new(bench_yield_f, (void *)yield_count);
+	for (int i = 0; i < coro_count; ++i)
+		coro_join(coros[i]);
+	uint64_t duration = bench_now_ns() - start;
+	free(coros);
+
+	printf("%s switch: %.1f ns\n", BENCH_CTX_NAME,
+		(double)duration / ((double)coro_count * yield_count));
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+static void *
+bench_main_f(void *arg)
+{
+	(void)arg;
+	bench_spawn(10000);
+	bench_switch(10, 1000000);
+	return NULL;
+}
+
+int
+main(void)
+{
+	coro_sched_init();
+	struct coro *main_coro = coro_new(bench_main_f, NULL);
+	coro_sched_run();
+	coro_join(main_coro);
+	coro_sched_destroy();
+	return 0;
+}
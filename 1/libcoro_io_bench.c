@@ -0,0 +1,197 @@
+#include "libcoro.h"
+
+#include <stdarg.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+
+/**
+ * Small-message echo over socketpairs, to compare the I/O
+ * backends of libcoro. Build it with different -DLIBCORO_IO=...
+ * and with the syscalls wrapped by the linker to be counted. See
+ * the Makefile's bench_io target.
+ */
+
+#if LIBCORO_IO == LIBCORO_IO_URING
+#define BENCH_IO_NAME "uring"
+#else
+#define BENCH_IO_NAME "epoll"
+#endif
+
+enum {
+	BENCH_PAIR_COUNT = 100,
+	BENCH_MSG_COUNT = 2000,
+	BENCH_MSG_SIZE = 32,
+};
+
+static long bench_syscall_count = 0;
+
+ssize_t
+__real_read(int fd, void *buf, size_t size);
+
+ssize_t
+__wrap_read(int fd, void *buf, size_t size)
+{
+	++bench_syscall_count;
+	return __real_read(fd, buf, size);
+}
+
+ssize_t
+__real_write(int fd, const void *buf, size_t size);
+
+ssize_t
+__wrap_write(int fd, const void *buf, size_t size)
+{
+	++bench_syscall_count;
+	return __real_write(fd, buf, size);
+}
+
+ssize_t
+__real_recv(int fd, void *buf, size_t size, int flags);
+
+ssize_t
+__wrap_recv(int fd, void *buf, size_t size, int flags)
+{
+	++bench_syscall_count;
+	return __real_recv(fd, buf, size, flags);
+}
+
+ssize_t
+__real_send(int fd, const void *buf, size_t size, int flags);
+
+ssize_t
+__wrap_send(int fd, const void *buf, size_t size, int flags)
+{
+	++bench_syscall_count;
+	return __real_send(fd, buf, size, flags);
+}
+
+int
+__real_epoll_wait(int epfd, struct epoll_event *events, int count,
+	int timeout);
+
+int
+__wrap_epoll_wait(int epfd, struct epoll_event *events, int count,
+	int timeout)
+{
+	++bench_syscall_count;
+	return __real_epoll_wait(epfd, events, count, timeout);
+}
+
+int
+__real_epoll_ctl(int epfd, int op, int fd, struct epoll_event *event);
+
+int
+__wrap_epoll_ctl(int epfd, int op, int fd, struct epoll_event *event)
+{
+	++bench_syscall_count;
+	return __real_epoll_ctl(epfd, op, fd, event);
+}
+
+long
+__real_syscall(long number, ...);
+
+/** io_uring_enter() and futex go here. */
+long
+__wrap_syscall(long number, ...)
+{
+	++bench_syscall_count;
+	va_list ap;
+	va_start(ap, number);
+	long a[6];
+	for (int i = 0; i < 6; ++i)
+		a[i] = va_arg(ap, long);
+	va_end(ap);
+	return __real_syscall(number, a[0], a[1], a[2], a[3], a[4], a[5]);
+}
+
+static uint64_t
+bench_now_ns(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+static void *
+bench_echo_f(void *arg)
+{
+	int fd = (int)(long)arg;
+	char buf[BENCH_MSG_SIZE];
+	ssize_t rc;
+	while ((rc = coro_recv(fd, buf, sizeof(buf), 0)) > 0) {
+		if (coro_send(fd, buf, rc, 0) != rc)
+			abort();
+	}
+	coro_close(fd);
+	return NULL;
+}
+
+static void *
+bench_client_f(void *arg)
+{
+	int fd = (int)(long)arg;
+	char buf[BENCH_MSG_SIZE];
+	memset(buf, 'x', sizeof(buf));
+	for (int i = 0; i < BENCH_MSG_COUNT; ++i) {
+		if (coro_send(fd, buf, sizeof(buf), 0) != sizeof(buf))
+			abort();
+		size_t got = 0;
+		while (got < sizeof(buf)) {
+			ssize_t rc = coro_recv(fd, buf + got, sizeof(buf) - got,
+				0);
+			if (rc <= 0)
+				abort();
+			got += rc;
+		}
+	}
+	coro_close(fd);
+	return NULL;
+}
+
+static void *
+bench_main_f(void *arg)
+{
+	(void)arg;
+	struct coro *coros[BENCH_PAIR_COUNT * 2];
+	for (int i = 0; i < BENCH_PAIR_COUNT; ++i) {
+		int fds[2];
+		if (socketpair(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK, 0,
+			       fds) != 0)
+			abort();
+		coros[2 * i] = coro_new(bench_echo_f, (void *)(long)fds[0]);
+		coros[2 * i + 1] = coro_new(bench_client_f,
+			(void *)(long)fds[1]);
+	}
+	for (int i = 0; i < BENCH_PAIR_COUNT * 2; ++i)
+		coro_join(coros[i]);
+	return NULL;
+}
+
+int
+main(void)
+{
+	coro_sched_init();
+	struct coro *main_coro = coro_new(bench_main_f, NULL);
+	uint64_t start = bench_now_ns();
+	coro_sched_run();
+	uint64_t duration = bench_now_ns() - start;
+	long syscall_count = bench_syscall_count;
+	coro_join(main_coro);
+	coro_sched_destroy();
+
+	/* A round-trip is 2 sends and 2 receives. */
+	double msg_count = (double)BENCH_PAIR_COUNT * BENCH_MSG_COUNT;
+	printf("%s echo: %.0f msg/s\n", BENCH_IO_NAME,
+		msg_count * 1000000000 / duration);
+	printf("%s syscalls per op: %.2f\n", BENCH_IO_NAME,
+		syscall_count / (msg_count * 4));
+	return 0;
+}
@@ -0,0 +1,74 @@
+#include "libcoro.h"
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+
+/**
+ * Scaling benchmark of the multi-thread libcoro mode. A fixed
+ * amount of CPU-bound work, split between many coroutines, is
+ * done with 1 to N threads, where N is the number of cores.
+ */
+
+enum {
+	BENCH_CORO_COUNT = 256,
+	BENCH_SLICE_COUNT = 200,
+	BENCH_SLICE_SIZE = 20000,
+};
+
+static uint64_t
+bench_now_ns(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static void *
+bench_work_f(void *arg)
+{
+	uint64_t x = (uintptr_t)arg;
+	for (int i = 0; i < BENCH_SLICE_COUNT; ++i) {
+		for (int j = 0; j < BENCH_SLICE_SIZE; ++j)
+			x = x * 6364136223846793005ULL + 1442695040888963407ULL;
+		coro_yield();
+	}
+	return (void *)(uintptr_t)x;
+}
+
+static double
+bench_run(int thread_count)
+{
+	struct coro *coros[BENCH_CORO_COUNT];
+	uint64_t start = bench_now_ns();
+	for (int i = 0; i < BENCH_CORO_COUNT; ++i)
+		coros[i] = coro_new(bench_work_f, (void *)(uintptr_t)i);
+	coro_sched_run_threads(thread_count);
+	uint64_t duration = bench_now_ns() - start;
+	for (int i = 0; i < BENCH_CORO_COUNT; ++i)
+		coro_join(coros[i]);
+	return duration / 1000000000.0;
+}
+
+int
+main(int argc, char **argv)
+{
+	int max_threads = sysconf(_SC_NPROCESSORS_ONLN);
+	if (argc > 1)
+		max_threads = atoi(argv[1]);
+	if (max_threads < 1)
+		max_threads = 1;
+	coro_sched_init();
+	double base = 0;
+	for (int i = 1; i <= max_threads; ++i) {
+		double duration = bench_run(i);
+		if (i == 1)
+			base = duration;
+		printf("threads: %d, time: %.3f s, speedup: %.2f\n", i,
+			duration, base / duration);
+	}
+	coro_sched_destroy();
+	return 0;
+}
@@ -0,0 +1,130 @@
+#include "libcoro.h"
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+/**
+ * Wakeup-to-run latency of a coroutine under a bulk load of many
+ * busy ones, with the normal and the high priority. See the
+ * Makefile's bench_prio target.
+ */
+
+enum {
+	BENCH_BULK_COUNT = 1000,
+	/** Busy work of a bulk coroutine between the yields. */
+	BENCH_BULK_SLICE_NS = 1000,
+	BENCH_SAMPLE_COUNT = 500,
+};
+
+static uint64_t
+bench_now_ns(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static int
+bench_cmp_u64(const void *a, const void *b)
+{
+	uint64_t l = *(const uint64_t *)a;
+	uint64_t r = *(const uint64_t *)b;
+	return l < r ? -1 : l > r;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+static bool bench_is_done = false;
+static uint64_t bench_wakeup_time = 0;
+static uint64_t bench_samples[BENCH_SAMPLE_COUNT];
+static int bench_sample_count = 0;
+
+static void *
+bench_bulk_f(void *arg)
+{
+	(void)arg;
+	while (!bench_is_done) {
+		uint64_t start = bench_now_ns();
+		while (bench_now_ns() - start < BENCH_BULK_SLICE_NS)
+			;
+		coro_yield();
+	}
+	return NULL;
+}
+
+static void *
+bench_target_f(void *arg)
+{
+	(void)arg;
+	while (bench_sample_count < BENCH_SAMPLE_COUNT) {
+		coro_suspend();
+		bench_samples[bench_sample_count++] =
+			bench_now_ns() - bench_wakeup_time;
+		bench_wakeup_time = 0;
+	}
+	return NULL;
+}
+
+static void *
+bench_waker_f(void *arg)
+{
+	struct coro *target = arg;
+	while (bench_sample_count < BENCH_SAMPLE_COUNT) {
+		coro_sleep(0.001);
+		/* The previous wakeup must be consumed first. */
+		while (bench_wakeup_time != 0)
+			coro_yield();
+		bench_wakeup_time = bench_now_ns();
+		coro_wakeup(target);
+	}
+	return NULL;
+}
+
+static void
+bench_latency(enum coro_priority prio, const char *name)
+{
+	bench_is_done = false;
+	bench_sample_count = 0;
+	bench_wakeup_time = 0;
+	struct coro **bulk = malloc(sizeof(*bulk) * BENCH_BULK_COUNT);
+	for (int i = 0; i < BENCH_BULK_COUNT; ++i)
+		bulk[i] = coro_new(bench_bulk_f, NULL);
+	struct coro *target = coro_new(bench_target_f, NULL);
+	coro_set_priority(target, prio);
+	struct coro *waker = coro_new(bench_waker_f, target);
+	coro_join(waker);
+	coro_join(target);
+	bench_is_done = true;
+	for (int i = 0; i < BENCH_BULK_COUNT; ++i)
+		coro_join(bulk[i]);
+	free(bulk);
+
+	qsort(bench_samples, BENCH_SAMPLE_COUNT, sizeof(bench_samples[0]),
+		bench_cmp_u64);
+	printf("%s wakeup-to-run p50: %.1f us\n", name,
+		bench_samples[BENCH_SAMPLE_COUNT / 2] / 1000.0);
+	printf("%s wakeup-to-run p99: %.1f us\n", name,
+		bench_samples[BENCH_SAMPLE_COUNT * 99 / 100] / 1000.0);
+}
+
+static void *
+bench_main_f(void *arg)
+{
+	(void)arg;
+	bench_latency(CORO_PRIO_NORMAL, "normal");
+	bench_latency(CORO_PRIO_HIGH, "high");
+	return NULL;
+}
+
+int
+main(void)
+{
+	coro_sched_init();
+	struct coro *main_coro = coro_new(bench_main_f, NULL);
+	coro_sched_run();
+	coro_join(main_coro);
+	coro_sched_destroy();
+	return 0;
+}
@@ -2,6 +2,15 @@
 
 #include "unit.h"
 
+#include <errno.h>
+#include <pthread.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+
 ////////////////////////////////////////////////////////////////////////////////
 
 static void *
@@ -34,6 +43,65 @@ test_suspend(void)
 
 ////////////////////////////////////////////////////////////////////////////////
 
+#if defined(__x86_64__) && LIBCORO_CTX == LIBCORO_CTX_ASM
+
+static uint32_t
+test_fp_env_get(void)
+{
+	uint32_t mxcsr;
+	uint16_t cw;
+	__asm__ volatile("stmxcsr %0" : "=m"(mxcsr));
+	__asm__ volatile("fnstcw %0" : "=m"(cw));
+	return (mxcsr & 0xffff) | (uint32_t)cw << 16;
+}
+
+static void
+test_fp_env_set(uint32_t env)
+{
+	uint32_t mxcsr = env & 0xffff;
+	uint16_t cw = env >> 16;
+	__asm__ volatile("ldmxcsr %0" : : "m"(mxcsr));
+	__asm__ volatile("fldcw %0" : : "m"(cw));
+}
+
+static void *
+test_fp_env_f(void *arg)
+{
+	uint32_t env = *(uint32_t *)arg;
+	/* Rounding up, both for SSE and x87. */
+	uint32_t own = env | 0x4000 | (0x800 << 16);
+	test_fp_env_set(own);
+	coro_yield();
+	bool ok = test_fp_env_get() == own;
+	test_fp_env_set(env);
+	return (void *)ok;
+}
+
+static void
+test_fp_env(void)
+{
+	unit_test_start();
+
+	uint32_t env = test_fp_env_get();
+	struct coro *c = coro_new(test_fp_env_f, &env);
+	coro_yield();
+	unit_check(test_fp_env_get() == env, "rounding mode isn't leaked");
+	unit_check(coro_join(c) != NULL, "rounding mode is kept");
+
+	unit_test_finish();
+}
+
+#else
+
+static void
+test_fp_env(void)
+{
+}
+
+#endif
+
+////////////////////////////////////////////////////////////////////////////////
+
 struct test_loop_ctx {
 	int id;
 	int yield_count;
@@ -162,15 +230,967 @@ test_wakeup_of_finished(void)
 
 ////////////////////////////////////////////////////////////////////////////////
 
+static void *
+test_stack_touch_f(void *arg)
+{
+	size_t size = (size_t)arg;
+	char buf[size];
+	memset(buf, 1, size);
+	/* Don't let the compiler drop the buffer. */
+	__asm__ volatile("" : : "r"(buf) : "memory");
+	coro_suspend();
+	return NULL;
+}
+
+static void
+test_stack_size(void)
+{
+	unit_test_start();
+
+	struct coro_stack_stats before;
+	coro_sched_stack_stats(&before);
+
+	/*
+	 * Bigger than the default, so it can't be taken from the
+	 * pool.
+	 */
+	const size_t stack_size = 4 * 1024 * 1024;
+	const size_t touch_size = 100 * 1024;
+	struct coro *c = coro_new_with_stack(test_stack_touch_f,
+		(void *)touch_size, stack_size);
+	coro_yield();
+	struct coro_stack_stats after;
+	coro_sched_stack_stats(&after);
+	unit_check(after.count == before.count + 1, "one more stack");
+	unit_check(after.virtual_size - before.virtual_size == stack_size,
+		"own stack size");
+	unit_check(after.resident_size - before.resident_size >= touch_size,
+		"touched memory is resident");
+	unit_check(after.resident_size - before.resident_size <
+		   touch_size + 64 * 1024, "untouched memory is not");
+	unit_check(after.max_resident_size >= touch_size, "max resident");
+	coro_wakeup(c);
+	unit_check(coro_join(c) == NULL, "joined");
+
+	unit_test_finish();
+}
+
+static void *
+test_stack_pool_f(void *arg)
+{
+	size_t size = (size_t)arg;
+	if (size != 0) {
+		char buf[size];
+		memset(buf, 1, size);
+		__asm__ volatile("" : : "r"(buf) : "memory");
+	}
+	return NULL;
+}
+
+static void *
+test_stack_pool_yield_f(void *arg)
+{
+	volatile long ids[64];
+	for (int i = 0; i < 64; ++i)
+		ids[i] = (long)arg;
+	for (int i = 0; i < 3; ++i)
+		coro_yield();
+	for (int i = 0; i < 64; ++i) {
+		if (ids[i] != (long)arg)
+			return NULL;
+	}
+	return arg;
+}
+
+static void
+test_stack_pool(void)
+{
+	unit_test_start();
+
+	struct coro_pool_stats before, after;
+	coro_sched_pool_stats(&before);
+	coro_sched_set_pool_max(4);
+	struct coro *coros[10];
+	for (int i = 0; i < 10; ++i)
+		coros[i] = coro_new(test_stack_pool_f, NULL);
+	for (int i = 0; i < 10; ++i)
+		coro_join(coros[i]);
+	coro_sched_pool_stats(&after);
+	unit_check(after.count == 4, "pool is bounded");
+	unit_check(after.free_count >= before.free_count + 6,
+		   "extra coroutines are freed");
+
+	/* A used stack gives the memory back when trimmed. */
+	const size_t touch_size = 200 * 1024;
+	struct coro *c = coro_new(test_stack_pool_f, (void *)touch_size);
+	coro_join(c);
+	struct coro_stack_stats stack_before, stack_after;
+	coro_sched_stack_stats(&stack_before);
+	coro_sched_pool_trim();
+	coro_sched_stack_stats(&stack_after);
+	coro_sched_pool_stats(&after);
+	unit_check(after.trimmed_count == after.count, "all are trimmed");
+	unit_check(stack_before.resident_size - stack_after.resident_size >=
+		   touch_size - 16 * 1024, "memory is given back");
+
+	/* The trimmed coroutines are still reusable. */
+	c = coro_new(test_stack_pool_f, (void *)touch_size);
+	unit_check(coro_join(c) == NULL, "trimmed one is reused");
+
+	/* All of them, with the switches in and out of the stacks. */
+	coro_sched_pool_trim();
+	for (int i = 0; i < 4; ++i)
+		coros[i] = coro_new(test_stack_pool_yield_f, (void *)(long)i);
+	bool ok = true;
+	for (int i = 0; i < 4; ++i)
+		ok = ok && coro_join(coros[i]) == (void *)(long)i;
+	unit_check(ok, "trimmed ones keep their stacks across switches");
+	coro_sched_set_pool_max(1024);
+
+	unit_test_finish();
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+static double
+test_now(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1000000000.0;
+}
+
+struct test_sleep_ctx {
+	double duration;
+	int *order;
+	int *order_size;
+	int id;
+};
+
+static void *
+test_sleep_f(void *arg)
+{
+	struct test_sleep_ctx *ctx = arg;
+	coro_sleep(ctx->duration);
+	ctx->order[(*ctx->order_size)++] = ctx->id;
+	return NULL;
+}
+
+static void *
+test_sleep_and_wakeup_f(void *arg)
+{
+	coro_sleep(0.01);
+	coro_wakeup(arg);
+	return NULL;
+}
+
+static void
+test_timers(void)
+{
+	unit_test_start();
+
+	double start = test_now();
+	coro_sleep(0.03);
+	unit_check(test_now() - start >= 0.03, "sleep");
+
+	start = test_now();
+	unit_check(!coro_suspend_timeout(0.02), "suspend timed out");
+	unit_check(test_now() - start >= 0.02, "suspend timeout");
+
+	start = test_now();
+	struct coro *c = coro_new(test_sleep_and_wakeup_f, coro_this());
+	unit_check(coro_suspend_timeout(10), "suspend woken up");
+	unit_check(test_now() - start < 5, "woken up before timeout");
+	coro_join(c);
+
+	/*
+	 * The longer ones don't fit into the first level of the
+	 * wheel and are cascaded.
+	 */
+	enum { count = 50 };
+	struct test_sleep_ctx ctxs[count];
+	struct coro *coros[count];
+	int order[count];
+	int order_size = 0;
+	for (int i = 0; i < count; ++i) {
+		ctxs[i].duration = (count - i) * 0.003;
+		ctxs[i].order = order;
+		ctxs[i].order_size = &order_size;
+		ctxs[i].id = count - i - 1;
+		coros[i] = coro_new(test_sleep_f, &ctxs[i]);
+	}
+	for (int i = 0; i < count; ++i)
+		coro_join(coros[i]);
+	bool ok = order_size == count;
+	for (int i = 0; i < order_size && ok; ++i)
+		ok = order[i] == i;
+	unit_check(ok, "woken up in the deadline order");
+
+	unit_test_finish();
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+static void *
+test_stats_busy_f(void *arg)
+{
+	(void)arg;
+	double start = test_now();
+	while (test_now() - start < 0.005)
+		;
+	for (int i = 0; i < 3; ++i)
+		coro_yield();
+	return NULL;
+}
+
+static void *
+test_stats_yield_f(void *arg)
+{
+	(void)arg;
+	for (int i = 0; i < 3; ++i)
+		coro_yield();
+	return NULL;
+}
+
+static void
+test_stats(void)
+{
+	unit_test_start();
+
+	struct coro_sched_stats before, after;
+	coro_sched_stats(&before);
+	coro_sched_trace_start(1000);
+	struct coro *c = coro_new(test_stats_busy_f, NULL);
+	/* It gets the CPU once on start and once after each yield. */
+	struct coro_stats stats;
+	do {
+		coro_yield();
+		coro_stats(c, &stats);
+	} while (stats.switch_count < 4);
+	coro_join(c);
+	const char *path = "test_trace.json";
+	unit_check(coro_sched_trace_stop(path) == 0, "trace is saved");
+	coro_sched_set_stats(false);
+	coro_sched_stats(&after);
+
+	unit_check(stats.switch_count == 4, "switch count");
+	unit_check(stats.run_ns >= 5000000, "run time");
+	unit_check(stats.max_slice_ns >= 5000000, "max slice");
+	unit_check(stats.max_slice_ns <= stats.run_ns, "slice <= total");
+	unit_check(after.loop_count > before.loop_count, "loops");
+	unit_check(after.switch_count > before.switch_count, "switches");
+	unit_check(after.pool_hit_count + after.pool_miss_count ==
+		   before.pool_hit_count + before.pool_miss_count + 1,
+		   "pool hits and misses");
+
+	FILE *f = fopen(path, "r");
+	char buf[64] = {0};
+	unit_fail_if(f == NULL);
+	unit_check(fread(buf, 1, sizeof(buf) - 1, f) > 0 &&
+		   strncmp(buf, "{\"traceEvents\":[", 16) == 0 &&
+		   strstr(buf, "\"name\":\"coro ") != NULL, "trace format");
+	fclose(f);
+	unlink(path);
+
+	/* The ones started before the trace get their IDs in it. */
+	struct coro *coros[2];
+	for (int i = 0; i < 2; ++i)
+		coros[i] = coro_new(test_stats_yield_f, NULL);
+	coro_yield();
+	coro_sched_trace_start(1000);
+	for (int i = 0; i < 2; ++i)
+		coro_join(coros[i]);
+	unit_check(coro_sched_trace_stop(path) == 0, "trace is saved");
+	coro_sched_set_stats(false);
+	f = fopen(path, "r");
+	unit_fail_if(f == NULL);
+	char trace[4096] = {0};
+	unit_check(fread(trace, 1, sizeof(trace) - 1, f) > 0 &&
+		   strstr(trace, "\"name\":\"coro ") != NULL &&
+		   strstr(trace, "\"name\":\"coro 0\"") == NULL,
+		   "no zero IDs in the trace");
+	fclose(f);
+	unlink(path);
+
+	unit_test_finish();
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+static void *
+test_detach_f(void *arg)
+{
+	int *count = arg;
+	coro_yield();
+	++*count;
+	return NULL;
+}
+
+static int test_group_count = 0;
+
+static void *
+test_group_f(void *arg)
+{
+	long yield_count = (long)arg;
+	for (long i = 0; i < yield_count; ++i)
+		coro_yield();
+	++test_group_count;
+	return NULL;
+}
+
+static void *
+test_group_parent_f(void *arg)
+{
+	struct coro_group *group = arg;
+	coro_yield();
+	coro_group_spawn(group, test_group_f, (void *)3);
+	return NULL;
+}
+
+/** Coroutines which are neither pooled nor freed. */
+static size_t
+test_live_count(void)
+{
+	struct coro_stack_stats stack;
+	struct coro_pool_stats pool;
+	coro_sched_stack_stats(&stack);
+	coro_sched_pool_stats(&pool);
+	return stack.count - pool.count;
+}
+
+static void
+test_detach(void)
+{
+	unit_test_start();
+
+	size_t live_count = test_live_count();
+	int count = 0;
+	for (int i = 0; i < 5; ++i)
+		coro_detach(coro_new(test_detach_f, &count));
+	/* Finished, but not detached yet. */
+	struct coro *c = coro_new(test_detach_f, &count);
+	while (count != 6)
+		coro_yield();
+	coro_detach(c);
+	unit_check(test_live_count() == live_count, "detached are recycled");
+
+	struct coro_sched_stats stats_before, stats_after;
+	coro_sched_stats(&stats_before);
+	struct coro_group *group = coro_group_new();
+	for (long i = 0; i < 10; ++i)
+		coro_group_spawn(group, test_group_f, (void *)(i % 3));
+	/* A child can add more children. */
+	coro_group_spawn(group, test_group_parent_f, group);
+	coro_group_join(group);
+	coro_sched_stats(&stats_after);
+	unit_check(test_group_count == 11, "all children are done");
+	unit_check(stats_after.wakeup_count - stats_before.wakeup_count == 1,
+		   "joiner is woken up once");
+	unit_check(test_live_count() == live_count, "children are recycled");
+
+	unit_test_finish();
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+static int test_prio_log[16];
+static int test_prio_log_size = 0;
+static struct coro *test_prio_high = NULL;
+static bool test_prio_is_done = false;
+
+static void
+test_prio_log_add(int id)
+{
+	if (test_prio_log_size < (int)(sizeof(test_prio_log) /
+				       sizeof(test_prio_log[0])))
+		test_prio_log[test_prio_log_size++] = id;
+}
+
+static void *
+test_prio_high_f(void *arg)
+{
+	(void)arg;
+	coro_suspend();
+	test_prio_log_add(100);
+	return NULL;
+}
+
+static void *
+test_prio_bulk_f(void *arg)
+{
+	int id = (int)(long)arg;
+	test_prio_log_add(id);
+	if (id == 1)
+		coro_wakeup(test_prio_high);
+	coro_yield();
+	test_prio_log_add(id);
+	return NULL;
+}
+
+static void *
+test_prio_low_f(void *arg)
+{
+	int *count = arg;
+	while (!test_prio_is_done) {
+		++*count;
+		coro_yield();
+	}
+	return NULL;
+}
+
+static void *
+test_prio_normal_f(void *arg)
+{
+	(void)arg;
+	for (int i = 0; i < 40; ++i)
+		coro_yield();
+	return NULL;
+}
+
+static void
+test_priority(void)
+{
+	unit_test_start();
+
+	test_prio_high = coro_new(test_prio_high_f, NULL);
+	coro_set_priority(test_prio_high, CORO_PRIO_HIGH);
+	/* Let it start and suspend. */
+	coro_yield();
+	struct coro *bulk[4];
+	for (int i = 0; i < 4; ++i)
+		bulk[i] = coro_new(test_prio_bulk_f, (void *)(long)(i + 1));
+	for (int i = 0; i < 4; ++i)
+		coro_join(bulk[i]);
+	coro_join(test_prio_high);
+	/* The woken up one doesn't wait for the end of the iteration. */
+	int expected[] = {1, 100, 2, 3, 4, 1, 2, 3, 4};
+	bool is_ok = test_prio_log_size == 9;
+	for (int i = 0; i < 9 && is_ok; ++i)
+		is_ok = test_prio_log[i] == expected[i];
+	unit_check(is_ok, "high priority runs ahead");
+
+	int low_count = 0;
+	struct coro *low = coro_new(test_prio_low_f, &low_count);
+	coro_set_priority(low, CORO_PRIO_LOW);
+	struct coro *normal[2];
+	for (int i = 0; i < 2; ++i)
+		normal[i] = coro_new(test_prio_normal_f, NULL);
+	for (int i = 0; i < 2; ++i)
+		coro_join(normal[i]);
+	test_prio_is_done = true;
+	coro_join(low);
+	unit_check(low_count > 0, "low priority isn't starved");
+	unit_check(low_count < 20, "low priority runs less");
+
+	unit_test_finish();
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+static void
+test_socketpair(int fds[2])
+{
+	unit_fail_if(socketpair(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK, 0,
+		fds) != 0);
+}
+
+static void *
+test_io_writer_f(void *arg)
+{
+	int fd = (int)(long)arg;
+	coro_sleep(0.01);
+	if (coro_write(fd, "hello", 5) != 5)
+		return (void *)-1;
+	return NULL;
+}
+
+/** Echo everything back until EOF. */
+static void *
+test_io_echo_f(void *arg)
+{
+	int fd = (int)(long)arg;
+	char buf[64];
+	ssize_t rc;
+	while ((rc = coro_recv(fd, buf, sizeof(buf), 0)) > 0) {
+		if (coro_send(fd, buf, rc, 0) != rc)
+			return (void *)-1;
+	}
+	coro_close(fd);
+	return rc == 0 ? NULL : (void *)-1;
+}
+
+/** Send messages and check they come back. */
+static void *
+test_io_client_f(void *arg)
+{
+	int fd = (int)(long)arg;
+	for (int i = 0; i < 100; ++i) {
+		char msg[16], buf[16];
+		int len = snprintf(msg, sizeof(msg), "msg %d", i);
+		if (coro_send(fd, msg, len, 0) != len)
+			return (void *)-1;
+		int got = 0;
+		while (got < len) {
+			ssize_t rc = coro_recv(fd, buf + got, len - got, 0);
+			if (rc <= 0)
+				return (void *)-1;
+			got += rc;
+		}
+		if (memcmp(msg, buf, len) != 0)
+			return (void *)-1;
+	}
+	coro_close(fd);
+	return NULL;
+}
+
+static void *
+test_io_reader_f(void *arg)
+{
+	int fd = (int)(long)arg;
+	char buf[16];
+	return (void *)(long)coro_read(fd, buf, sizeof(buf));
+}
+
+/** Accept one connection and serve it. */
+static void *
+test_io_server_f(void *arg)
+{
+	int fd = (int)(long)arg;
+	int conn = coro_accept(fd, NULL, NULL);
+	if (conn < 0)
+		return (void *)-1;
+	return test_io_echo_f((void *)(long)conn);
+}
+
+/** Start echo pairs, each waiting on its own socket. */
+static bool
+test_io_echo_pairs(int count)
+{
+	struct coro **coros = malloc(sizeof(*coros) * count * 2);
+	for (int i = 0; i < count; ++i) {
+		int fds[2];
+		test_socketpair(fds);
+		coros[2 * i] = coro_new(test_io_echo_f, (void *)(long)fds[0]);
+		coros[2 * i + 1] = coro_new(test_io_client_f,
+			(void *)(long)fds[1]);
+	}
+	bool ok = true;
+	for (int i = 0; i < count * 2; ++i)
+		ok = coro_join(coros[i]) == NULL && ok;
+	free(coros);
+	return ok;
+}
+
+static void
+test_io(void)
+{
+	unit_test_start();
+
+	int fds[2];
+	test_socketpair(fds);
+	struct coro *c = coro_new(test_io_writer_f, (void *)(long)fds[1]);
+	char buf[16];
+	unit_check(coro_read(fds[0], buf, sizeof(buf)) == 5 &&
+		   memcmp(buf, "hello", 5) == 0, "read waits for the data");
+	unit_check(coro_join(c) == NULL, "write");
+	coro_close(fds[1]);
+	unit_check(coro_read(fds[0], buf, sizeof(buf)) == 0, "EOF");
+	coro_close(fds[0]);
+
+	unit_check(coro_wait_fd(-1, CORO_FD_READ) == -1, "bad fd");
+
+	test_socketpair(fds);
+	c = coro_new(test_io_reader_f, (void *)(long)fds[0]);
+	coro_yield();
+	coro_close(fds[0]);
+	unit_check(coro_join(c) == (void *)-1L, "close wakes the reader");
+	coro_close(fds[1]);
+
+	unit_check(test_io_echo_pairs(100), "echo");
+
+	int lfd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0);
+	struct sockaddr_in addr;
+	memset(&addr, 0, sizeof(addr));
+	addr.sin_family = AF_INET;
+	addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	socklen_t addr_len = sizeof(addr);
+	unit_fail_if(bind(lfd, (struct sockaddr *)&addr, addr_len) != 0);
+	unit_fail_if(listen(lfd, 10) != 0);
+	unit_fail_if(getsockname(lfd, (struct sockaddr *)&addr,
+		&addr_len) != 0);
+	c = coro_new(test_io_server_f, (void *)(long)lfd);
+	/* Let the server block in accept. */
+	coro_yield();
+	int cfd = socket(AF_INET, SOCK_STREAM, 0);
+	unit_fail_if(connect(cfd, (struct sockaddr *)&addr, addr_len) != 0);
+	fcntl(cfd, F_SETFL, fcntl(cfd, F_GETFL) | O_NONBLOCK);
+	unit_check(test_io_client_f((void *)(long)cfd) == NULL, "accepted");
+	unit_check(coro_join(c) == NULL, "served");
+	coro_close(lfd);
+
+	unit_test_finish();
+}
+
+static int test_local_key = -1;
+
+static void *
+test_local_f(void *arg)
+{
+	(void)arg;
+	void *inherited = coro_local_get(test_local_key);
+	coro_local_set(test_local_key, (void *)2);
+	return inherited;
+}
+
+static void *
+test_cancel_suspend_f(void *arg)
+{
+	(void)arg;
+	bool is_woken_up = coro_suspend();
+	return (void *)(long)(!is_woken_up && coro_is_cancelled());
+}
+
+static void *
+test_cancel_sleep_f(void *arg)
+{
+	(void)arg;
+	coro_sleep(100);
+	return (void *)(long)coro_is_cancelled();
+}
+
+static void *
+test_cancel_read_f(void *arg)
+{
+	int fd = (int)(long)arg;
+	char c;
+	return (void *)(long)(coro_read(fd, &c, 1) == -1 &&
+			      errno == ECANCELED);
+}
+
+static int test_cancel_group_count = 0;
+
+static void *
+test_cancel_child_f(void *arg)
+{
+	(void)arg;
+	coro_sleep(100);
+	if (coro_is_cancelled())
+		++test_cancel_group_count;
+	return NULL;
+}
+
+static void *
+test_cancel_group_f(void *arg)
+{
+	(void)arg;
+	struct coro_group *group = coro_group_new();
+	for (int i = 0; i < 3; ++i)
+		coro_group_spawn(group, test_cancel_child_f, NULL);
+	coro_group_join(group);
+	return NULL;
+}
+
+static void
+test_cancel(void)
+{
+	unit_test_start();
+
+	test_local_key = coro_local_key_new();
+	unit_fail_if(test_local_key < 0);
+	coro_local_set(test_local_key, (void *)1);
+	struct coro *c = coro_new(test_local_f, NULL);
+	unit_check(coro_join(c) == (void *)1, "locals are inherited");
+	unit_check(coro_local_get(test_local_key) == (void *)1,
+		   "locals are not shared");
+	coro_local_set(test_local_key, NULL);
+
+	c = coro_new(test_cancel_suspend_f, NULL);
+	coro_yield();
+	coro_cancel(c);
+	unit_check(coro_join(c) != NULL, "suspend is cancelled");
+
+	c = coro_new(test_cancel_sleep_f, NULL);
+	coro_yield();
+	coro_cancel(c);
+	unit_check(coro_join(c) != NULL, "sleep is cancelled");
+
+	int fds[2];
+	test_socketpair(fds);
+	c = coro_new(test_cancel_read_f, (void *)(long)fds[0]);
+	coro_yield();
+	coro_cancel(c);
+	unit_check(coro_join(c) != NULL, "read is cancelled");
+	/* Cancellation is sticky, the wait fails right away. */
+	c = coro_new(test_cancel_read_f, (void *)(long)fds[0]);
+	coro_cancel(c);
+	unit_check(coro_join(c) != NULL, "read of a cancelled one fails");
+	coro_close(fds[0]);
+	coro_close(fds[1]);
+
+	c = coro_new(test_cancel_group_f, NULL);
+	coro_yield();
+	coro_cancel(c);
+	unit_check(coro_join(c) == NULL, "group is joined");
+	unit_check(test_cancel_group_count == 3, "children are cancelled");
+
+	unit_test_finish();
+}
+
+static void *
+test_io_threads_f(void *arg)
+{
+	return test_io_echo_pairs(100) ? NULL : arg;
+}
+
+static void
+test_io_threads(void)
+{
+	unit_test_start();
+
+	struct coro *c = coro_new(test_io_threads_f, (void *)-1);
+	coro_sched_run_threads(4);
+	unit_check(coro_join(c) == NULL, "echo in threads");
+
+	unit_test_finish();
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+struct test_threads_ctx {
+	/** Total number of increments done by all the coroutines. */
+	long counter;
+	/** How many of them the consumer expects. */
+	long target;
+	/** Coroutine waiting for the counter to reach the target. */
+	struct coro *consumer;
+};
+
+static void *
+test_threads_producer_f(void *arg)
+{
+	struct test_threads_ctx *ctx = arg;
+	for (int i = 0; i < 1000; ++i) {
+		__atomic_add_fetch(&ctx->counter, 1, __ATOMIC_SEQ_CST);
+		coro_wakeup(ctx->consumer);
+		coro_yield();
+	}
+	return NULL;
+}
+
+static void *
+test_threads_consumer_f(void *arg)
+{
+	struct test_threads_ctx *ctx = arg;
+	while (__atomic_load_n(&ctx->counter, __ATOMIC_SEQ_CST) < ctx->target)
+		coro_suspend();
+	return NULL;
+}
+
+static void *
+test_threads_child_f(void *arg)
+{
+	coro_yield();
+	return arg;
+}
+
+static void *
+test_threads_main_f(void *arg)
+{
+	struct test_threads_ctx *ctx = arg;
+	/* The other threads must wait for a sleeping one. */
+	coro_sleep(0.02);
+	const int producer_count = 16;
+	ctx->target = producer_count * 1000;
+	ctx->consumer = coro_new(test_threads_consumer_f, ctx);
+	struct coro *producers[producer_count];
+	for (int i = 0; i < producer_count; ++i)
+		producers[i] = coro_new(test_threads_producer_f, ctx);
+	/* Joins of the coroutines which might work in other threads. */
+	for (long i = 0; i < 1000; ++i) {
+		struct coro *c = coro_new(test_threads_child_f, (void *)i);
+		if (coro_join(c) != (void *)i)
+			return (void *)-1;
+	}
+	for (int i = 0; i < producer_count; ++i)
+		coro_join(producers[i]);
+	coro_join(ctx->consumer);
+	return NULL;
+}
+
+static void
+test_threads(void)
+{
+	unit_test_start();
+
+	struct test_threads_ctx ctx;
+	ctx.counter = 0;
+	struct coro *c = coro_new(test_threads_main_f, &ctx);
+	coro_sched_run_threads(4);
+	unit_check(coro_join(c) == NULL, "children joined");
+	unit_check(ctx.counter == ctx.target, "all increments are done");
+
+	unit_test_finish();
+}
+
+static void *
+test_threads_pool_f(void *arg)
+{
+	for (int i = 0; i < 3; ++i)
+		coro_yield();
+	return arg;
+}
+
+static void *
+test_threads_pool_main_f(void *arg)
+{
+	(void)arg;
+	struct coro *coros[64];
+	for (int i = 0; i < 64; ++i)
+		coros[i] = coro_new(test_threads_pool_f, NULL);
+	for (int i = 0; i < 64; ++i)
+		coro_join(coros[i]);
+	/* The joined ones are pooled by their creator, with its limit. */
+	struct coro_pool_stats stats;
+	coro_sched_pool_stats(&stats);
+	return (void *)stats.count;
+}
+
+static void
+test_threads_pool(void)
+{
+	unit_test_start();
+
+	coro_sched_set_pool_max(4);
+	struct coro *c = coro_new(test_threads_pool_main_f, NULL);
+	coro_sched_run_threads(4);
+	unit_check((size_t)coro_join(c) <= 4,
+		   "pool is bounded while the threads work");
+	coro_sched_set_pool_max(1024);
+
+	unit_test_finish();
+}
+
+static void *
+test_threads_group_child_f(void *arg)
+{
+	if (arg != NULL)
+		coro_yield();
+	return NULL;
+}
+
+static void *
+test_threads_group_main_f(void *arg)
+{
+	(void)arg;
+	/* The children finish in other threads while the join starts. */
+	for (long i = 0; i < 5000; ++i) {
+		struct coro_group *group = coro_group_new();
+		coro_group_spawn(group, test_threads_group_child_f, NULL);
+		coro_group_spawn(group, test_threads_group_child_f,
+				 (void *)(i % 2));
+		coro_group_join(group);
+	}
+	return NULL;
+}
+
+static void
+test_threads_group(void)
+{
+	unit_test_start();
+
+	struct coro *c = coro_new(test_threads_group_main_f, NULL);
+	coro_sched_run_threads(4);
+	unit_check(coro_join(c) == NULL, "groups joined");
+
+	unit_test_finish();
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+static void *
+test_engines_worker_f(void *arg)
+{
+	long *counter = arg;
+	for (int i = 0; i < 100; ++i) {
+		++*counter;
+		coro_yield();
+	}
+	return NULL;
+}
+
+static void *
+test_engines_main_f(void *arg)
+{
+	long *counter = arg;
+	struct coro *coros[10];
+	for (int i = 0; i < 10; ++i)
+		coros[i] = coro_new(test_engines_worker_f, counter);
+	for (int i = 0; i < 10; ++i)
+		coro_join(coros[i]);
+	return counter;
+}
+
+static void *
+test_engines_thread_f(void *arg)
+{
+	long *counter = arg;
+	struct coro_engine *e = coro_engine_new();
+	coro_engine_set_current(e);
+	struct coro *c = coro_new(test_engines_main_f, counter);
+	coro_engine_set_current(NULL);
+	coro_sched_run_engine(e);
+	coro_engine_set_current(e);
+	void *rc = coro_join(c);
+	coro_engine_set_current(NULL);
+	coro_engine_delete(e);
+	return rc;
+}
+
+static void
+test_engines(void)
+{
+	unit_test_start();
+
+	const int thread_count = 4;
+	pthread_t threads[thread_count];
+	long counters[thread_count];
+	for (int i = 0; i < thread_count; ++i) {
+		counters[i] = 0;
+		pthread_create(&threads[i], NULL, test_engines_thread_f,
+			&counters[i]);
+	}
+	bool ok = true;
+	for (int i = 0; i < thread_count; ++i) {
+		void *rc;
+		pthread_join(threads[i], &rc);
+		ok = ok && rc == &counters[i] && counters[i] == 1000;
+	}
+	unit_check(ok, "each thread ran its own engine");
+	unit_check(coro_engine_get_current() != NULL, "global engine is back");
+
+	unit_test_finish();
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
 static void *
 coro_main_f(void *arg)
 {
 	(void)arg;
 	test_suspend();
 	test_loop_of_yields();
+	test_fp_env();
 	test_wakup_self();
 	test_join_of_join();
 	test_wakeup_of_finished();
+	test_stack_size();
+	test_stack_pool();
+	test_timers();
+	test_io();
+	test_stats();
+	test_priority();
+	test_detach();
+	test_cancel();
 	return NULL;
 }
 
@@ -182,6 +1202,11 @@ main(void)
 	coro_sched_run();
 	void *rc = coro_join(main_coro);
 	unit_check(rc == NULL, "main coro rc");
+	test_threads();
+	test_threads_pool();
+	test_threads_group();
+	test_io_threads();
+	test_engines();
 	coro_sched_destroy();
 	return 0;
 }
@@ -3,6 +3,7 @@
 #include "unit.h"
 #include "corobus.h"
 
+#include <pthread.h>
 #include <string.h>
 
 ////////////////////////////////////////////////////////////////////////////////
@@ -189,6 +190,53 @@ test_channel_reopen(void)
 	unit_test_finish();
 }
 
+static void
+test_channel_many(void)
+{
+	unit_test_start();
+	struct coro_bus *bus = coro_bus_new();
+	enum { COUNT = 100000 };
+
+	unit_msg("open many channels");
+	for (int i = 0; i < COUNT; ++i)
+		unit_assert(coro_bus_channel_open(bus, 1) == i);
+
+	unit_msg("close every second one");
+	for (int i = 0; i < COUNT; i += 2)
+		coro_bus_channel_close(bus, i);
+
+	unit_msg("the closed descriptors are reused");
+	bool *is_reused = calloc(COUNT, sizeof(*is_reused));
+	for (int i = 0; i < COUNT / 2; ++i) {
+		int c = coro_bus_channel_open(bus, 1);
+		unit_assert(c >= 0 && c < COUNT && c % 2 == 0);
+		unit_assert(!is_reused[c]);
+		is_reused[c] = true;
+	}
+	free(is_reused);
+	unit_assert(coro_bus_channel_open(bus, 1) == COUNT);
+
+#if NEED_BROADCAST
+	unit_msg("broadcast reaches only the open ones");
+	for (int i = 0; i <= COUNT; ++i) {
+		if (i != COUNT - 1)
+			coro_bus_channel_close(bus, i);
+	}
+	unit_assert(coro_bus_try_broadcast(bus, 7) == 0);
+	unit_assert(coro_bus_try_broadcast(bus, 8) != 0);
+	unit_assert(coro_bus_errno() == CORO_BUS_ERR_WOULD_BLOCK);
+	unsigned data = 0;
+	unit_assert(coro_bus_try_recv(bus, COUNT - 1, &data) == 0);
+	unit_assert(data == 7);
+	coro_bus_channel_close(bus, COUNT - 1);
+	unit_assert(coro_bus_try_broadcast(bus, 9) != 0);
+	unit_assert(coro_bus_errno() == CORO_BUS_ERR_NO_CHANNEL);
+#endif
+
+	coro_bus_delete(bus);
+	unit_test_finish();
+}
+
 ////////////////////////////////////////////////////////////////////////////////
 
 static void
@@ -737,6 +785,296 @@ test_wakeup_on_close(void)
 	unit_assert(coro_bus_errno() == CORO_BUS_ERR_NO_CHANNEL);
 	unit_assert(data2 == 654);
 
+	unit_msg("close and reopen before the woken ones run");
+	c1 = coro_bus_channel_open(bus, 1);
+	unit_assert(c1 >= 0);
+	unit_assert(coro_bus_send(bus, c1, 1) == 0);
+	send_start(&send_ctx1, bus, c1, 2);
+	send_start(&send_ctx2, bus, c1, 3);
+	coro_yield();
+	unit_assert(!send_ctx1.is_done && !send_ctx2.is_done);
+	coro_bus_channel_close(bus, c1);
+	int c2 = coro_bus_channel_open(bus, 1);
+	unit_assert(c2 == c1);
+	unit_assert(send_join(&send_ctx1) != 0);
+	unit_assert(coro_bus_errno() == CORO_BUS_ERR_NO_CHANNEL);
+	unit_assert(send_join(&send_ctx2) != 0);
+	unit_assert(coro_bus_errno() == CORO_BUS_ERR_NO_CHANNEL);
+	unit_assert(coro_bus_try_recv(bus, c2, &data1) != 0);
+	unit_assert(coro_bus_errno() == CORO_BUS_ERR_WOULD_BLOCK);
+	coro_bus_channel_close(bus, c2);
+
+	coro_bus_delete(bus);
+	unit_test_finish();
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+static void
+test_wakeup_count(void)
+{
+	unit_test_start();
+	struct coro_bus *bus = coro_bus_new();
+	int c1 = coro_bus_channel_open(bus, 3);
+	unit_assert(c1 >= 0);
+
+	unit_msg("start receivers");
+	unsigned data[3];
+	struct ctx_recv recv_ctx[3];
+	for (int i = 0; i < 3; ++i)
+		recv_start(&recv_ctx[i], bus, c1, &data[i]);
+	coro_yield();
+
+	unit_msg("each message wakes a separate receiver");
+	for (unsigned i = 0; i < 3; ++i)
+		unit_assert(coro_bus_try_send(bus, c1, i) == 0);
+	coro_yield();
+	for (int i = 0; i < 3; ++i) {
+		unit_assert(recv_ctx[i].is_done);
+		unit_assert(recv_join(&recv_ctx[i]) == 0);
+		unit_assert(data[i] == (unsigned)i);
+	}
+
+	unit_msg("close wakes everyone at once");
+	for (int i = 0; i < 3; ++i)
+		recv_start(&recv_ctx[i], bus, c1, &data[i]);
+	coro_yield();
+	coro_bus_channel_close(bus, c1);
+	coro_yield();
+	for (int i = 0; i < 3; ++i) {
+		unit_assert(recv_ctx[i].is_done);
+		unit_assert(recv_join(&recv_ctx[i]) != 0);
+		unit_assert(coro_bus_errno() == CORO_BUS_ERR_NO_CHANNEL);
+	}
+
+	coro_bus_delete(bus);
+	unit_test_finish();
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+struct ctx_select {
+	struct coro_bus *bus;
+	const struct coro_bus_select_op *ops;
+	int count;
+	int rc;
+	enum coro_bus_error_code err;
+	bool is_done;
+};
+
+static void *
+select_f(void *arg)
+{
+	struct ctx_select *ctx = arg;
+	ctx->rc = coro_bus_select(ctx->bus, ctx->ops, ctx->count);
+	ctx->err = coro_bus_errno();
+	ctx->is_done = true;
+	return NULL;
+}
+
+static void
+test_select(void)
+{
+	unit_test_start();
+	struct coro_bus *bus = coro_bus_new();
+	int c1 = coro_bus_channel_open(bus, 1);
+	int c2 = coro_bus_channel_open(bus, 1);
+	unit_assert(c1 >= 0 && c2 >= 0);
+	struct coro_bus_select_op ops[2] = {
+		{.channel = c1, .is_send = false},
+		{.channel = c2, .is_send = false},
+	};
+
+	unit_msg("nothing is ready");
+	unit_assert(coro_bus_try_select(bus, ops, 2) == -1);
+	unit_assert(coro_bus_errno() == CORO_BUS_ERR_WOULD_BLOCK);
+
+	unit_msg("wait for a message in any channel");
+	struct ctx_select ctx = {.bus = bus, .ops = ops, .count = 2};
+	struct coro *c = coro_new(select_f, &ctx);
+	coro_yield();
+	unit_assert(!ctx.is_done);
+	unit_assert(coro_bus_try_send(bus, c2, 5) == 0);
+	unit_assert(coro_join(c) == NULL);
+	unit_assert(ctx.rc == 1);
+
+	unit_msg("a wakeup of a stale entry goes to another waiter");
+	unsigned data = 0;
+	unit_assert(coro_bus_try_recv(bus, c2, &data) == 0 && data == 5);
+	ctx.is_done = false;
+	c = coro_new(select_f, &ctx);
+	struct ctx_recv recv_ctx;
+	recv_start(&recv_ctx, bus, c2, &data);
+	coro_yield();
+	unit_assert(!ctx.is_done);
+	/* The selector is woken by c1, its entry in c2 is stale. */
+	unit_assert(coro_bus_try_send(bus, c1, 6) == 0);
+	unit_assert(coro_bus_try_send(bus, c2, 7) == 0);
+	unit_assert(coro_join(c) == NULL);
+	unit_assert(ctx.rc == 0);
+	unit_assert(recv_join(&recv_ctx) == 0 && data == 7);
+	unit_assert(coro_bus_try_recv(bus, c1, &data) == 0 && data == 6);
+
+	unit_msg("wait for a free slot");
+	unit_assert(coro_bus_try_send(bus, c1, 1) == 0);
+	struct coro_bus_select_op send_op = {.channel = c1, .is_send = true};
+	ctx.ops = &send_op;
+	ctx.count = 1;
+	ctx.is_done = false;
+	c = coro_new(select_f, &ctx);
+	coro_yield();
+	unit_assert(!ctx.is_done);
+	unit_assert(coro_bus_try_recv(bus, c1, &data) == 0);
+	unit_assert(coro_join(c) == NULL);
+	unit_assert(ctx.rc == 0);
+
+	unit_msg("all are ready, none starves");
+	unit_assert(coro_bus_try_send(bus, c1, 1) == 0);
+	unit_assert(coro_bus_try_send(bus, c2, 2) == 0);
+	bool is_seen[2] = {false, false};
+	for (int i = 0; i < 2; ++i) {
+		int rc = coro_bus_select(bus, ops, 2);
+		unit_assert(rc >= 0 && rc < 2);
+		is_seen[rc] = true;
+	}
+	unit_assert(is_seen[0] && is_seen[1]);
+
+	unit_msg("close wakes the selector");
+	unit_assert(coro_bus_try_recv(bus, c1, &data) == 0);
+	unit_assert(coro_bus_try_recv(bus, c2, &data) == 0);
+	ctx.ops = ops;
+	ctx.count = 2;
+	ctx.is_done = false;
+	c = coro_new(select_f, &ctx);
+	coro_yield();
+	coro_bus_channel_close(bus, c2);
+	unit_assert(coro_join(c) == NULL);
+	unit_assert(ctx.rc == -1 && ctx.err == CORO_BUS_ERR_NO_CHANNEL);
+
+	unit_msg("the selector doesn't see a channel reopened after close");
+	ctx.is_done = false;
+	c2 = coro_bus_channel_open(bus, 1);
+	unit_assert(c2 == ops[1].channel);
+	c = coro_new(select_f, &ctx);
+	coro_yield();
+	coro_bus_channel_close(bus, c2);
+	unit_assert(coro_bus_channel_open(bus, 1) == c2);
+	unit_assert(coro_bus_try_send(bus, c2, 8) == 0);
+	unit_assert(coro_join(c) == NULL);
+	unit_assert(ctx.rc == -1 && ctx.err == CORO_BUS_ERR_NO_CHANNEL);
+
+	coro_bus_channel_close(bus, c2);
+	coro_bus_channel_close(bus, c1);
+	coro_bus_delete(bus);
+	unit_test_finish();
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+static void
+test_cancel_on_recv(void)
+{
+	unit_test_start();
+	struct coro_bus *bus = coro_bus_new();
+	int c1 = coro_bus_channel_open(bus, 3);
+	unit_assert(c1 >= 0);
+
+	unit_msg("cancel a blocked receiver");
+	unsigned data = 987;
+	struct ctx_recv recv_ctx;
+	recv_start(&recv_ctx, bus, c1, &data);
+	coro_yield();
+	unit_assert(recv_ctx.is_started && !recv_ctx.is_done);
+	coro_cancel(recv_ctx.worker);
+	unit_assert(recv_join(&recv_ctx) != 0);
+	unit_assert(coro_bus_errno() == CORO_BUS_ERR_CANCELLED);
+	unit_assert(data == 987);
+
+	unit_msg("the channel still works");
+	unit_assert(coro_bus_send(bus, c1, 123) == 0);
+	unit_assert(coro_bus_recv(bus, c1, &data) == 0);
+	unit_assert(data == 123);
+
+	coro_bus_channel_close(bus, c1);
+	coro_bus_delete(bus);
+	unit_test_finish();
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+struct test_record {
+	unsigned id;
+	char payload[100];
+};
+
+static void
+test_typed_channel(void)
+{
+	unit_test_start();
+	struct coro_bus *bus = coro_bus_new();
+	int c1 = coro_bus_channel_open_typed(bus, 3, sizeof(struct test_record));
+	unit_assert(c1 >= 0);
+
+	unit_msg("copy the records through the channel, with wrap around");
+	struct test_record rec;
+	for (unsigned i = 0; i < 10; ++i) {
+		rec.id = i;
+		memset(rec.payload, 'a' + i, sizeof(rec.payload));
+		unit_assert(coro_bus_send_elem(bus, c1, &rec, sizeof(rec)) == 0);
+		memset(&rec, 0, sizeof(rec));
+		unit_assert(coro_bus_recv_elem(bus, c1, &rec, sizeof(rec)) == 0);
+		unit_assert(rec.id == i && rec.payload[99] == (char)('a' + i));
+	}
+
+	unit_msg("sizes must match");
+	unit_assert(coro_bus_try_send(bus, c1, 123) != 0);
+	unit_assert(coro_bus_errno() == CORO_BUS_ERR_WRONG_SIZE);
+	unit_assert(coro_bus_try_recv_elem(bus, c1, &rec, 1) != 0);
+	unit_assert(coro_bus_errno() == CORO_BUS_ERR_WRONG_SIZE);
+
+	unit_msg("sizes of a channel are checked");
+	unit_assert(coro_bus_channel_open(bus, 0) < 0);
+	unit_assert(coro_bus_errno() == CORO_BUS_ERR_WRONG_SIZE);
+	unit_assert(coro_bus_channel_open_typed(bus, 3, 0) < 0);
+	unit_assert(coro_bus_errno() == CORO_BUS_ERR_WRONG_SIZE);
+	unit_assert(coro_bus_channel_open(bus, SIZE_MAX) < 0);
+	unit_assert(coro_bus_errno() == CORO_BUS_ERR_WRONG_SIZE);
+	unit_assert(coro_bus_channel_open_typed(bus, SIZE_MAX / 4,
+						sizeof(rec)) < 0);
+	unit_assert(coro_bus_errno() == CORO_BUS_ERR_WRONG_SIZE);
+
+	unit_msg("fill in place");
+	struct test_record *slot = coro_bus_send_reserve(bus, c1);
+	unit_assert(slot != NULL);
+	slot->id = 7;
+	unit_msg("not visible until commit, and locks the other senders");
+	unit_assert(coro_bus_try_recv_elem(bus, c1, &rec, sizeof(rec)) != 0);
+	unit_assert(coro_bus_errno() == CORO_BUS_ERR_WOULD_BLOCK);
+	unit_assert(coro_bus_try_send_reserve(bus, c1) == NULL);
+	unit_assert(coro_bus_errno() == CORO_BUS_ERR_WOULD_BLOCK);
+	unit_assert(coro_bus_send_commit(bus, c1) == 0);
+
+	unit_msg("read in place");
+	const struct test_record *msg = coro_bus_recv_peek(bus, c1);
+	unit_assert(msg != NULL && msg->id == 7);
+	unit_assert(coro_bus_try_recv_peek(bus, c1) == NULL);
+	unit_assert(coro_bus_errno() == CORO_BUS_ERR_WOULD_BLOCK);
+	unit_assert(coro_bus_recv_consume(bus, c1) == 0);
+	unit_assert(coro_bus_try_recv_peek(bus, c1) == NULL);
+	unit_assert(coro_bus_errno() == CORO_BUS_ERR_WOULD_BLOCK);
+
+#if NEED_BROADCAST
+	unit_msg("broadcast skips the typed channels");
+	int c2 = coro_bus_channel_open(bus, 1);
+	unit_assert(c2 >= 0);
+	unit_assert(coro_bus_try_broadcast(bus, 5) == 0);
+	unsigned data = 0;
+	unit_assert(coro_bus_try_recv(bus, c2, &data) == 0 && data == 5);
+	unit_assert(coro_bus_try_recv_elem(bus, c1, &rec, sizeof(rec)) != 0);
+
+	coro_bus_channel_close(bus, c2);
+#endif
+	coro_bus_channel_close(bus, c1);
 	coro_bus_delete(bus);
 	unit_test_finish();
 }
@@ -1014,6 +1352,79 @@ test_broadcast_blocking_drop_channel_during_wait(void)
 #endif
 }
 
+static void
+test_broadcast_overflow(void)
+{
+#if NEED_BROADCAST
+	unit_test_start();
+	struct coro_bus *bus = coro_bus_new();
+
+	unit_msg("a policy needs a channel of unsigned");
+	unit_assert(coro_bus_channel_set_overflow(bus, 0,
+		CORO_BUS_OVERFLOW_DROP_OLDEST) != 0);
+	unit_assert(coro_bus_errno() == CORO_BUS_ERR_NO_CHANNEL);
+	int typed = coro_bus_channel_open_typed(bus, 2, 8);
+	unit_assert(coro_bus_channel_set_overflow(bus, typed,
+		CORO_BUS_OVERFLOW_DROP_OLDEST) != 0);
+	unit_assert(coro_bus_errno() == CORO_BUS_ERR_WRONG_SIZE);
+	coro_bus_channel_close(bus, typed);
+
+	unit_msg("a blocking channel and the dropping ones");
+	int blocking = coro_bus_channel_open(bus, 3);
+	int oldest = coro_bus_channel_open(bus, 2);
+	unit_assert(coro_bus_channel_set_overflow(bus, oldest,
+		CORO_BUS_OVERFLOW_DROP_OLDEST) == 0);
+	int newest = coro_bus_channel_open(bus, 2);
+	unit_assert(coro_bus_channel_set_overflow(bus, newest,
+		CORO_BUS_OVERFLOW_DROP_NEWEST) == 0);
+
+	unit_msg("the blocking one limits the batch");
+	unsigned data4[4] = {1, 2, 3, 4};
+	unit_assert(coro_bus_try_broadcast_v(bus, data4, 4) == 3);
+	unit_assert(coro_bus_try_broadcast(bus, 5) != 0);
+	unit_assert(coro_bus_errno() == CORO_BUS_ERR_WOULD_BLOCK);
+	unsigned data3[3];
+	unit_assert(coro_bus_try_recv_v(bus, blocking, data3, 3) == 3);
+	unit_assert(data3[0] == 1 && data3[1] == 2 && data3[2] == 3);
+
+	unit_msg("the full ones drop by their policies");
+	unsigned data5[5] = {5, 6, 7, 8, 9};
+	unit_assert(coro_bus_try_broadcast_v(bus, data5, 5) == 3);
+	unit_assert(coro_bus_try_recv_v(bus, blocking, data3, 3) == 3);
+	unit_assert(data3[0] == 5 && data3[1] == 6 && data3[2] == 7);
+	unit_assert(coro_bus_try_recv_v(bus, oldest, data3, 3) == 2);
+	unit_assert(data3[0] == 6 && data3[1] == 7);
+	unit_assert(coro_bus_try_recv_v(bus, newest, data3, 3) == 2);
+	unit_assert(data3[0] == 1 && data3[1] == 2);
+
+	unit_msg("a peeked message is not dropped");
+	unit_assert(coro_bus_try_broadcast_v(bus, data4, 2) == 2);
+	const unsigned *peeked = coro_bus_try_recv_peek(bus, oldest);
+	unit_assert(peeked != NULL && *peeked == 1);
+	unit_assert(coro_bus_try_broadcast(bus, 3) == 0);
+	unit_assert(*peeked == 1);
+	coro_bus_recv_consume(bus, oldest);
+	unsigned data = 0;
+	unit_assert(coro_bus_try_recv(bus, oldest, &data) == 0 && data == 2);
+	unit_assert(coro_bus_try_recv_v(bus, blocking, data3, 3) == 3);
+	unit_assert(coro_bus_try_recv_v(bus, newest, data3, 3) == 2);
+
+	unit_msg("only the dropping channels never block");
+	coro_bus_channel_close(bus, blocking);
+	for (unsigned i = 0; i < 10; ++i)
+		unit_assert(coro_bus_broadcast(bus, i) == 0);
+	unit_assert(coro_bus_try_recv_v(bus, oldest, data3, 3) == 2);
+	unit_assert(data3[0] == 8 && data3[1] == 9);
+	unit_assert(coro_bus_try_recv_v(bus, newest, data3, 3) == 2);
+	unit_assert(data3[0] == 0 && data3[1] == 1);
+
+	coro_bus_channel_close(bus, oldest);
+	coro_bus_channel_close(bus, newest);
+	coro_bus_delete(bus);
+	unit_test_finish();
+#endif
+}
+
 ////////////////////////////////////////////////////////////////////////////////
 
 static void
@@ -1603,12 +2014,154 @@ test_recv_vector_blocking_recv_many(void)
 
 ////////////////////////////////////////////////////////////////////////////////
 
+enum {
+	MT_PRODUCER_COUNT = 4,
+	MT_CONSUMER_COUNT = 4,
+	MT_MSG_PER_PRODUCER = 20000,
+	MT_MSG_COUNT = MT_PRODUCER_COUNT * MT_MSG_PER_PRODUCER,
+};
+
+static struct coro_bus_mt *mt_bus = NULL;
+static int mt_channel = -1;
+static unsigned char mt_is_seen[MT_MSG_COUNT];
+static int mt_error_count = 0;
+static bool mt_is_thread_done = false;
+
+static void *
+mt_producer_f(void *arg)
+{
+	unsigned first = (unsigned)(long)arg * MT_MSG_PER_PRODUCER;
+	for (unsigned i = 0; i < MT_MSG_PER_PRODUCER; ++i) {
+		if (coro_bus_mt_send(mt_bus, mt_channel, first + i) != 0)
+			__atomic_add_fetch(&mt_error_count, 1, __ATOMIC_RELAXED);
+	}
+	return NULL;
+}
+
+static void *
+mt_consumer_f(void *arg)
+{
+	(void)arg;
+	for (int i = 0; i < MT_MSG_COUNT / MT_CONSUMER_COUNT; ++i) {
+		unsigned data;
+		if (coro_bus_mt_recv(mt_bus, mt_channel, &data) != 0 ||
+		    data >= MT_MSG_COUNT ||
+		    __atomic_exchange_n(&mt_is_seen[data], 1, __ATOMIC_RELAXED))
+			__atomic_add_fetch(&mt_error_count, 1, __ATOMIC_RELAXED);
+	}
+	return NULL;
+}
+
+static void *
+mt_thread_f(void *arg)
+{
+	mt_producer_f(arg);
+	__atomic_store_n(&mt_is_thread_done, true, __ATOMIC_RELEASE);
+	return NULL;
+}
+
+/**
+ * The scheduler stops when all its coroutines are suspended, but
+ * the thread can still wake them up.
+ */
+static void *
+mt_keeper_f(void *arg)
+{
+	(void)arg;
+	while (!__atomic_load_n(&mt_is_thread_done, __ATOMIC_ACQUIRE))
+		coro_yield();
+	return NULL;
+}
+
+static void *
+mt_recv_f(void *arg)
+{
+	(void)arg;
+	unsigned data;
+	if (coro_bus_mt_recv(mt_bus, mt_channel, &data) == 0)
+		return (void *)1;
+	return (void *)(long)coro_bus_errno();
+}
+
+static void
+test_mt_bus(void)
+{
+	unit_test_start();
+	mt_bus = coro_bus_mt_new(2);
+	mt_channel = coro_bus_mt_channel_open(mt_bus, 16);
+	unit_assert(mt_channel >= 0);
+
+	unit_msg("coroutines in many threads and a plain thread");
+	struct coro *coros[MT_PRODUCER_COUNT + MT_CONSUMER_COUNT];
+	/* The last producer is a plain thread, it waits on a futex. */
+	pthread_t thread;
+	unit_assert(pthread_create(&thread, NULL, mt_thread_f,
+		(void *)(long)(MT_PRODUCER_COUNT - 1)) == 0);
+	struct coro *keeper = coro_new(mt_keeper_f, NULL);
+	for (long i = 0; i < MT_PRODUCER_COUNT - 1; ++i)
+		coros[i] = coro_new(mt_producer_f, (void *)i);
+	for (int i = 0; i < MT_CONSUMER_COUNT; ++i)
+		coros[MT_PRODUCER_COUNT + i] = coro_new(mt_consumer_f, NULL);
+	coro_sched_run_threads(4);
+	unit_assert(pthread_join(thread, NULL) == 0);
+	coro_join(keeper);
+	for (int i = 0; i < MT_PRODUCER_COUNT + MT_CONSUMER_COUNT; ++i) {
+		if (i != MT_PRODUCER_COUNT - 1)
+			coro_join(coros[i]);
+	}
+	unit_check(mt_error_count == 0, "no errors");
+	bool is_all_seen = true;
+	for (int i = 0; i < MT_MSG_COUNT; ++i)
+		is_all_seen = is_all_seen && mt_is_seen[i];
+	unit_check(is_all_seen, "all messages are received once");
+	unsigned data;
+	unit_assert(coro_bus_mt_try_recv(mt_bus, mt_channel, &data) != 0);
+	unit_assert(coro_bus_errno() == CORO_BUS_ERR_WOULD_BLOCK);
+
+	unit_msg("close wakes a receiver in another thread");
+	struct coro *c = coro_new(mt_recv_f, NULL);
+	coro_sched_run_threads(2);
+	coro_bus_mt_channel_close(mt_bus, mt_channel);
+	coro_sched_run_threads(2);
+	unit_check(coro_join(c) == (void *)CORO_BUS_ERR_NO_CHANNEL,
+		   "receiver gets an error");
+
+	unit_msg("the channel count is limited");
+	int small = coro_bus_mt_channel_open(mt_bus, 1);
+	unit_assert(small >= 0);
+	unit_assert(coro_bus_mt_channel_open(mt_bus, 1) < 0);
+	unit_assert(coro_bus_errno() == CORO_BUS_ERR_NO_CHANNEL);
+
+	unit_msg("a channel of one message");
+	bool is_ok = true;
+	for (unsigned i = 0; i < 3; ++i) {
+		is_ok = is_ok &&
+			coro_bus_mt_try_send(mt_bus, small, 100 + i) == 0;
+		is_ok = is_ok &&
+			coro_bus_mt_try_send(mt_bus, small, 200) != 0 &&
+			coro_bus_errno() == CORO_BUS_ERR_WOULD_BLOCK;
+		is_ok = is_ok &&
+			coro_bus_mt_try_recv(mt_bus, small, &data) == 0 &&
+			data == 100 + i;
+		is_ok = is_ok &&
+			coro_bus_mt_try_recv(mt_bus, small, &data) != 0 &&
+			coro_bus_errno() == CORO_BUS_ERR_WOULD_BLOCK;
+	}
+	unit_check(is_ok, "holds one message, no overwrites");
+
+	coro_bus_mt_delete(mt_bus);
+	unit_test_finish();
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
 static void *
 coro_main_f(void *arg)
 {
 	(void)arg;
 	test_basic();
 	test_channel_reopen();
+	test_channel_many();
 	test_multiple_channels();
 
 	test_send_basic();
@@ -1622,11 +2175,16 @@ coro_main_f(void *arg)
 	test_stress_send_recv_concurrent();
 	test_send_recv_very_many();
 	test_wakeup_on_close();
+	test_wakeup_count();
+	test_cancel_on_recv();
+	test_select();
+	test_typed_channel();
 	test_close_non_empty_bus();
 
 	test_broadcast_basic();
 	test_broadcast_blocking_basic();
 	test_broadcast_blocking_drop_channel_during_wait();
+	test_broadcast_overflow();
 
 	test_send_vector_basic();
 	test_send_vector_blocking();
@@ -1657,6 +2215,7 @@ main(int argc, char **argv)
 	coro_sched_run();
 	void *rc = coro_join(main_coro);
 	unit_check(rc == NULL, "main coro rc");
+	test_mt_bus();
 	coro_sched_destroy();
 	return 0;
 }
@@ -0,0 +1,203 @@
+#include "exe_cache.h"
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+struct exe_cache_entry {
+	struct exe_cache_entry *next;
+	uint32_t hash;
+	uint32_t hits;
+	/** The end of the path, after the dir. */
+	const char *name;
+	char path[];
+};
+
+/** Chained buckets, a power of 2 of them. */
+static struct exe_cache_entry **exe_cache_buckets = NULL;
+static uint32_t exe_cache_bucket_count = 0;
+static uint32_t exe_cache_count = 0;
+/** The PATH the exes were found in. */
+static char *exe_cache_path_env = NULL;
+/** The paths being checked and the ones which can't be cached. */
+static char exe_cache_buf[4096];
+
+static uint32_t exe_cache_hash(const char *name)
+{
+	/* FNV-1a. */
+	uint32_t hash = 2166136261u;
+	for (; *name != 0; ++name) {
+		hash ^= (uint8_t)*name;
+		hash *= 16777619u;
+	}
+	return hash;
+}
+
+/** The link to the entry of the name or to where it would be. */
+static struct exe_cache_entry **exe_cache_lookup(const char *name, uint32_t hash)
+{
+	if (exe_cache_bucket_count == 0)
+		return NULL;
+	struct exe_cache_entry **link =
+		&exe_cache_buckets[hash & (exe_cache_bucket_count - 1)];
+	while (*link != NULL &&
+	       ((*link)->hash != hash || strcmp((*link)->name, name) != 0))
+		link = &(*link)->next;
+	return link;
+}
+
+static void exe_cache_grow(void)
+{
+	uint32_t count = exe_cache_bucket_count == 0 ? 16 : exe_cache_bucket_count * 2;
+	struct exe_cache_entry **buckets = calloc(count, sizeof(*buckets));
+	if (buckets == NULL)
+		return;
+	for (uint32_t i = 0; i < exe_cache_bucket_count; ++i) {
+		struct exe_cache_entry *e = exe_cache_buckets[i];
+		while (e != NULL) {
+			struct exe_cache_entry *next = e->next;
+			uint32_t b = e->hash & (count - 1);
+			e->next = buckets[b];
+			buckets[b] = e;
+			e = next;
+		}
+	}
+	free(exe_cache_buckets);
+	exe_cache_buckets = buckets;
+	exe_cache_bucket_count = count;
+}
+
+static void exe_cache_add(const char *path, uint32_t dir_len, uint32_t hash)
+{
+	if (exe_cache_count >= exe_cache_bucket_count)
+		exe_cache_grow();
+	if (exe_cache_bucket_count == 0)
+		return;
+	size_t len = strlen(path);
+	struct exe_cache_entry *e = malloc(sizeof(*e) + len + 1);
+	if (e == NULL)
+		return;
+	memcpy(e->path, path, len + 1);
+	e->name = e->path + dir_len + 1;
+	e->hash = hash;
+	e->hits = 1;
+	struct exe_cache_entry **bucket =
+		&exe_cache_buckets[hash & (exe_cache_bucket_count - 1)];
+	e->next = *bucket;
+	*bucket = e;
+	++exe_cache_count;
+}
+
+/**
+ * A regular file which can be exec-ed. access() alone is fine with
+ * dirs too, execvp() would skip them and search further.
+ */
+static bool exe_cache_is_exe(const char *path)
+{
+	struct stat st;
+	return stat(path, &st) == 0 && S_ISREG(st.st_mode) &&
+	       access(path, X_OK) == 0;
+}
+
+/** Search the dirs of PATH, like execvp() would do. */
+static const char *exe_cache_search(const char *path_env, const char *name, uint32_t hash)
+{
+	size_t name_len = strlen(name);
+	const char *dir = path_env;
+	while (true) {
+		const char *end = strchr(dir, ':');
+		if (end == NULL)
+			end = dir + strlen(dir);
+		size_t dir_len = end - dir;
+		if (dir_len != 0 && dir_len + name_len + 2 <= sizeof(exe_cache_buf)) {
+			memcpy(exe_cache_buf, dir, dir_len);
+			exe_cache_buf[dir_len] = '/';
+			memcpy(exe_cache_buf + dir_len + 1, name, name_len + 1);
+			if (exe_cache_is_exe(exe_cache_buf)) {
+				/* A relative dir depends on the current one. */
+				if (dir[0] == '/')
+					exe_cache_add(exe_cache_buf, dir_len, hash);
+				return exe_cache_buf;
+			}
+		}
+		if (*end == 0)
+			return NULL;
+		dir = end + 1;
+	}
+}
+
+const char *exe_cache_find(const char *name)
+{
+	if (strchr(name, '/') != NULL)
+		return exe_cache_is_exe(name) ? name : NULL;
+	if (*name == 0)
+		return NULL;
+	const char *path_env = getenv("PATH");
+	if (path_env == NULL)
+		return NULL;
+	if (exe_cache_path_env == NULL ||
+	    strcmp(exe_cache_path_env, path_env) != 0) {
+		exe_cache_clear();
+		free(exe_cache_path_env);
+		exe_cache_path_env = strdup(path_env);
+	}
+	uint32_t hash = exe_cache_hash(name);
+	struct exe_cache_entry **link = exe_cache_lookup(name, hash);
+	if (link != NULL && *link != NULL) {
+		++(*link)->hits;
+		return (*link)->path;
+	}
+	return exe_cache_search(path_env, name, hash);
+}
+
+void exe_cache_forget(const char *name)
+{
+	struct exe_cache_entry **link = exe_cache_lookup(name, exe_cache_hash(name));
+	if (link == NULL || *link == NULL)
+		return;
+	struct exe_cache_entry *e = *link;
+	*link = e->next;
+	free(e);
+	--exe_cache_count;
+}
+
+void exe_cache_clear(void)
+{
+	for (uint32_t i = 0; i < exe_cache_bucket_count; ++i) {
+		struct exe_cache_entry *e = exe_cache_buckets[i];
+		while (e != NULL) {
+			struct exe_cache_entry *next = e->next;
+			free(e);
+			e = next;
+		}
+		exe_cache_buckets[i] = NULL;
+	}
+	exe_cache_count = 0;
+}
+
+void exe_cache_print(FILE *out)
+{
+	if (exe_cache_count == 0) {
+		fprintf(out, "hash: hash table empty\n");
+		return;
+	}
+	fprintf(out, "hits\tcommand\n");
+	for (uint32_t i = 0; i < exe_cache_bucket_count; ++i) {
+		for (struct exe_cache_entry *e = exe_cache_buckets[i]; e != NULL;
+		     e = e->next)
+			fprintf(out, "%4u\t%s\n", e->hits, e->path);
+	}
+}
+
+void exe_cache_destroy(void)
+{
+	exe_cache_clear();
+	free(exe_cache_buckets);
+	exe_cache_buckets = NULL;
+	exe_cache_bucket_count = 0;
+	free(exe_cache_path_env);
+	exe_cache_path_env = NULL;
+}
@@ -0,0 +1,30 @@
+#pragma once
+
+#include <stdio.h>
+
+/**
+ * The exes found in PATH, by their names, like the `hash` of bash.
+ * So the same commands don't search PATH again and again. All of it
+ * is forgotten when PATH changes.
+ */
+
+/**
+ * Find an exe. A name with a slash is a path already and is only
+ * checked, not cached.
+ *
+ * @retval Path to exec. Valid till the next call.
+ * @retval NULL Not found.
+ */
+const char *exe_cache_find(const char *name);
+
+/** Forget an exe, for example because it couldn't be started. */
+void exe_cache_forget(const char *name);
+
+/** Forget all the exes, `hash -r`. */
+void exe_cache_clear(void);
+
+/** Print the exes and how many times each was found, `hash`. */
+void exe_cache_print(FILE *out);
+
+/** Free the memory. The cache can be used after it again. */
+void exe_cache_destroy(void);
@@ -0,0 +1,114 @@
+#include "launcher.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#if LAUNCHER_MODE == LAUNCHER_MODE_SPAWN
+#include <spawn.h>
+
+extern char **environ;
+#endif
+
+/** The exe and the args, NULL-terminated, like exec wants them. */
+static char **launch_argv_new(const struct command *cmd)
+{
+	char **argv = malloc(sizeof(*argv) * (cmd->arg_count + 2));
+	if (argv == NULL)
+		return NULL;
+	argv[0] = cmd->exe;
+	for (uint32_t i = 0; i < cmd->arg_count; ++i)
+		argv[i + 1] = cmd->args[i];
+	argv[cmd->arg_count + 1] = NULL;
+	return argv;
+}
+
+/**
+ * The output file is opened by the shell, so its errors are not
+ * mixed with the exec ones. It is close-on-exec, only its dup2-ed
+ * copy gets into the process.
+ */
+static enum launch_error launch_open_out(const struct launch *l, int *out_fd)
+{
+	*out_fd = l->out_fd;
+	if (l->out_fd >= 0 || l->out_file == NULL)
+		return LAUNCH_ERR_NONE;
+	int flags = O_WRONLY | O_CREAT | O_CLOEXEC |
+		    (l->is_append ? O_APPEND : O_TRUNC);
+	*out_fd = open(l->out_file, flags, 0666);
+	return *out_fd >= 0 ? LAUNCH_ERR_NONE : LAUNCH_ERR_OUT_FILE;
+}
+
+#if LAUNCHER_MODE == LAUNCHER_MODE_SPAWN
+
+/**
+ * The dup2s and the opens are done by the child as file actions.
+ * glibc starts it with clone(CLONE_VM | CLONE_VFORK), so nothing is
+ * copied, and reports the exec errors back.
+ */
+static enum launch_error launch_process(const struct launch *l, char **argv, int out_fd,
+					pid_t *pid)
+{
+	posix_spawn_file_actions_t actions;
+	posix_spawn_file_actions_init(&actions);
+	if (l->in_fd >= 0 && l->in_fd != STDIN_FILENO)
+		posix_spawn_file_actions_adddup2(&actions, l->in_fd, STDIN_FILENO);
+	if (out_fd >= 0 && out_fd != STDOUT_FILENO)
+		posix_spawn_file_actions_adddup2(&actions, out_fd, STDOUT_FILENO);
+	posix_spawn_file_actions_addopen(&actions, STDERR_FILENO, "/dev/null",
+					 O_WRONLY, 0);
+	int rc = posix_spawn(pid, l->path, &actions, NULL, argv, environ);
+	posix_spawn_file_actions_destroy(&actions);
+	if (rc == 0)
+		return LAUNCH_ERR_NONE;
+	if (rc == ENOENT || rc == EACCES || rc == ENOEXEC)
+		return LAUNCH_ERR_EXEC;
+	return LAUNCH_ERR_SYSTEM;
+}
+
+#else
+
+static enum launch_error launch_process(const struct launch *l, char **argv, int out_fd,
+					pid_t *pid)
+{
+	*pid = fork();
+	if (*pid < 0)
+		return LAUNCH_ERR_SYSTEM;
+	if (*pid > 0)
+		return LAUNCH_ERR_NONE;
+	if (l->in_fd >= 0 && l->in_fd != STDIN_FILENO)
+		dup2(l->in_fd, STDIN_FILENO);
+	if (out_fd >= 0 && out_fd != STDOUT_FILENO)
+		dup2(out_fd, STDOUT_FILENO);
+	int devnull = open("/dev/null", O_WRONLY);
+	if (devnull >= 0) {
+		dup2(devnull, STDERR_FILENO);
+		close(devnull);
+	}
+	execv(l->path, argv);
+	_exit(1);
+}
+
+#endif
+
+enum launch_error launch_start(const struct launch *l, pid_t *pid)
+{
+	*pid = -1;
+	int out_fd;
+	enum launch_error err = launch_open_out(l, &out_fd);
+	if (err != LAUNCH_ERR_NONE)
+		return err;
+	char **argv = NULL;
+	if (l->path == NULL) {
+		err = LAUNCH_ERR_EXEC;
+	} else if ((argv = launch_argv_new(l->cmd)) == NULL) {
+		err = LAUNCH_ERR_SYSTEM;
+	} else {
+		err = launch_process(l, argv, out_fd, pid);
+		free(argv);
+	}
+	if (out_fd != l->out_fd)
+		close(out_fd);
+	return err;
+}
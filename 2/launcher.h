@@ -0,0 +1,66 @@
+#pragma once
+
+#include "parser.h"
+
+#include <stdbool.h>
+#include <sys/types.h>
+
+/**
+ * How the processes of the commands are started, selected via
+ * -DLAUNCHER_MODE=<mode>.
+ *
+ * - FORK - fork() and exec. Copies the page tables of the shell, so
+ *   the cost grows with its memory.
+ * - SPAWN - posix_spawn(). The child shares the memory of the shell
+ *   till the exec, like with vfork(), so the cost is flat.
+ */
+#define LAUNCHER_MODE_FORK 0
+#define LAUNCHER_MODE_SPAWN 1
+
+#ifndef LAUNCHER_MODE
+#define LAUNCHER_MODE LAUNCHER_MODE_SPAWN
+#endif
+
+enum launch_error {
+	LAUNCH_ERR_NONE,
+	/** The exe is not found or couldn't be exec-ed. */
+	LAUNCH_ERR_EXEC,
+	/** The output file couldn't be opened. */
+	LAUNCH_ERR_OUT_FILE,
+	/** No memory, too many processes, and alike. */
+	LAUNCH_ERR_SYSTEM,
+};
+
+/** A process to start for a command. */
+struct launch {
+	const struct command *cmd;
+	/**
+	 * The exe, exec-ed as is, without a search in PATH. NULL - it
+	 * is not found.
+	 */
+	const char *path;
+	/** To become the stdin and stdout. -1 - keep the shell's ones. */
+	int in_fd;
+	int out_fd;
+	/** To open as the stdout when out_fd is -1. NULL - none. */
+	const char *out_file;
+	bool is_append;
+};
+
+/**
+ * Start a process for a command. Its stderr goes to /dev/null.
+ * The descriptors of the shell are inherited, so the ones the
+ * process must not get, like the other ends of the pipes, have to
+ * be close-on-exec.
+ *
+ * The output file is opened first, so it is created even when the
+ * exe is not found, like a shell does the redirects before the exec.
+ * With FORK the exec errors are seen only later, as the exit status
+ * 1 of the process.
+ *
+ * @param l What to start.
+ * @param[out] pid Pid of the process, -1 on an error.
+ *
+ * @return The error, LAUNCH_ERR_NONE if started.
+ */
+enum launch_error launch_start(const struct launch *l, pid_t *pid);
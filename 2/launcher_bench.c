@@ -0,0 +1,93 @@
+#include "exe_cache.h"
+#include "launcher.h"
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/wait.h>
+#include <time.h>
+
+/**
+ * Latency of starting and waiting for a command, 10k of `true`,
+ * when the shell's memory is small and when it is big. With fork()
+ * it grows with the memory, with posix_spawn() it should stay flat.
+ * See the Makefile's bench_launcher target.
+ */
+
+#if LAUNCHER_MODE == LAUNCHER_MODE_SPAWN
+#define BENCH_MODE_NAME "spawn"
+#else
+#define BENCH_MODE_NAME "fork"
+#endif
+
+enum {
+	BENCH_COMMAND_COUNT = 10000,
+};
+
+static uint64_t
+bench_now_ns(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static int
+bench_cmp_u64(const void *a, const void *b)
+{
+	uint64_t l = *(const uint64_t *)a;
+	uint64_t r = *(const uint64_t *)b;
+	return l < r ? -1 : l > r;
+}
+
+static void
+bench_launch(size_t rss_mb)
+{
+	/* Touched, so the pages are really there for fork() to copy. */
+	size_t rss = rss_mb * 1024 * 1024;
+	char *mem = NULL;
+	if (rss != 0) {
+		mem = malloc(rss);
+		memset(mem, 1, rss);
+	}
+	static uint64_t samples[BENCH_COMMAND_COUNT];
+	char exe[] = "true";
+	struct command cmd = {.exe = exe};
+	struct launch l = {
+		.cmd = &cmd,
+		.path = exe_cache_find(exe),
+		.in_fd = -1,
+		.out_fd = -1,
+	};
+	uint64_t start = bench_now_ns();
+	for (int i = 0; i < BENCH_COMMAND_COUNT; ++i) {
+		uint64_t cmd_start = bench_now_ns();
+		pid_t pid;
+		if (launch_start(&l, &pid) != LAUNCH_ERR_NONE)
+			abort();
+		int status;
+		waitpid(pid, &status, 0);
+		if (!WIFEXITED(status) || WEXITSTATUS(status) != 0)
+			abort();
+		samples[i] = bench_now_ns() - cmd_start;
+	}
+	uint64_t duration = bench_now_ns() - start;
+	free(mem);
+	qsort(samples, BENCH_COMMAND_COUNT, sizeof(samples[0]), bench_cmp_u64);
+	printf("%s, rss %4zu MB: %.1f us/command, p50 %.1f us, p99 %.1f us\n",
+	       BENCH_MODE_NAME, rss_mb,
+	       (double)duration / BENCH_COMMAND_COUNT / 1000,
+	       (double)samples[BENCH_COMMAND_COUNT / 2] / 1000,
+	       (double)samples[BENCH_COMMAND_COUNT * 99 / 100] / 1000);
+}
+
+int
+main(void)
+{
+	static const size_t rss_mbs[] = {0, 64, 256};
+	for (size_t i = 0; i < sizeof(rss_mbs) / sizeof(rss_mbs[0]); ++i)
+		bench_launch(rss_mbs[i]);
+	exe_cache_destroy();
+	return 0;
+}
@@ -5,10 +5,62 @@
 #include <stdlib.h>
 #include <string.h>
 
+#if PARSER_SCAN == PARSER_SCAN_AVX2
+#include <immintrin.h>
+#elif PARSER_SCAN == PARSER_SCAN_SSE2
+#include <emmintrin.h>
+#endif
+
+/** What the tokenizer is in the middle of. */
+enum token_state {
+	/** Between the tokens. */
+	TOKEN_STATE_SPACE,
+	TOKEN_STATE_STR,
+	/** A backslash outside of quotes is read. */
+	TOKEN_STATE_ESCAPE,
+	/** A backslash in double quotes is read. */
+	TOKEN_STATE_QUOTED_ESCAPE,
+	/** One of &|> is read, might be doubled. */
+	TOKEN_STATE_OPERATOR,
+	TOKEN_STATE_COMMENT,
+};
+
+/** What the line expects next. */
+enum line_state {
+	LINE_STATE_EXPRS,
+	/** After > or >>. */
+	LINE_STATE_OUT_FILE,
+	/** After the output file. Only & or the line end can go. */
+	LINE_STATE_OUT_DONE,
+	/** After &. Only the line end can go. */
+	LINE_STATE_END,
+};
+
+/**
+ * The parser keeps its state between the calls, so each byte is
+ * scanned once, however it is fed. The strings are unescaped in
+ * place, right in the buffer, which is fine because they never
+ * get longer than their source.
+ */
 struct parser {
 	char *buffer;
 	uint32_t size;
 	uint32_t capacity;
+	/** Where the scan stopped. */
+	uint32_t pos;
+	/** The string being read, in the buffer. */
+	uint32_t token_begin;
+	uint32_t token_end;
+	enum token_state token_state;
+	/** The quote the string is in, or 0. */
+	char quote;
+	/** The operator char of TOKEN_STATE_OPERATOR. */
+	char op;
+	/** The line being built, NULL before its first token. */
+	struct command_line *line;
+	enum line_state line_state;
+	/** The line is broken and is skipped till its end. */
+	enum parser_error error;
 };
 
 enum token_type {
@@ -23,45 +75,84 @@ enum token_type {
 	TOKEN_TYPE_BACKGROUND,
 };
 
+/** A token. A string points into the parser's buffer. */
 struct token {
 	enum token_type type;
-	char *data;
+	const char *data;
 	uint32_t size;
-	uint32_t capacity;
 };
 
-static char* token_strdup(const struct token *t)
+enum {
+	/** The arena block allocated together with the line. */
+	LINE_ARENA_SIZE = 512,
+	/** Enough for the pointers and the exprs. */
+	LINE_ARENA_ALIGN = sizeof(void *),
+};
+
+/** An arena block, besides the one of the line itself. */
+struct line_arena_block {
+	struct line_arena_block *next;
+};
+
+static struct command_line *command_line_new(void)
 {
-	assert(t->type == TOKEN_TYPE_STR);
-	assert(t->size > 0);
-	char *res = malloc(t->size + 1);
-	memcpy(res, t->data, t->size);
-	res[t->size] = 0;
-	return res;
+	struct command_line *line = malloc(sizeof(*line) + LINE_ARENA_SIZE);
+	memset(line, 0, sizeof(*line));
+	line->arena.pos = (char *)(line + 1);
+	line->arena.end = line->arena.pos + LINE_ARENA_SIZE;
+	line->arena.block_size = LINE_ARENA_SIZE;
+	return line;
 }
 
-static void token_append(struct token *t, char c)
+static void *command_line_alloc(struct command_line *line, uint32_t size)
 {
-	if (t->size == t->capacity) {
-		t->capacity = (t->capacity + 1) * 2;
-		t->data = realloc(t->data, sizeof(*t->data) * t->capacity);
-	} else {
-		assert(t->size < t->capacity);
+	struct command_line_arena *arena = &line->arena;
+	size = (size + LINE_ARENA_ALIGN - 1) & ~(LINE_ARENA_ALIGN - 1);
+	if ((uint32_t)(arena->end - arena->pos) < size) {
+		/* Double the blocks, so a huge line has few of them. */
+		uint32_t block_size = arena->block_size * 2;
+		if (block_size < size)
+			block_size = size;
+		struct line_arena_block *block =
+			malloc(sizeof(*block) + block_size);
+		block->next = arena->blocks;
+		arena->blocks = block;
+		arena->pos = (char *)(block + 1);
+		arena->end = arena->pos + block_size;
+		arena->block_size = block_size;
 	}
-	t->data[t->size++] = c;
+	void *res = arena->pos;
+	arena->pos += size;
+	return res;
 }
 
-static void token_reset(struct token *t)
+static struct expr *command_line_new_expr(struct command_line *line, enum expr_type type)
 {
-	t->size = 0;
-	t->type = TOKEN_TYPE_NONE;
+	struct expr *e = command_line_alloc(line, sizeof(*e));
+	memset(e, 0, sizeof(*e));
+	e->type = type;
+	return e;
 }
 
-static void command_append_arg(struct command *cmd, char *arg)
+static char *command_line_strdup(struct command_line *line, const struct token *t)
+{
+	assert(t->type == TOKEN_TYPE_STR);
+	char *res = command_line_alloc(line, t->size + 1);
+	memcpy(res, t->data, t->size);
+	res[t->size] = 0;
+	return res;
+}
+
+static void command_append_arg(struct command_line *line, struct command *cmd, char *arg)
 {
 	if (cmd->arg_count == cmd->arg_capacity) {
-		cmd->arg_capacity = (cmd->arg_capacity + 1) * 2;
-		cmd->args = realloc(cmd->args, sizeof(*cmd->args) * cmd->arg_capacity);
+		/* The old array stays in the arena till the line is freed. */
+		uint32_t capacity = (cmd->arg_capacity + 1) * 2;
+		char **args = command_line_alloc(line, sizeof(*args) * capacity);
+		if (cmd->arg_count != 0)
+			memcpy(args, cmd->args, sizeof(*args) * cmd->arg_count);
+		cmd->args = args;
+		cmd->arg_capacity = capacity;
 	} else {
 		assert(cmd->arg_count < cmd->arg_capacity);
 	}
@@ -70,19 +161,12 @@ static void command_append_arg(struct command *cmd, char *arg)
 
 void command_line_delete(struct command_line *line)
 {
-	while (line->head != NULL) {
-		struct expr *e = line->head;
-		if (e->type == EXPR_TYPE_COMMAND) {
-			struct command *cmd = &e->cmd;
-			free(cmd->exe);
-			for (uint32_t i = 0; i < cmd->arg_count; ++i)
-				free(cmd->args[i]);
-			free(cmd->args);
-		}
-		line->head = e->next;
-		free(e);
+	struct line_arena_block *block = line->arena.blocks;
+	while (block != NULL) {
+		struct line_arena_block *next = block->next;
+		free(block);
+		block = next;
 	}
-	free(line->out_file);
 	free(line);
 }
 
@@ -100,9 +184,39 @@ struct parser *parser_new(void)
 	return calloc(1, sizeof(struct parser));
 }
 
+static bool parser_is_in_str(const struct parser *p)
+{
+	return p->token_state == TOKEN_STATE_STR ||
+	       p->token_state == TOKEN_STATE_ESCAPE ||
+	       p->token_state == TOKEN_STATE_QUOTED_ESCAPE;
+}
+
+/** Drop the parsed bytes from the buffer. */
+static void parser_compact(struct parser *p)
+{
+	uint32_t keep = parser_is_in_str(p) ? p->token_begin : p->pos;
+	memmove(p->buffer, p->buffer + keep, p->size - keep);
+	p->size -= keep;
+	p->pos -= keep;
+	if (parser_is_in_str(p)) {
+		p->token_begin -= keep;
+		p->token_end -= keep;
+	}
+}
+
 void parser_feed(struct parser *p, const char *str, uint32_t len)
 {
 	uint32_t cap = p->capacity - p->size;
+	if (cap < len) {
+		/*
+		 * Move the rest down only when it is not bigger than
+		 * what was parsed, so each byte is moved O(1) times.
+		 */
+		uint32_t parsed = parser_is_in_str(p) ? p->token_begin : p->pos;
+		if (parsed > 0 && parsed >= p->size - parsed)
+			parser_compact(p);
+	}
+	cap = p->capacity - p->size;
 	if (cap < len) {
 		uint32_t new_capacity = (p->capacity + 1) * 2;
 		if (new_capacity - p->size < len)
@@ -115,316 +229,396 @@ void parser_feed(struct parser *p, const char *str, uint32_t len)
 	assert(p->size <= p->capacity);
 }
 
-static void parser_consume(struct parser *p, uint32_t size)
+/** Bytes which end a run of plain ones in an unquoted string. */
+static const bool parser_is_special[256] = {
+	['\''] = true, ['"'] = true, ['\\'] = true, ['&'] = true,
+	['|'] = true, ['>'] = true, ['#'] = true, ['\n'] = true,
+	[' '] = true, ['\t'] = true, ['\r'] = true,
+};
+
+#if PARSER_SCAN == PARSER_SCAN_AVX2
+
+/**
+ * Mask of the bytes which might be special. All the ones up to
+ * the space are taken, it is cheaper than checking each of them.
+ * The tokenizer appends the wrongly taken ones as usual.
+ */
+static inline uint32_t scan_mask(__m256i v, char quote)
 {
-	assert(p->size >= size);
-	if (size == p->size) {
-		p->size = 0;
-		return;
+	__m256i m;
+	if (quote == 0) {
+		m = _mm256_cmpeq_epi8(_mm256_min_epu8(v, _mm256_set1_epi8(' ')), v);
+		m = _mm256_or_si256(m, _mm256_cmpeq_epi8(v, _mm256_set1_epi8('"')));
+		m = _mm256_or_si256(m, _mm256_cmpeq_epi8(v, _mm256_set1_epi8('#')));
+		m = _mm256_or_si256(m, _mm256_cmpeq_epi8(v, _mm256_set1_epi8('&')));
+		m = _mm256_or_si256(m, _mm256_cmpeq_epi8(v, _mm256_set1_epi8('\'')));
+		m = _mm256_or_si256(m, _mm256_cmpeq_epi8(v, _mm256_set1_epi8('>')));
+		m = _mm256_or_si256(m, _mm256_cmpeq_epi8(v, _mm256_set1_epi8('\\')));
+		m = _mm256_or_si256(m, _mm256_cmpeq_epi8(v, _mm256_set1_epi8('|')));
+	} else {
+		m = _mm256_cmpeq_epi8(v, _mm256_set1_epi8('"'));
+		m = _mm256_or_si256(m, _mm256_cmpeq_epi8(v, _mm256_set1_epi8('\\')));
 	}
-	memmove(p->buffer, p->buffer + size, p->size - size);
-	p->size -= size;
+	return _mm256_movemask_epi8(m);
 }
 
-static uint32_t parse_token(const char *pos, const char *end, struct token *out)
+enum { SCAN_STEP = 32 };
+
+#elif PARSER_SCAN == PARSER_SCAN_SSE2
+
+/** Same as the AVX2 one. */
+static inline uint32_t scan_mask(__m128i v, char quote)
 {
-	token_reset(out);
-	const char *begin = pos;
-	while (pos < end) {
-		if (!isspace(*pos))
-			break;
-		if (*pos == '\n') {
-			out->type = TOKEN_TYPE_NEW_LINE;
-			return pos + 1 - begin;
-		}
-		++pos;
+	__m128i m;
+	if (quote == 0) {
+		m = _mm_cmpeq_epi8(_mm_min_epu8(v, _mm_set1_epi8(' ')), v);
+		m = _mm_or_si128(m, _mm_cmpeq_epi8(v, _mm_set1_epi8('"')));
+		m = _mm_or_si128(m, _mm_cmpeq_epi8(v, _mm_set1_epi8('#')));
+		m = _mm_or_si128(m, _mm_cmpeq_epi8(v, _mm_set1_epi8('&')));
+		m = _mm_or_si128(m, _mm_cmpeq_epi8(v, _mm_set1_epi8('\'')));
+		m = _mm_or_si128(m, _mm_cmpeq_epi8(v, _mm_set1_epi8('>')));
+		m = _mm_or_si128(m, _mm_cmpeq_epi8(v, _mm_set1_epi8('\\')));
+		m = _mm_or_si128(m, _mm_cmpeq_epi8(v, _mm_set1_epi8('|')));
+	} else {
+		m = _mm_cmpeq_epi8(v, _mm_set1_epi8('"'));
+		m = _mm_or_si128(m, _mm_cmpeq_epi8(v, _mm_set1_epi8('\\')));
+	}
+	return _mm_movemask_epi8(m);
+}
+
+enum { SCAN_STEP = 16 };
+
+#endif
+
+/**
+ * Find where the plain bytes of a string end, in the string's
+ * @a quote or out of quotes.
+ */
+static uint32_t parser_scan_plain(const char *buf, uint32_t pos, uint32_t end, char quote)
+{
+	if (quote == '\'') {
+		const char *found = memchr(buf + pos, '\'', end - pos);
+		return found != NULL ? found - buf : end;
+	}
+#if PARSER_SCAN == PARSER_SCAN_AVX2
+	for (; pos + SCAN_STEP <= end; pos += SCAN_STEP) {
+		__m256i v = _mm256_loadu_si256((const __m256i *)(buf + pos));
+		uint32_t mask = scan_mask(v, quote);
+		if (mask != 0)
+			return pos + __builtin_ctz(mask);
+	}
+#elif PARSER_SCAN == PARSER_SCAN_SSE2
+	for (; pos + SCAN_STEP <= end; pos += SCAN_STEP) {
+		__m128i v = _mm_loadu_si128((const __m128i *)(buf + pos));
+		uint32_t mask = scan_mask(v, quote);
+		if (mask != 0)
+			return pos + __builtin_ctz(mask);
+	}
+#endif
+	if (quote == 0) {
+		while (pos < end && !parser_is_special[(unsigned char)buf[pos]])
+			++pos;
+	} else {
+		while (pos < end && buf[pos] != '"' && buf[pos] != '\\')
+			++pos;
+	}
+	return pos;
+}
+
+static enum token_type token_type_operator(char op, bool is_double)
+{
+	switch (op) {
+	case '&':
+		return is_double ? TOKEN_TYPE_AND : TOKEN_TYPE_BACKGROUND;
+	case '|':
+		return is_double ? TOKEN_TYPE_OR : TOKEN_TYPE_PIPE;
+	case '>':
+		return is_double ? TOKEN_TYPE_OUT_APPEND : TOKEN_TYPE_OUT_NEW;
+	default:
+		assert(false);
+		return TOKEN_TYPE_NONE;
 	}
-	char quote = 0;
+}
+
+/**
+ * Continue the scan from where it stopped.
+ * @retval true A token is read into @a out.
+ * @retval false Need more data.
+ */
+static bool parse_token(struct parser *p, struct token *out)
+{
+	char *buf = p->buffer;
+	uint32_t pos = p->pos;
+	uint32_t end = p->size;
 	while (pos < end) {
-		char c = *pos;
-		switch(c) {
-		case '\'':
-		case '"':
-			if (quote == 0) {
-				quote = c;
+		char c = buf[pos];
+		switch (p->token_state) {
+		case TOKEN_STATE_SPACE:
+			if (c == '\n') {
+				p->pos = pos + 1;
+				out->type = TOKEN_TYPE_NEW_LINE;
+				return true;
+			}
+			if (isspace((unsigned char)c)) {
 				++pos;
-				if (pos == end)
-					return 0;
 				continue;
 			}
-			if (quote != c)
-				goto append_and_next;
-			out->type = TOKEN_TYPE_STR;
-			return pos + 1 - begin;
-		case '\\':
-			if (quote == '\'')
-				goto append_and_next;
-			if (quote == '"') {
+			if (c == '#') {
+				p->token_state = TOKEN_STATE_COMMENT;
 				++pos;
-				if (pos == end)
-					return 0;
-				c = *pos;
-				switch (c)
-				{
-				case '\\':
-					goto append_and_next;
-				case '\n':
-					++pos;
-					continue;
-				case '"':
-					goto append_and_next;
-				default:
-					break;
-				}
-				token_append(out, '\\');
-				goto append_and_next;
+				continue;
 			}
-			assert(quote == 0);
-			++pos;
-			if (pos == end)
-				return 0;
-			c = *pos;
-			if (c == '\n') {
+			if (c == '&' || c == '|' || c == '>') {
+				p->op = c;
+				p->token_state = TOKEN_STATE_OPERATOR;
 				++pos;
 				continue;
 			}
-			goto append_and_next;
-		case '&':
-		case '|':
-		case '>':
-			if (quote != 0)
-				goto append_and_next;
-			if (out->size > 0) {
-				out->type = TOKEN_TYPE_STR;
-				return pos - begin;
+			p->token_begin = pos;
+			p->token_end = pos;
+			p->quote = 0;
+			p->token_state = TOKEN_STATE_STR;
+			continue;
+		case TOKEN_STATE_COMMENT: {
+			const char *eol = memchr(buf + pos, '\n', end - pos);
+			if (eol == NULL) {
+				pos = end;
+				continue;
+			}
+			p->token_state = TOKEN_STATE_SPACE;
+			p->pos = eol + 1 - buf;
+			out->type = TOKEN_TYPE_NEW_LINE;
+			return true;
+		}
+		case TOKEN_STATE_OPERATOR:
+			p->token_state = TOKEN_STATE_SPACE;
+			out->type = token_type_operator(p->op, c == p->op);
+			if (c == p->op)
+				++pos;
+			p->pos = pos;
+			return true;
+		case TOKEN_STATE_ESCAPE:
+			++pos;
+			if (c != '\n') {
+				buf[p->token_end++] = c;
+				p->token_state = TOKEN_STATE_STR;
+			} else if (p->token_end == p->token_begin) {
+				/* A line continuation before a token. */
+				p->token_state = TOKEN_STATE_SPACE;
+			} else {
+				p->token_state = TOKEN_STATE_STR;
 			}
+			continue;
+		case TOKEN_STATE_QUOTED_ESCAPE:
 			++pos;
+			p->token_state = TOKEN_STATE_STR;
+			switch (c) {
+			case '\n':
+				break;
+			case '\\':
+			case '"':
+				buf[p->token_end++] = c;
+				break;
+			default:
+				buf[p->token_end++] = '\\';
+				buf[p->token_end++] = c;
+				break;
+			}
+			continue;
+		case TOKEN_STATE_STR: {
+			uint32_t next = parser_scan_plain(buf, pos, end, p->quote);
+			if (p->token_end != pos)
+				memmove(buf + p->token_end, buf + pos, next - pos);
+			p->token_end += next - pos;
+			pos = next;
 			if (pos == end)
-				return 0;
-			if (*pos == c) {
-				switch(c) {
-				case '&':
-					out->type = TOKEN_TYPE_AND;
-					break;
-				case '|':
-					out->type = TOKEN_TYPE_OR;
-					break;
-				case '>':
-					out->type = TOKEN_TYPE_OUT_APPEND;
-					break;
-				default:
-					assert(false);
-					break;
-				}
+				continue;
+			c = buf[pos];
+			break;
+		}
+		}
+		switch (c) {
+		case '\'':
+		case '"':
+			if (p->quote == 0) {
+				p->quote = c;
 				++pos;
-			} else {
-				switch(c) {
-				case '&':
-					out->type = TOKEN_TYPE_BACKGROUND;
-					break;
-				case '|':
-					out->type = TOKEN_TYPE_PIPE;
-					break;
-				case '>':
-					out->type = TOKEN_TYPE_OUT_NEW;
-					break;
-				default:
-					assert(false);
-					break;
-				}
+				continue;
 			}
-			return pos - begin;
+			if (p->quote != c)
+				break;
+			p->pos = pos + 1;
+			goto return_str;
+		case '\\':
+			if (p->quote == '\'')
+				break;
+			p->token_state = p->quote == '"' ?
+					 TOKEN_STATE_QUOTED_ESCAPE :
+					 TOKEN_STATE_ESCAPE;
+			++pos;
+			continue;
+		case '&':
+		case '|':
+		case '>':
+		case '#':
+		case '\n':
+			if (p->quote != 0)
+				break;
+			p->pos = pos;
+			goto return_str;
 		case ' ':
 		case '\t':
 		case '\r':
-			if (quote != 0)
-				goto append_and_next;
-			assert(out->size > 0);
-			out->type = TOKEN_TYPE_STR;
-			return pos + 1 - begin;
-		case '\n':
-			if (quote != 0)
-				goto append_and_next;
-			assert(out->size > 0);
-			out->type = TOKEN_TYPE_STR;
-			return pos - begin;
-		case '#':
-			if (quote != 0)
-				goto append_and_next;
-			if (out->size > 0) {
-				out->type = TOKEN_TYPE_STR;
-				return pos - begin;
-			}
-			++pos;
-			while (pos < end) {
-				if (*pos == '\n') {
-					out->type = TOKEN_TYPE_NEW_LINE;
-					return pos + 1 - begin;
-				}
-				++pos;
-			}
-			return 0;
+			if (p->quote != 0)
+				break;
+			p->pos = pos + 1;
+			goto return_str;
 		default:
-			goto append_and_next;
+			break;
 		}
-	append_and_next:
-		token_append(out, c);
+		buf[p->token_end++] = c;
 		++pos;
 	}
-	return 0;
+	p->pos = pos;
+	return false;
+
+return_str:
+	p->token_state = TOKEN_STATE_SPACE;
+	out->type = TOKEN_TYPE_STR;
+	out->data = buf + p->token_begin;
+	out->size = p->token_end - p->token_begin;
+	return true;
 }
 
-enum parser_error parser_pop_next(struct parser *p, struct command_line **out)
+/** Add a token, but not a new line, to the current line. */
+static enum parser_error parser_add_token(struct parser *p, const struct token *token)
 {
-	struct command_line *line = calloc(1, sizeof(*line));
-	char *pos = p->buffer;
-	const char *begin = pos;
-	char *end = pos + p->size;
-	struct token token = {0};
-	enum parser_error res = PARSER_ERR_NONE;
-
-	while (pos < end) {
-		uint32_t used = parse_token(pos, end, &token);
-		if (used == 0)
-			goto return_no_line;
-		pos += used;
-		struct expr *e;
-		switch(token.type) {
-		case TOKEN_TYPE_STR:
-			if (line->tail != NULL && line->tail->type == EXPR_TYPE_COMMAND) {
-				command_append_arg(&line->tail->cmd, token_strdup(&token));
-				continue;
-			}
-			e = calloc(1, sizeof(*e));
-			e->type = EXPR_TYPE_COMMAND;
-			e->cmd.exe = token_strdup(&token);
-			command_line_append(line, e);
-			continue;
-		case TOKEN_TYPE_NEW_LINE:
-			/* Skip new lines. */
-			if (line->tail == NULL)
-				continue;
-			goto close_and_return;
-		case TOKEN_TYPE_PIPE:
-			if (line->tail == NULL) {
-				res = PARSER_ERR_PIPE_WITH_NO_LEFT_ARG;
-				goto return_error;
-			}
-			if (line->tail->type != EXPR_TYPE_COMMAND) {
-				res = PARSER_ERR_PIPE_WITH_LEFT_ARG_NOT_A_COMMAND;
-				goto return_error;
-			}
-			e = calloc(1, sizeof(*e));
-			e->type = EXPR_TYPE_PIPE;
-			command_line_append(line, e);
-			continue;
-		case TOKEN_TYPE_AND:
-			if (line->tail == NULL) {
-				res = PARSER_ERR_AND_WITH_NO_LEFT_ARG;
-				goto return_error;
-			}
-			if (line->tail->type != EXPR_TYPE_COMMAND) {
-				res = PARSER_ERR_AND_WITH_LEFT_ARG_NOT_A_COMMAND;
-				goto return_error;
-			}
-			e = calloc(1, sizeof(*e));
-			e->type = EXPR_TYPE_AND;
-			command_line_append(line, e);
-			continue;
-		case TOKEN_TYPE_OR:
-			if (line->tail == NULL) {
-				res = PARSER_ERR_OR_WITH_NO_LEFT_ARG;
-				goto return_error;
-			}
-			if (line->tail->type != EXPR_TYPE_COMMAND) {
-				res = PARSER_ERR_OR_WITH_LEFT_ARG_NOT_A_COMMAND;
-				goto return_error;
-			}
-			e = calloc(1, sizeof(*e));
-			e->type = EXPR_TYPE_OR;
-			command_line_append(line, e);
-			continue;
-		case TOKEN_TYPE_OUT_NEW:
-		case TOKEN_TYPE_OUT_APPEND:
-		case TOKEN_TYPE_BACKGROUND:
-			goto close_and_return;
-		default:
-			assert(false);
-		}
-	}
-	goto return_no_line;
-
-close_and_return:
-	if (token.type == TOKEN_TYPE_OUT_NEW || token.type == TOKEN_TYPE_OUT_APPEND)
-	{
-		if (token.type == TOKEN_TYPE_OUT_NEW)
-			line->out_type = OUTPUT_TYPE_FILE_NEW;
-		else
-			line->out_type = OUTPUT_TYPE_FILE_APPEND;
-		uint32_t used = parse_token(pos, end, &token);
-		if (used == 0)
-			goto return_no_line;
-		pos += used;
-		if (token.type != TOKEN_TYPE_STR) {
-			res = PARSER_ERR_OUTOUT_REDIRECT_BAD_ARG;
-			goto return_error;
-		}
-		line->out_file = token_strdup(&token);
-		used = parse_token(pos, end, &token);
-		if (used == 0)
-			goto return_no_line;
-		pos += used;
-	}
-	if (token.type == TOKEN_TYPE_BACKGROUND) {
+	struct command_line *line = p->line;
+	struct expr *e;
+	switch (p->line_state) {
+	case LINE_STATE_EXPRS:
+		break;
+	case LINE_STATE_OUT_FILE:
+		if (token->type != TOKEN_TYPE_STR)
+			return PARSER_ERR_OUTOUT_REDIRECT_BAD_ARG;
+		line->out_file = command_line_strdup(line, token);
+		p->line_state = LINE_STATE_OUT_DONE;
+		return PARSER_ERR_NONE;
+	case LINE_STATE_OUT_DONE:
+		if (token->type != TOKEN_TYPE_BACKGROUND)
+			return PARSER_ERR_TOO_LATE_ARGUMENTS;
 		line->is_background = true;
-		uint32_t used = parse_token(pos, end, &token);
-		if (used == 0)
-			goto return_no_line;
-		pos += used;
+		p->line_state = LINE_STATE_END;
+		return PARSER_ERR_NONE;
+	case LINE_STATE_END:
+		return PARSER_ERR_TOO_LATE_ARGUMENTS;
 	}
-	if (token.type == TOKEN_TYPE_NEW_LINE) {
-		assert(line->tail != NULL);
-		parser_consume(p, pos - begin);
-		if (line->tail->type != EXPR_TYPE_COMMAND) {
-			res = PARSER_ERR_ENDS_NOT_WITH_A_COMMAND;
-			goto return_no_line;
+	switch(token->type) {
+	case TOKEN_TYPE_STR:
+		if (line->tail != NULL && line->tail->type == EXPR_TYPE_COMMAND) {
+			command_append_arg(line, &line->tail->cmd,
+					   command_line_strdup(line, token));
+			return PARSER_ERR_NONE;
 		}
-		res = PARSER_ERR_NONE;
-		*out = line;
-		goto return_final;
+		e = command_line_new_expr(line, EXPR_TYPE_COMMAND);
+		e->cmd.exe = command_line_strdup(line, token);
+		command_line_append(line, e);
+		return PARSER_ERR_NONE;
+	case TOKEN_TYPE_PIPE:
+		if (line->tail == NULL)
+			return PARSER_ERR_PIPE_WITH_NO_LEFT_ARG;
+		if (line->tail->type != EXPR_TYPE_COMMAND)
+			return PARSER_ERR_PIPE_WITH_LEFT_ARG_NOT_A_COMMAND;
+		e = command_line_new_expr(line, EXPR_TYPE_PIPE);
+		command_line_append(line, e);
+		return PARSER_ERR_NONE;
+	case TOKEN_TYPE_AND:
+		if (line->tail == NULL)
+			return PARSER_ERR_AND_WITH_NO_LEFT_ARG;
+		if (line->tail->type != EXPR_TYPE_COMMAND)
+			return PARSER_ERR_AND_WITH_LEFT_ARG_NOT_A_COMMAND;
+		e = command_line_new_expr(line, EXPR_TYPE_AND);
+		command_line_append(line, e);
+		return PARSER_ERR_NONE;
+	case TOKEN_TYPE_OR:
+		if (line->tail == NULL)
+			return PARSER_ERR_OR_WITH_NO_LEFT_ARG;
+		if (line->tail->type != EXPR_TYPE_COMMAND)
+			return PARSER_ERR_OR_WITH_LEFT_ARG_NOT_A_COMMAND;
+		e = command_line_new_expr(line, EXPR_TYPE_OR);
+		command_line_append(line, e);
+		return PARSER_ERR_NONE;
+	case TOKEN_TYPE_OUT_NEW:
+		line->out_type = OUTPUT_TYPE_FILE_NEW;
+		p->line_state = LINE_STATE_OUT_FILE;
+		return PARSER_ERR_NONE;
+	case TOKEN_TYPE_OUT_APPEND:
+		line->out_type = OUTPUT_TYPE_FILE_APPEND;
+		p->line_state = LINE_STATE_OUT_FILE;
+		return PARSER_ERR_NONE;
+	case TOKEN_TYPE_BACKGROUND:
+		line->is_background = true;
+		p->line_state = LINE_STATE_END;
+		return PARSER_ERR_NONE;
+	default:
+		assert(false);
+		return PARSER_ERR_NONE;
 	}
-	res = PARSER_ERR_TOO_LATE_ARGUMENTS;
-	goto return_error;
-
-return_error:
-	/*
-	 * Try to skip the whole current line. It can't be executed but can't
-	 * just crash here because of that.
-	 */
-	while (pos < end) {
-		uint32_t used = parse_token(pos, end, &token);
-		if (used == 0)
-			break;
-		pos += used;
+}
+
+/** Drop the current line and return its error, if any. */
+static enum parser_error parser_drop_line(struct parser *p)
+{
+	enum parser_error res = p->error;
+	if (p->line != NULL)
+		command_line_delete(p->line);
+	p->line = NULL;
+	p->line_state = LINE_STATE_EXPRS;
+	p->error = PARSER_ERR_NONE;
+	return res;
+}
+
+enum parser_error parser_pop_next(struct parser *p, struct command_line **out)
+{
+	*out = NULL;
+	struct token token;
+	while (parse_token(p, &token)) {
 		if (token.type == TOKEN_TYPE_NEW_LINE) {
-			parser_consume(p, pos - begin);
-			goto return_no_line;
+			/* Skip new lines. */
+			if (p->line == NULL)
+				continue;
+			if (p->error != PARSER_ERR_NONE)
+				return parser_drop_line(p);
+			if (p->line_state == LINE_STATE_OUT_FILE) {
+				p->error = PARSER_ERR_OUTOUT_REDIRECT_BAD_ARG;
+				return parser_drop_line(p);
+			}
+			if (p->line->tail == NULL ||
+			    p->line->tail->type != EXPR_TYPE_COMMAND) {
+				p->error = PARSER_ERR_ENDS_NOT_WITH_A_COMMAND;
+				return parser_drop_line(p);
+			}
+			*out = p->line;
+			p->line = NULL;
+			p->line_state = LINE_STATE_EXPRS;
+			return PARSER_ERR_NONE;
 		}
+		if (p->line == NULL)
+			p->line = command_line_new();
+		/*
+		 * A broken line can't be executed, but can't just crash
+		 * here because of that. Its rest is skipped.
+		 */
+		if (p->error == PARSER_ERR_NONE)
+			p->error = parser_add_token(p, &token);
 	}
-	res = PARSER_ERR_NONE;
-	goto return_no_line;
-
-return_no_line:
-	command_line_delete(line);
-	*out = NULL;
-
-return_final:
-	free(token.data);
-	return res;
+	return PARSER_ERR_NONE;
 }
 
 void parser_delete(struct parser *p)
 {
+	if (p->line != NULL)
+		command_line_delete(p->line);
 	free(p->buffer);
 	free(p);
 }
@@ -3,6 +3,29 @@
 #include <stdbool.h>
 #include <stdint.h>
 
+/**
+ * Scanners of the plain bytes of the strings, selected via
+ * -DPARSER_SCAN=<scanner>. They find the next byte special for
+ * the tokenizer, so the bytes in between are copied in bulk.
+ *
+ * - SCALAR - a byte at a time, with a lookup table.
+ * - SSE2 - 16 bytes at a time. Always there on x86-64.
+ * - AVX2 - 32 bytes at a time. Needs -mavx2.
+ */
+#define PARSER_SCAN_SCALAR 0
+#define PARSER_SCAN_SSE2 1
+#define PARSER_SCAN_AVX2 2
+
+#ifndef PARSER_SCAN
+#if defined(__AVX2__)
+#define PARSER_SCAN PARSER_SCAN_AVX2
+#elif defined(__SSE2__)
+#define PARSER_SCAN PARSER_SCAN_SSE2
+#else
+#define PARSER_SCAN PARSER_SCAN_SCALAR
+#endif
+#endif
+
 struct parser;
 
 enum parser_error {
@@ -45,6 +68,20 @@ enum output_type {
 	OUTPUT_TYPE_FILE_APPEND,
 };
 
+/**
+ * Memory of a command line. Its exprs, strings and arrays are all
+ * in there and are freed together with the line. Most lines fit
+ * into the block allocated with the line itself.
+ */
+struct command_line_arena {
+	/** Free space of the last block. */
+	char *pos;
+	char *end;
+	uint32_t block_size;
+	/** The blocks allocated when the first one was not enough. */
+	void *blocks;
+};
+
 struct command_line {
 	struct expr *head;
 	struct expr *tail;
@@ -52,6 +89,7 @@ struct command_line {
 	/** Valid if the out type is FILE. */
 	char *out_file;
 	bool is_background;
+	struct command_line_arena arena;
 };
 
 void command_line_delete(struct command_line *line);
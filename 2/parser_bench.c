@@ -0,0 +1,182 @@
+#include "parser.h"
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+#ifdef BENCH_HEAP_HELP
+#include "heap_help.h"
+#endif
+
+/**
+ * Parser throughput on a big script, made of a tests.txt-style
+ * file repeated many times. It is fed in small chunks like the
+ * shell reads them, and all at once. Then the same for the lines
+ * with long arguments, where the string scan is the hot loop. See
+ * the Makefile's bench_parser target.
+ *
+ * With -DBENCH_HEAP_HELP and utils/heap_help linked in it also
+ * counts the heap allocations per parsed line. Then the timings
+ * are of no use, heap_help is slow.
+ */
+
+#if PARSER_SCAN == PARSER_SCAN_AVX2
+#define BENCH_SCAN_NAME "avx2"
+#elif PARSER_SCAN == PARSER_SCAN_SSE2
+#define BENCH_SCAN_NAME "sse2"
+#else
+#define BENCH_SCAN_NAME "scalar"
+#endif
+
+enum {
+#ifdef BENCH_HEAP_HELP
+	BENCH_SCRIPT_SIZE = 4 * 1024 * 1024,
+#else
+	BENCH_SCRIPT_SIZE = 64 * 1024 * 1024,
+#endif
+	BENCH_CHUNK_SIZE = 4096,
+	BENCH_LONG_ARG_SIZE = 4000,
+};
+
+static uint64_t
+bench_now_ns(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/** Heap allocations done so far, where they are counted. */
+static uint64_t
+bench_alloc_count(void)
+{
+#ifdef BENCH_HEAP_HELP
+	return heaph_get_alloc_count_total();
+#else
+	return 0;
+#endif
+}
+
+/** CPU cycles, where they can be read cheaply. */
+static uint64_t
+bench_now_cycles(void)
+{
+#if defined(__x86_64__) || defined(__i386__)
+	return __rdtsc();
+#else
+	return 0;
+#endif
+}
+
+static char *
+bench_script_new(const char *path, uint32_t *size)
+{
+	FILE *f = fopen(path, "r");
+	if (f == NULL) {
+		perror(path);
+		exit(1);
+	}
+	fseek(f, 0, SEEK_END);
+	long file_size = ftell(f);
+	fseek(f, 0, SEEK_SET);
+	char *file = malloc(file_size);
+	if (fread(file, 1, file_size, f) != (size_t)file_size)
+		abort();
+	fclose(f);
+
+	uint32_t count = BENCH_SCRIPT_SIZE / file_size;
+	char *script = malloc(file_size * count);
+	for (uint32_t i = 0; i < count; ++i)
+		memcpy(script + i * file_size, file, file_size);
+	free(file);
+	*size = file_size * count;
+	return script;
+}
+
+/** Lines of a long plain argument and a long quoted one. */
+static char *
+bench_long_args_new(uint32_t *size)
+{
+	char line[BENCH_LONG_ARG_SIZE * 2 + 16];
+	int len = sprintf(line, "echo ");
+	for (int i = 0; i < BENCH_LONG_ARG_SIZE; ++i)
+		line[len++] = 'a' + i % 26;
+	line[len++] = ' ';
+	line[len++] = '"';
+	for (int i = 0; i < BENCH_LONG_ARG_SIZE; ++i)
+		line[len++] = i % 8 == 7 ? ' ' : 'a' + i % 26;
+	line[len++] = '"';
+	line[len++] = '\n';
+
+	uint32_t count = BENCH_SCRIPT_SIZE / len;
+	char *script = malloc(len * count);
+	for (uint32_t i = 0; i < count; ++i)
+		memcpy(script + i * len, line, len);
+	*size = len * count;
+	return script;
+}
+
+static uint64_t
+bench_pop_all(struct parser *p)
+{
+	uint64_t count = 0;
+	while (true) {
+		struct command_line *line = NULL;
+		enum parser_error err = parser_pop_next(p, &line);
+		if (err != PARSER_ERR_NONE) {
+			++count;
+			continue;
+		}
+		if (line == NULL)
+			return count;
+		command_line_delete(line);
+		++count;
+	}
+}
+
+static void
+bench_parse(const char *script, uint32_t size, uint32_t chunk_size,
+	    const char *name)
+{
+	struct parser *p = parser_new();
+	uint64_t line_count = 0;
+	uint64_t start_allocs = bench_alloc_count();
+	uint64_t start = bench_now_ns();
+	uint64_t start_cycles = bench_now_cycles();
+	for (uint32_t pos = 0; pos < size; pos += chunk_size) {
+		uint32_t len = size - pos < chunk_size ? size - pos : chunk_size;
+		parser_feed(p, script + pos, len);
+		line_count += bench_pop_all(p);
+	}
+	uint64_t cycles = bench_now_cycles() - start_cycles;
+	uint64_t duration = bench_now_ns() - start;
+	uint64_t allocs = bench_alloc_count() - start_allocs;
+	parser_delete(p);
+	printf("%s %s: %.1f MB/s, %.0f lines/s", BENCH_SCAN_NAME, name,
+		(double)size * 1000000000 / duration / (1024 * 1024),
+		(double)line_count * 1000000000 / duration);
+	if (cycles != 0)
+		printf(", %.2f bytes/cycle", (double)size / cycles);
+	if (allocs != 0)
+		printf(", %.2f allocs/line", (double)allocs / line_count);
+	printf("\n");
+}
+
+int
+main(int argc, char **argv)
+{
+	const char *path = argc > 1 ? argv[1] : "tests.txt";
+	uint32_t size;
+	char *script = bench_script_new(path, &size);
+	bench_parse(script, size, BENCH_CHUNK_SIZE, "4 KB chunks");
+	bench_parse(script, size, size, "one feed");
+	free(script);
+	script = bench_long_args_new(&size);
+	bench_parse(script, size, BENCH_CHUNK_SIZE, "long args");
+	free(script);
+	return 0;
+}
@@ -773,6 +773,56 @@ test_background(void)
 	unit_test_finish();
 }
 
+static void
+test_many_lines(void)
+{
+	unit_test_start();
+	struct parser *p = parser_new();
+	struct command_line *line = NULL;
+	const char *str = "echo 'a b' \"c\\\"d\" e\\ f | grep x > out\n";
+	uint32_t len = strlen(str);
+	enum { COUNT = 10000 };
+
+	unit_msg("many lines in one feed");
+	char *buf = malloc(len * COUNT);
+	for (int i = 0; i < COUNT; ++i)
+		memcpy(buf + i * len, str, len);
+	parser_feed(p, buf, len * COUNT);
+	free(buf);
+	int count = 0;
+	while (true) {
+		unit_fail_if(parser_pop_next(p, &line) != PARSER_ERR_NONE);
+		if (line == NULL)
+			break;
+		struct expr *e = line->head;
+		unit_fail_if(strcmp(e->cmd.exe, "echo") != 0);
+		unit_fail_if(e->cmd.arg_count != 3);
+		unit_fail_if(strcmp(e->cmd.args[0], "a b") != 0);
+		unit_fail_if(strcmp(e->cmd.args[1], "c\"d") != 0);
+		unit_fail_if(strcmp(e->cmd.args[2], "e f") != 0);
+		unit_fail_if(strcmp(line->out_file, "out") != 0);
+		command_line_delete(line);
+		++count;
+	}
+	unit_check(count == COUNT, "all lines are parsed");
+
+	unit_msg("a line split between the feeds at each byte");
+	for (uint32_t i = 1; i < len; ++i) {
+		parser_feed(p, str, i);
+		unit_fail_if(parser_pop_next(p, &line) != PARSER_ERR_NONE);
+		unit_fail_if(line != NULL);
+		parser_feed(p, str + i, len - i);
+		unit_fail_if(parser_pop_next(p, &line) != PARSER_ERR_NONE);
+		unit_fail_if(line == NULL);
+		unit_fail_if(strcmp(line->head->cmd.args[1], "c\"d") != 0);
+		command_line_delete(line);
+	}
+	unit_check(true, "all splits are parsed");
+
+	parser_delete(p);
+	unit_test_finish();
+}
+
 static void
 test_error_one(struct parser *p, const char *expr, enum parser_error err)
 {
@@ -834,5 +884,6 @@ main(void)
 	test_logical_operators();
 	test_background();
 	test_errors();
+	test_many_lines();
 	return 0;
 }
@@ -1,3 +1,6 @@
+#define _GNU_SOURCE
+#include "exe_cache.h"
+#include "launcher.h"
 #include "parser.h"
 
 #include <assert.h>
@@ -44,35 +47,54 @@ static int execute_cd(const struct command *cmd)
         return 1;
 }
 
-static bool command_existence(const char *cmd)
+/** `hash` prints the found exes, `hash -r` forgets them, `hash name` finds one. */
+static int execute_hash(const struct command *cmd)
 {
-	if (strchr(cmd, '/') != NULL) return access(cmd, X_OK) == 0;
-
-	const char *cmd_path = getenv("PATH");
-	if (cmd_path == NULL) return false;
-
-	bool access_to_path = false;
-	char *path_copy = strdup(cmd_path);
-	char *dir = strtok(path_copy, ":");
-
-
-	while (dir != NULL)
+	if (cmd->arg_count == 0)
 	{
-		char full_path[4096];
-		snprintf(full_path, 4096, "%s/%s", dir, cmd);
-
-		if (access(full_path, X_OK) == 0)
-		{
-			access_to_path = true;
-			break;
-		}
-
-		dir = strtok(NULL, ":");
+		exe_cache_print(stdout);
+		fflush(stdout);
+		return 0;
 	}
+	int status = 0;
+	for (uint32_t i = 0; i < cmd->arg_count; i++)
+	{
+		if (strcmp(cmd->args[i], "-r") == 0)
+			exe_cache_clear();
+		else if (exe_cache_find(cmd->args[i]) == NULL)
+			status = 1;
+	}
+	return status;
+}
 
-	free(path_copy);
+/**
+ * The builtins are not exes, so can't go through launch_start(). They
+ * run in the shell itself, or in a forked one when in a pipeline or
+ * with a redirect.
+ */
+static bool is_builtin(const struct command *cmd)
+{
+	return strcmp(cmd->exe, "exit") == 0 || strcmp(cmd->exe, "cd") == 0 ||
+	       strcmp(cmd->exe, "hash") == 0;
+}
 
-	return access_to_path;
+/** Start the exe found via the cache. A stale one is searched again next time. */
+static pid_t launch_command(struct launch *l)
+{
+	l->path = exe_cache_find(l->cmd->exe);
+	pid_t pid;
+	enum launch_error err = launch_start(l, &pid);
+	if (err == LAUNCH_ERR_EXEC && l->path != NULL)
+		exe_cache_forget(l->cmd->exe);
+	return pid;
+}
+
+static int wait_status(pid_t pid)
+{
+	if (pid < 0) return 1;
+	int ret_status;
+	waitpid(pid, &ret_status, 0);
+	return WEXITSTATUS(ret_status);
 }
 
 static bool is_pipeline(const struct command_line *line)
@@ -103,43 +125,17 @@ static int execute_command(const struct command *cmd)
 	{
 		return execute_cd(cmd);
 	}
-	else if (!command_existence(cmd->exe))
+	else if (strcmp(cmd->exe, "hash") == 0)
 	{
-		return 1;
-	}
-
-	pid_t pid = fork();
-
-	if (pid < 0) return 1;
-
-	if (pid == 0)
-	{
-		shut_down_error_messages();
-
-		//Выделение памяти размера, соответствующего кол-ву аргументов + NULL и имя команды
-		char **args = malloc((cmd->arg_count + 2)*sizeof(char*));
-		if (args == NULL) exit(1);
-
-		args[0] = cmd->exe;
-
-		for (uint32_t i = 1; i < cmd->arg_count + 1; i++)
-		{
-			args[i] = cmd->args[i-1];
-		}
-
-		args[cmd->arg_count + 1] = NULL;
-
-		execvp(cmd->exe, args);
-		free(args);
-		exit(1);
-	}
-	else
-	{
-		int ret_status;
-		waitpid(pid, &ret_status, 0);
-		return WEXITSTATUS(ret_status);
+		return execute_hash(cmd);
 	}
 
+	struct launch l = {
+		.cmd = cmd,
+		.in_fd = -1,
+		.out_fd = -1,
+	};
+	return wait_status(launch_command(&l));
 }
 
 static int execute_piped_command(const struct command_line *line)
@@ -173,10 +169,12 @@ static int execute_piped_command(const struct command_line *line)
 
 	for (int i = 0; i < cmd_count; i++) {
 		if (i < cmd_count - 1) {
-			if (pipe(pipefd[i % 2]) < 0) {
+			/* Only the dup2-ed ends get into the exes. */
+			if (pipe2(pipefd[i % 2], O_CLOEXEC) < 0) {
 				perror("pipe");
 				for (int j = 0; j < i; j++) {
-					kill(pids[j], SIGTERM);
+					if (pids[j] > 0)
+						kill(pids[j], SIGTERM);
 				}
 				free(pids);
 				free(commands);
@@ -184,10 +182,29 @@ static int execute_piped_command(const struct command_line *line)
 			}
 		}
 
+		if (!is_builtin(&commands[i])) {
+			struct launch l = {
+				.cmd = &commands[i],
+				.in_fd = i > 0 ? pipefd[(i + 1) % 2][0] : -1,
+				.out_fd = i < cmd_count - 1 ? pipefd[i % 2][1] : -1,
+				.out_file = line->out_type != OUTPUT_TYPE_STDOUT ?
+					    line->out_file : NULL,
+				.is_append = line->out_type == OUTPUT_TYPE_FILE_APPEND,
+			};
+			/* Not started is like failed to exec, status 1. */
+			pids[i] = launch_command(&l);
+			if (i > 0) {
+				close(pipefd[(i + 1) % 2][0]);
+				close(pipefd[(i + 1) % 2][1]);
+			}
+			continue;
+		}
+
 		pids[i] = fork();
 		if (pids[i] < 0) {
 			for (int j = 0; j < i; j++) {
-				kill(pids[j], SIGTERM);
+				if (pids[j] > 0)
+					kill(pids[j], SIGTERM);
 			}
 			if (i < cmd_count - 1) {
 				close(pipefd[i % 2][0]);
@@ -227,29 +244,7 @@ static int execute_piped_command(const struct command_line *line)
 				close(pipefd[(i + 1) % 2][1]);
 			}
 
-			if (strcmp(commands[i].exe, "exit") == 0) {
-				execute_exit(&commands[i]);
-			}
-
-			if (strcmp(commands[i].exe, "cd") == 0) {
-				exit(execute_cd(&commands[i]));
-			}
-
-			char **args = malloc(sizeof(char *) * (commands[i].arg_count + 2));
-			if (args == NULL) {
-				exit(1);
-			}
-			args[0] = commands[i].exe;
-			for (uint32_t j = 0; j < commands[i].arg_count; j++) {
-				args[j + 1] = commands[i].args[j];
-			}
-			args[commands[i].arg_count + 1] = NULL;
-
-			shut_down_error_messages();
-
-			execvp(commands[i].exe, args);
-			free(args);
-			exit(1);
+			exit(execute_command(&commands[i]));
 		}
 
 		if (i > 0) {
@@ -260,10 +255,9 @@ static int execute_piped_command(const struct command_line *line)
 
 	int status = 0;
 	for (int i = 0; i < cmd_count; i++) {
-		int cmd_status;
-		waitpid(pids[i], &cmd_status, 0);
+		int cmd_status = wait_status(pids[i]);
 		if (strcmp(commands[i].exe, "exit") == 0 || i == cmd_count - 1) {
-			status = WEXITSTATUS(cmd_status);
+			status = cmd_status;
 		}
 	}
 	free(pids);
@@ -281,7 +275,7 @@ static int execute_command_line(const struct command_line *line)
 	{
 		execute_exit(&e->cmd);
 	}
-	else if (e->type == EXPR_TYPE_COMMAND && strcmp(e->cmd.exe, "cd") == 0 && e->next == NULL &&
+	else if (e->type == EXPR_TYPE_COMMAND && is_builtin(&e->cmd) && e->next == NULL &&
 	 line->out_type == OUTPUT_TYPE_STDOUT)
 	{
 		return execute_command(&e->cmd);
@@ -290,6 +284,17 @@ static int execute_command_line(const struct command_line *line)
 	{
 		return execute_piped_command(line);
 	}
+	else if (line->out_type != OUTPUT_TYPE_STDOUT && !is_builtin(&e->cmd))
+	{
+		struct launch l = {
+			.cmd = &e->cmd,
+			.in_fd = -1,
+			.out_fd = -1,
+			.out_file = line->out_file,
+			.is_append = line->out_type == OUTPUT_TYPE_FILE_APPEND,
+		};
+		return wait_status(launch_command(&l));
+	}
 	else if (line->out_type != OUTPUT_TYPE_STDOUT)
 	{
 		/* Создаём новый процесс */
@@ -380,6 +385,7 @@ int main(void)
 	}
 	
 	parser_delete(p);
+	exe_cache_destroy();
 	
 	return ret_status;
 }